@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2026 The drv-netif-netmap contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Steer the traffic of a NIC onto the ring pairs that rump kernel
+ * processes have claimed with "rings=" in their link strings (Linux,
+ * through the ethtool ioctl; needs CAP_NET_ADMIN):
+ *
+ *	nmsteer eth0 show		rings and RSS indirection table
+ *	nmsteer eth0 rss 0-7		spread RSS evenly over rings 0-7
+ *	nmsteer eth0 flow tcp 80 2	TCP to port 80 on ring 2
+ *	nmsteer eth0 del 1023		remove the flow rule at 1023
+ *
+ * With e.g. "eth0,rings=0-3" and "eth0,rings=4-7" in two processes,
+ * "rss 0-7" gives each of them half of the flows, always the same
+ * ones.  Flow rules take precedence over RSS.
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include <net/if.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+
+static int s;
+static const char *ifname;
+
+static void
+ethtool(void *cmd, const char *what)
+{
+	struct ifreq ifr;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, IFNAMSIZ-1);
+	ifr.ifr_data = cmd;
+	if (ioctl(s, SIOCETHTOOL, &ifr) == -1)
+		err(1, "%s: %s", ifname, what);
+}
+
+static uint64_t
+rxrings(void)
+{
+	struct ethtool_rxnfc nfc;
+
+	memset(&nfc, 0, sizeof(nfc));
+	nfc.cmd = ETHTOOL_GRXRINGS;
+	ethtool(&nfc, "ETHTOOL_GRXRINGS");
+	return nfc.data;
+}
+
+static struct ethtool_rxfh_indir *
+getindir(void)
+{
+	struct ethtool_rxfh_indir hdr, *ind;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.cmd = ETHTOOL_GRXFHINDIR;
+	ethtool(&hdr, "ETHTOOL_GRXFHINDIR");
+	if (hdr.size == 0)
+		errx(1, "%s: no RSS indirection table", ifname);
+	ind = calloc(1, sizeof(*ind) + hdr.size * sizeof(ind->ring_index[0]));
+	if (ind == NULL)
+		err(1, "calloc");
+	ind->cmd = ETHTOOL_GRXFHINDIR;
+	ind->size = hdr.size;
+	ethtool(ind, "ETHTOOL_GRXFHINDIR");
+	return ind;
+}
+
+static void
+show(void)
+{
+	struct ethtool_rxfh_indir *ind;
+	uint32_t i;
+
+	printf("%s: %llu rx rings\n", ifname, (unsigned long long)rxrings());
+	ind = getindir();
+	for (i = 0; i < ind->size; i++)
+		printf("%s%3u", i % 16 ? " " : i ? "\n" : "", ind->ring_index[i]);
+	printf("\n");
+	free(ind);
+}
+
+static unsigned long
+number(const char *str, unsigned long max, const char *what)
+{
+	unsigned long v;
+	char *ep;
+
+	v = strtoul(str, &ep, 10);
+	if (ep == str || *ep != '\0' || v > max)
+		errx(1, "bad %s %s", what, str);
+	return v;
+}
+
+static void
+rss(const char *range)
+{
+	struct ethtool_rxfh_indir *ind;
+	unsigned long first, last;
+	const char *p = range;
+	char *ep;
+	uint32_t i;
+
+	first = last = strtoul(p, &ep, 10);
+	if (ep != p && *ep == '-') {
+		p = ep + 1;
+		last = strtoul(p, &ep, 10);
+	}
+	if (ep == p || *ep != '\0')
+		errx(1, "bad ring range %s", range);
+	if (last < first || last >= rxrings())
+		errx(1, "%s: no rings %s", ifname, range);
+
+	ind = getindir();
+	for (i = 0; i < ind->size; i++)
+		ind->ring_index[i] = first + i % (last - first + 1);
+	ind->cmd = ETHTOOL_SRXFHINDIR;
+	ethtool(ind, "ETHTOOL_SRXFHINDIR");
+	free(ind);
+}
+
+static void
+flow(const char *proto, const char *port, const char *ring)
+{
+	struct ethtool_rxnfc nfc;
+
+	memset(&nfc, 0, sizeof(nfc));
+	nfc.cmd = ETHTOOL_SRXCLSRLINS;
+	if (strcmp(proto, "tcp") == 0)
+		nfc.fs.flow_type = TCP_V4_FLOW;
+	else if (strcmp(proto, "udp") == 0)
+		nfc.fs.flow_type = UDP_V4_FLOW;
+	else
+		errx(1, "protocol must be tcp or udp");
+	nfc.fs.h_u.tcp_ip4_spec.pdst = htons(number(port, 65535, "port"));
+	nfc.fs.m_u.tcp_ip4_spec.pdst = 0xffff;
+	nfc.fs.ring_cookie = number(ring, rxrings() - 1, "ring");
+	nfc.fs.location = RX_CLS_LOC_ANY;
+	ethtool(&nfc, "ETHTOOL_SRXCLSRLINS");
+	printf("%s: rule %u\n", ifname, nfc.fs.location);
+}
+
+static void
+del(const char *loc)
+{
+	struct ethtool_rxnfc nfc;
+
+	memset(&nfc, 0, sizeof(nfc));
+	nfc.cmd = ETHTOOL_SRXCLSRLDEL;
+	nfc.fs.location = number(loc, UINT32_MAX, "rule");
+	ethtool(&nfc, "ETHTOOL_SRXCLSRLDEL");
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	if (argc < 3) {
+ usage:
+		fprintf(stderr, "usage: %s ifname show | rss first[-last] | "
+		    "flow tcp|udp port ring | del rule\n", argv[0]);
+		exit(1);
+	}
+	ifname = argv[1];
+	if ((s = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		err(1, "socket");
+
+	if (strcmp(argv[2], "show") == 0 && argc == 3)
+		show();
+	else if (strcmp(argv[2], "rss") == 0 && argc == 4)
+		rss(argv[3]);
+	else if (strcmp(argv[2], "flow") == 0 && argc == 6)
+		flow(argv[3], argv[4], argv[5]);
+	else if (strcmp(argv[2], "del") == 0 && argc == 4)
+		del(argv[3]);
+	else
+		goto usage;
+	return 0;
+}
@@ -0,0 +1,459 @@
+/*
+ * Copyright (c) 2026 The drv-netif-netmap contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Minimal vhost-user device for trying out libvhostif without a
+ * software switch: listens on a unix socket, serves one driver and
+ * bridges its virtqueues to a Linux tap device, virtio-net headers
+ * and all.  Not a reference implementation; only the messages
+ * libvhostif sends are understood.
+ *
+ *	vhostdev /tmp/vhost.sock tap0
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <net/if.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/if_tun.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_net.h>
+#include <linux/virtio_ring.h>
+
+#define GET_FEATURES	1
+#define SET_FEATURES	2
+#define SET_MEM_TABLE	5
+#define SET_VRING_NUM	8
+#define SET_VRING_ADDR	9
+#define SET_VRING_KICK	12
+#define SET_VRING_CALL	13
+
+#define MAXREGIONS	8
+#define MAXFRAME	(65536 + 2048)
+
+struct msg {
+	uint32_t request;
+	uint32_t flags;
+	uint32_t size;
+	union {
+		uint64_t u64;
+		struct {
+			uint32_t index;
+			uint32_t num;
+		} state;
+		struct {
+			uint32_t index;
+			uint32_t flags;
+			uint64_t desc;
+			uint64_t used;
+			uint64_t avail;
+			uint64_t log;
+		} addr;
+		struct {
+			uint32_t nregions;
+			uint32_t padding;
+			struct {
+				uint64_t gpa;
+				uint64_t size;
+				uint64_t uaddr;
+				uint64_t mmapoff;
+			} regions[MAXREGIONS];
+		} mem;
+	} u;
+} __attribute__((__packed__));
+#define HDRSZ offsetof(struct msg, u)
+
+#define F(b)	((uint64_t)1 << (b))
+static const uint64_t features =
+    F(VIRTIO_F_VERSION_1) | F(VIRTIO_F_ANY_LAYOUT) |
+    F(VIRTIO_NET_F_MRG_RXBUF) |
+    F(VIRTIO_NET_F_CSUM) | F(VIRTIO_NET_F_GUEST_CSUM) |
+    F(VIRTIO_NET_F_HOST_TSO4) | F(VIRTIO_NET_F_HOST_TSO6) |
+    F(VIRTIO_NET_F_GUEST_TSO4) | F(VIRTIO_NET_F_GUEST_TSO6);
+
+static struct {
+	uint64_t gpa, size, uaddr;
+	uint8_t *va;
+} regions[MAXREGIONS];
+static unsigned nregions;
+
+/* index 0 is the driver's rx (our tx), 1 its tx */
+static struct vq {
+	unsigned num;
+	struct vring_desc *desc;
+	struct vring_avail *avail;
+	struct vring_used *used;
+	uint16_t lastavail;
+	int kickfd, callfd;
+} vqs[2] = { { .kickfd = -1, .callfd = -1 }, { .kickfd = -1, .callfd = -1 } };
+
+static uint64_t negotiated;
+static size_t hdrsz;
+static int tapfd;
+
+static void *
+gpa2va(uint64_t gpa, uint32_t len)
+{
+	unsigned i;
+
+	for (i = 0; i < nregions; i++)
+		if (gpa >= regions[i].gpa
+		    && gpa + len <= regions[i].gpa + regions[i].size)
+			return regions[i].va + (gpa - regions[i].gpa);
+	errx(1, "descriptor address 0x%llx out of bounds",
+	    (unsigned long long)gpa);
+}
+
+static void *
+uaddr2va(uint64_t uaddr)
+{
+	unsigned i;
+
+	for (i = 0; i < nregions; i++)
+		if (uaddr >= regions[i].uaddr
+		    && uaddr < regions[i].uaddr + regions[i].size)
+			return regions[i].va + (uaddr - regions[i].uaddr);
+	errx(1, "ring address 0x%llx not in any region",
+	    (unsigned long long)uaddr);
+}
+
+static int
+recvmsgfds(int s, struct msg *m, int *fds, int *nfds)
+{
+	char cbuf[CMSG_SPACE(MAXREGIONS * sizeof(int))];
+	struct msghdr mh;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	ssize_t nn;
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = m;
+	iov.iov_len = HDRSZ;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+	if ((nn = recvmsg(s, &mh, MSG_WAITALL)) <= 0)
+		return -1;
+	if (nn != HDRSZ || m->size > sizeof(m->u))
+		errx(1, "bad message");
+
+	*nfds = 0;
+	for (cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+			*nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cm), *nfds * sizeof(int));
+		}
+	}
+	if (m->size && recv(s, &m->u, m->size, MSG_WAITALL) != m->size)
+		return -1;
+	return 0;
+}
+
+static void
+setuptap(void)
+{
+	unsigned off = 0;
+	int sz = hdrsz;
+
+	if (ioctl(tapfd, TUNSETVNETHDRSZ, &sz) == -1)
+		err(1, "TUNSETVNETHDRSZ");
+	if (negotiated & F(VIRTIO_NET_F_CSUM))
+		off |= TUN_F_CSUM;
+	if (negotiated & F(VIRTIO_NET_F_GUEST_TSO4))
+		off |= TUN_F_TSO4;
+	if (negotiated & F(VIRTIO_NET_F_GUEST_TSO6))
+		off |= TUN_F_TSO6;
+	if (ioctl(tapfd, TUNSETOFFLOAD, off) == -1)
+		err(1, "TUNSETOFFLOAD");
+}
+
+/* returns 1 once both rings are ready to go */
+static int
+handlemsg(int s)
+{
+	struct msg m;
+	struct vq *vq;
+	int fds[MAXREGIONS], nfds, i;
+
+	memset(&m, 0, sizeof(m));
+	if (recvmsgfds(s, &m, fds, &nfds) == -1)
+		errx(1, "driver went away");
+
+	switch (m.request) {
+	case GET_FEATURES:
+		m.flags = 0x1 | 0x4;
+		m.size = sizeof(m.u.u64);
+		m.u.u64 = features;
+		if (write(s, &m, HDRSZ + m.size) != (ssize_t)(HDRSZ + m.size))
+			err(1, "reply");
+		break;
+	case SET_FEATURES:
+		negotiated = m.u.u64;
+		hdrsz = (negotiated & (F(VIRTIO_F_VERSION_1)
+		    | F(VIRTIO_NET_F_MRG_RXBUF)))
+		    ? sizeof(struct virtio_net_hdr_mrg_rxbuf)
+		    : sizeof(struct virtio_net_hdr);
+		setuptap();
+		break;
+	case SET_MEM_TABLE:
+		if (m.u.mem.nregions > MAXREGIONS
+		    || (int)m.u.mem.nregions != nfds)
+			errx(1, "bad memory table");
+		for (i = 0; i < nfds; i++) {
+			regions[i].gpa = m.u.mem.regions[i].gpa;
+			regions[i].size = m.u.mem.regions[i].size;
+			regions[i].uaddr = m.u.mem.regions[i].uaddr;
+			regions[i].va = mmap(NULL,
+			    m.u.mem.regions[i].size + m.u.mem.regions[i].mmapoff,
+			    PROT_READ | PROT_WRITE, MAP_SHARED, fds[i], 0);
+			if (regions[i].va == MAP_FAILED)
+				err(1, "mmap region");
+			regions[i].va += m.u.mem.regions[i].mmapoff;
+			close(fds[i]);
+		}
+		nregions = nfds;
+		break;
+	case SET_VRING_NUM:
+		vqs[m.u.state.index & 1].num = m.u.state.num;
+		break;
+	case SET_VRING_ADDR:
+		vq = &vqs[m.u.addr.index & 1];
+		vq->desc = uaddr2va(m.u.addr.desc);
+		vq->avail = uaddr2va(m.u.addr.avail);
+		vq->used = uaddr2va(m.u.addr.used);
+		break;
+	case SET_VRING_KICK:
+	case SET_VRING_CALL:
+		if (nfds != 1)
+			errx(1, "missing eventfd");
+		vq = &vqs[m.u.u64 & 1];
+		if (m.request == SET_VRING_KICK)
+			vq->kickfd = fds[0];
+		else
+			vq->callfd = fds[0];
+		break;
+	default:
+		/* SET_OWNER, SET_VRING_BASE (always 0 from libvhostif) */
+		break;
+	}
+
+	return vqs[0].kickfd != -1 && vqs[1].kickfd != -1
+	    && vqs[0].callfd != -1 && vqs[1].callfd != -1;
+}
+
+static void
+notify(struct vq *vq)
+{
+	uint64_t one = 1;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if ((vq->avail->flags & VRING_AVAIL_F_NO_INTERRUPT) == 0)
+		(void)write(vq->callfd, &one, sizeof(one));
+}
+
+/*
+ * Fill the n'th used entry past the published index.  The entries
+ * become visible to the driver only with pubused().
+ */
+static void
+putused(struct vq *vq, uint16_t n, uint16_t head, uint32_t len)
+{
+	struct vring_used_elem *ue;
+
+	ue = &vq->used->ring[(uint16_t)(vq->used->idx + n) % vq->num];
+	ue->id = head;
+	ue->len = len;
+}
+
+static void
+pubused(struct vq *vq, uint16_t n)
+{
+
+	__atomic_store_n(&vq->used->idx, vq->used->idx + n, __ATOMIC_RELEASE);
+}
+
+/* driver tx -> tap */
+static void
+drivertx(void)
+{
+	struct vq *vq = &vqs[1];
+	struct iovec iov[64];
+	struct vring_desc *d;
+	uint16_t availidx, head, i;
+	int niov, n = 0;
+
+	availidx = __atomic_load_n(&vq->avail->idx, __ATOMIC_ACQUIRE);
+	for (; vq->lastavail != availidx; vq->lastavail++, n++) {
+		head = vq->avail->ring[vq->lastavail % vq->num];
+		for (i = head, niov = 0; niov < 64; i = d->next) {
+			d = &vq->desc[i];
+			iov[niov].iov_base = gpa2va(d->addr, d->len);
+			iov[niov].iov_len = d->len;
+			niov++;
+			if ((d->flags & VRING_DESC_F_NEXT) == 0)
+				break;
+		}
+		if (writev(tapfd, iov, niov) == -1 && errno != EAGAIN)
+			warn("tap write");
+		putused(vq, 0, head, 0);
+		pubused(vq, 1);
+	}
+	if (n)
+		notify(vq);
+}
+
+static uint8_t frame[MAXFRAME];
+
+/*
+ * tap -> driver rx.  Frames are read only when the driver has made
+ * buffers available, and a large frame is spread over as many
+ * buffers as it needs (num_buffers) when they are mergeable.
+ */
+static int
+driverrx(void)
+{
+	struct vq *vq = &vqs[0];
+	struct virtio_net_hdr_mrg_rxbuf *hdr;
+	struct vring_desc *d;
+	uint16_t availidx, head, nbufs;
+	ssize_t nn, off, n;
+	int frames = 0;
+
+	for (;;) {
+		availidx = __atomic_load_n(&vq->avail->idx, __ATOMIC_ACQUIRE);
+		if (vq->lastavail == availidx)
+			break;
+		if ((nn = read(tapfd, frame, sizeof(frame))) <= 0)
+			break;
+
+		hdr = NULL;
+		nbufs = 0;
+		for (off = 0; off < nn && vq->lastavail != availidx;
+		    vq->lastavail++) {
+			head = vq->avail->ring[vq->lastavail % vq->num];
+			d = &vq->desc[head];
+			n = nn - off < d->len ? nn - off : d->len;
+			memcpy(gpa2va(d->addr, d->len), frame + off, n);
+			if (hdr == NULL)
+				hdr = gpa2va(d->addr, d->len);
+			putused(vq, nbufs, head, n);
+			off += n;
+			nbufs++;
+			if ((negotiated & F(VIRTIO_NET_F_MRG_RXBUF)) == 0)
+				break;
+		}
+		/* the header must be complete before the driver sees it */
+		if (negotiated & F(VIRTIO_NET_F_MRG_RXBUF))
+			hdr->num_buffers = nbufs;
+		pubused(vq, nbufs);
+		frames++;
+	}
+	if (frames)
+		notify(vq);
+	return vq->lastavail != availidx;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_un sun;
+	struct ifreq ifr;
+	struct pollfd pfd[4];
+	uint64_t cnt;
+	int ls, s, ready = 0, rxroom = 1;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s socketpath tapif\n", argv[0]);
+		exit(1);
+	}
+
+	if ((tapfd = open("/dev/net/tun", O_RDWR | O_NONBLOCK)) == -1)
+		err(1, "open /dev/net/tun");
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+	strncpy(ifr.ifr_name, argv[2], IFNAMSIZ-1);
+	if (ioctl(tapfd, TUNSETIFF, &ifr) == -1)
+		err(1, "TUNSETIFF %s", argv[2]);
+
+	if ((ls = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, argv[1], sizeof(sun.sun_path)-1);
+	unlink(argv[1]);
+	if (bind(ls, (struct sockaddr *)&sun, sizeof(sun)) == -1
+	    || listen(ls, 1) == -1)
+		err(1, "bind %s", argv[1]);
+	if ((s = accept(ls, NULL, NULL)) == -1)
+		err(1, "accept");
+	close(ls);
+
+	while (!ready)
+		ready = handlemsg(s);
+	printf("driver connected, features 0x%llx\n",
+	    (unsigned long long)negotiated);
+
+	for (;;) {
+		pfd[0].fd = s;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = vqs[1].kickfd;
+		pfd[1].events = POLLIN;
+		pfd[2].fd = vqs[0].kickfd;
+		pfd[2].events = POLLIN;
+		pfd[3].fd = rxroom ? tapfd : -1;
+		pfd[3].events = POLLIN;
+		if (poll(pfd, 4, -1) == -1 && errno != EINTR)
+			err(1, "poll");
+
+		if (pfd[0].revents)
+			handlemsg(s);
+		if (pfd[1].revents & POLLIN) {
+			(void)read(vqs[1].kickfd, &cnt, sizeof(cnt));
+			drivertx();
+		}
+		if (pfd[2].revents & POLLIN)
+			(void)read(vqs[0].kickfd, &cnt, sizeof(cnt));
+		rxroom = driverrx();
+	}
+}
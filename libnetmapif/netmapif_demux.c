@@ -0,0 +1,487 @@
+/*
+ * Copyright (c) 2026 The drv-netif-netmap contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Netmap ports shared by several interfaces.  The first interface
+ * which names a port with "vlan=N" or "shared" opens it, and later
+ * ones with the same port name join it.  The port has one receiver
+ * thread, which looks at each frame in the ring buffer and delivers
+ * it straight to its interface.  A tagged frame goes to the interface
+ * of its 802.1Q VLAN, with the tag stripped.  Senders insert their tag
+ * while copying the frame into the tx slot.  An untagged frame goes
+ * to the "shared" interface with its destination MAC address.
+ * Broadcast and multicast frames go to each of them.  The tx rings
+ * are shared by all the interfaces, so each ring has a lock here.
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <net/if.h>
+#include <net/netmap.h>
+#include <net/netmap_user.h>
+
+#include <rump/rumpuser_component.h>
+
+#include "if_virt.h"
+#include "virtif_cycles.h"
+#include "rumpcomp_user.h"
+#include "rumpcomp_vif.h"
+#include "netmapif_user.h"
+
+#define NMPORT_NVLAN	4096
+#define NMPORT_NMACHASH	64	/* buckets of the MAC address table */
+#define MACHASH(ea) (((ea)[3] ^ (ea)[4] ^ (ea)[5]) % NMPORT_NMACHASH)
+
+struct nmport {
+	/* the port itself, as a single interface would have it */
+	struct virtif_user np_viu;
+	uint8_t np_enaddr[6];
+	pthread_mutex_t np_txlock[NETMAPIF_MAXTXR];
+
+	/* the members, changed with np_lock and portslock held */
+	pthread_mutex_t np_lock;
+	struct virtif_user *np_vlan[NMPORT_NVLAN];
+	struct virtif_user *np_mac[NMPORT_NMACHASH];	/* by viu_machash */
+	struct virtif_user *np_maclist;			/* by viu_macnext */
+	int np_refs;
+	int np_nactive;		/* members which are up */
+	int np_promisc;		/* we put the NIC into promiscuous mode */
+
+	/* frames no running interface wanted, receiver only */
+	uint64_t np_nomember;
+
+	struct nmport *np_next;
+};
+
+static pthread_mutex_t portslock = PTHREAD_MUTEX_INITIALIZER;
+static struct nmport *ports;
+
+/*
+ * The receiver must not be scheduled while it waits for np_lock, so
+ * it schedules only when the batch has its first frame.
+ */
+static void
+input(struct virtif_user *viu, unsigned int ring, struct iovec *iov,
+	size_t niov, unsigned int *npkt)
+{
+	struct virtif_stats *vs = &viu->viu_rxstats[ring];
+	size_t i;
+
+	vs->vs_ipackets++;
+	for (i = 0; i < niov; i++)
+		vs->vs_ibytes += iov[i].iov_len;
+	if ((*npkt)++ == 0)
+		rumpuser_component_schedule(NULL);
+	VIF_CAPTURE(viu->viu_cap, iov, niov, 0);
+	VIF_DELIVERPKT(viu->viu_virtifsc, iov, niov);
+}
+
+/* hand a frame to the interfaces it is for, called with np_lock held */
+static void
+demux(struct nmport *port, unsigned int ring, uint8_t *buf,
+	unsigned int len, unsigned int *npkt)
+{
+	struct virtif_user *viu;
+	struct iovec iov[2];
+	unsigned int vid, n;
+
+	if (len < 14)
+		return;
+	if (len >= 18 && buf[12] == 0x81 && buf[13] == 0x00) {
+		vid = (buf[14] & 0x0f) << 8 | buf[15];
+		if ((viu = port->np_vlan[vid]) == NULL || !viu->viu_active) {
+			port->np_nomember++;
+			return;
+		}
+		iov[0].iov_base = buf;
+		iov[0].iov_len = 12;
+		iov[1].iov_base = buf + 16;
+		iov[1].iov_len = len - 16;
+		input(viu, ring, iov, 2, npkt);
+		return;
+	}
+
+	iov[0].iov_base = buf;
+	iov[0].iov_len = len;
+	if (buf[0] & 0x01) {
+		/* VIF_DELIVERPKT copies, so the buffer can be shared */
+		for (viu = port->np_maclist, n = 0; viu != NULL;
+		    viu = viu->viu_macnext) {
+			if (viu->viu_active) {
+				input(viu, ring, iov, 1, npkt);
+				n++;
+			}
+		}
+	} else {
+		for (viu = port->np_mac[MACHASH(buf)]; viu != NULL;
+		    viu = viu->viu_machash) {
+			if (memcmp(viu->viu_enaddr, buf, 6) == 0)
+				break;
+		}
+		n = viu != NULL && viu->viu_active;
+		if (n)
+			input(viu, ring, iov, 1, npkt);
+	}
+	if (n == 0)
+		port->np_nomember++;
+}
+
+/*
+ * The receiver of all the members.  np_lock is held across a batch,
+ * so that a member cannot go away while frames are delivered to it.
+ */
+static void *
+receiver(void *arg)
+{
+	struct nmport *port = arg;
+	struct virtif_user *pviu = &port->np_viu;
+	struct netmap_if *nifp = pviu->nm_nifp;
+	struct netmap_ring *ring;
+	struct netmap_slot *slot;
+	struct pollfd pfd[NETMAPIF_MAXTXR + 1];
+	unsigned int i, n, npkt;
+
+	rumpuser_component_kthread();
+
+	for (;;) {
+		if (vif_runctl_wait(&pviu->viu_runctl))
+			break;
+
+		for (n = 0; n < pviu->viu_nrxfd; n++) {
+			pfd[n].fd = pviu->viu_rxfd[n];
+			pfd[n].events = POLLIN;
+		}
+		pfd[n].fd = vif_runctl_fd(&pviu->viu_runctl);
+		pfd[n].events = POLLIN;
+		if (poll(pfd, n + 1, -1) < 0) {
+			if (errno != EINTR && errno != EAGAIN) {
+				fprintf(stderr, "netmapif: poll failed: %s\n",
+				    strerror(errno));
+			}
+			continue;
+		}
+		if (pfd[n].revents & POLLIN)
+			continue;
+
+		npkt = 0;
+		pthread_mutex_lock(&port->np_lock);
+		for (i = pviu->viu_ring0;
+		    i < pviu->viu_ring0 + pviu->viu_nrxr; i++) {
+			ring = NETMAP_RXRING(nifp, i);
+			while (!nm_ring_empty(ring)) {
+				slot = &ring->slot[ring->cur];
+				demux(port, i, (uint8_t *)NETMAP_BUF(ring,
+				    slot->buf_idx), slot->len, &npkt);
+				ring->head = ring->cur = nm_ring_next(ring, ring->cur);
+			}
+		}
+		if (npkt)
+			rumpuser_component_unschedule();
+		pthread_mutex_unlock(&port->np_lock);
+		vif_stats_batch(&pviu->viu_rcvstats, npkt);
+	}
+
+	rumpuser_component_kthread_release();
+	return NULL;
+}
+
+/* the NIC has to take frames for the addresses of "shared" members */
+static int
+setpromisc(const char *ifname, int on)
+{
+	struct ifreq ifr;
+	int s, flags, rv = 0;
+
+	if ((s = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		return errno;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name));
+	if (ioctl(s, SIOCGIFFLAGS, &ifr) == -1) {
+		rv = errno;
+		goto out;
+	}
+#ifdef IFF_PPROMISC
+	flags = (ifr.ifr_flags & 0xffff) | (ifr.ifr_flagshigh << 16);
+	flags = on ? flags | IFF_PPROMISC : flags & ~IFF_PPROMISC;
+	ifr.ifr_flags = flags & 0xffff;
+	ifr.ifr_flagshigh = flags >> 16;
+#else
+	flags = ifr.ifr_flags;
+	ifr.ifr_flags = on ? flags | IFF_PROMISC : flags & ~IFF_PROMISC;
+#endif
+	if (ioctl(s, SIOCSIFFLAGS, &ifr) == -1)
+		rv = errno;
+ out:
+	close(s);
+	return rv;
+}
+
+static int
+openport(const struct netmapif_params *np, struct nmport **portp)
+{
+	struct nmport *port;
+	pthread_attr_t attr;
+	int i, rv;
+
+	if ((port = calloc(1, sizeof(*port))) == NULL)
+		return errno;
+	if ((rv = netmapif_openport(np, &port->np_viu,
+	    port->np_enaddr)) != 0) {
+		free(port);
+		return rv;
+	}
+	if ((rv = vif_runctl_init(&port->np_viu.viu_runctl)) != 0) {
+		netmapif_closeport(&port->np_viu);
+		free(port);
+		return rv;
+	}
+	strcpy(port->np_viu.viu_ifname, np->np_ifname);
+	pthread_mutex_init(&port->np_lock, NULL);
+	for (i = 0; i < NETMAPIF_MAXTXR; i++)
+		pthread_mutex_init(&port->np_txlock[i], NULL);
+
+	pthread_attr_init(&attr);
+	if (vif_placethread(np->np_ifname, &np->np_cpu, -1, &attr,
+	    port->np_viu.viu_placement,
+	    sizeof(port->np_viu.viu_placement)) != 0) {
+		snprintf(port->np_viu.viu_placement,
+		    sizeof(port->np_viu.viu_placement), "rx unpinned");
+		pthread_attr_destroy(&attr);
+		pthread_attr_init(&attr);
+	}
+	rv = pthread_create(&port->np_viu.viu_pt, &attr, receiver, port);
+	pthread_attr_destroy(&attr);
+	if (rv != 0) {
+		for (i = 0; i < NETMAPIF_MAXTXR; i++)
+			pthread_mutex_destroy(&port->np_txlock[i]);
+		pthread_mutex_destroy(&port->np_lock);
+		vif_runctl_fini(&port->np_viu.viu_runctl);
+		netmapif_closeport(&port->np_viu);
+		free(port);
+		return rv;
+	}
+
+	*portp = port;
+	return 0;
+}
+
+static void
+closeport(struct nmport *port)
+{
+	int i;
+
+	vif_runctl_dying(&port->np_viu.viu_runctl);
+	pthread_join(port->np_viu.viu_pt, NULL);
+	if (port->np_promisc)
+		(void)setpromisc(port->np_viu.viu_ifname, 0);
+	if (port->np_nomember)
+		fprintf(stderr, "netmap:%s: %" PRIu64 " frames for no "
+		    "interface dropped\n", port->np_viu.viu_ifname,
+		    port->np_nomember);
+	for (i = 0; i < NETMAPIF_MAXTXR; i++)
+		pthread_mutex_destroy(&port->np_txlock[i]);
+	pthread_mutex_destroy(&port->np_lock);
+	vif_runctl_fini(&port->np_viu.viu_runctl);
+	netmapif_closeport(&port->np_viu);
+	free(port);
+}
+
+static struct virtif_user *
+findmac(struct nmport *port, const uint8_t *enaddr)
+{
+	struct virtif_user *viu;
+
+	for (viu = port->np_mac[MACHASH(enaddr)]; viu != NULL;
+	    viu = viu->viu_machash) {
+		if (memcmp(viu->viu_enaddr, enaddr, 6) == 0)
+			break;
+	}
+	return viu;
+}
+
+/*
+ * Make viu an interface on the port named in the link string,
+ * opening the port if it is the first one.  A VLAN interface gets the
+ * port's MAC address.  A "shared" one keeps the address it was
+ * created with, unless one is given with "mac=".
+ */
+int
+nmport_join(const struct netmapif_params *np, struct virtif_user *viu,
+	uint8_t *enaddr)
+{
+	struct nmport *port;
+	int rv, error;
+
+	viu->viu_active = 0;
+	pthread_mutex_lock(&portslock);
+	for (port = ports; port != NULL; port = port->np_next) {
+		if (strcmp(port->np_viu.viu_ifname, np->np_ifname) == 0)
+			break;
+	}
+	if (port == NULL) {
+		if ((rv = openport(np, &port)) != 0) {
+			pthread_mutex_unlock(&portslock);
+			return rv;
+		}
+		port->np_next = ports;
+		ports = port;
+	}
+	rv = 0;
+
+	if (np->np_vlan != -1) {
+		if (port->np_vlan[np->np_vlan] != NULL)
+			rv = EADDRINUSE;
+		memcpy(viu->viu_enaddr, port->np_enaddr, 6);
+	} else {
+		if (np->np_hasmac)
+			memcpy(enaddr, np->np_mac, 6);
+		memcpy(viu->viu_enaddr, enaddr, 6);
+		if (findmac(port, enaddr) != NULL)
+			rv = EADDRINUSE;
+		else if (!port->np_promisc) {
+			/* e.g. VALE ports have no flags, and need none */
+			if ((error = setpromisc(np->np_ifname, 1)) != 0)
+				fprintf(stderr, "netmap:%s: cannot enable "
+				    "promiscuous mode: %s\n", np->np_ifname,
+				    strerror(error));
+			else
+				port->np_promisc = 1;
+		}
+	}
+	if (rv != 0) {
+		if (port->np_refs == 0) {
+			ports = port->np_next;
+			closeport(port);
+		}
+		pthread_mutex_unlock(&portslock);
+		return rv;
+	}
+
+	pthread_mutex_lock(&port->np_lock);
+	if (np->np_vlan != -1) {
+		port->np_vlan[np->np_vlan] = viu;
+	} else {
+		viu->viu_machash = port->np_mac[MACHASH(enaddr)];
+		port->np_mac[MACHASH(enaddr)] = viu;
+		viu->viu_macnext = port->np_maclist;
+		port->np_maclist = viu;
+	}
+	pthread_mutex_unlock(&port->np_lock);
+	port->np_refs++;
+	pthread_mutex_unlock(&portslock);
+
+	viu->viu_synth = NULL;
+	viu->viu_port = port;
+	viu->viu_vlan = np->np_vlan;
+	viu->viu_fd = port->np_viu.viu_fd;
+	viu->nm_nifp = port->np_viu.nm_nifp;
+	viu->nm_mem = port->np_viu.nm_mem;
+	viu->nm_memsize = port->np_viu.nm_memsize;
+	viu->viu_ring0 = port->np_viu.viu_ring0;
+	viu->viu_nrxr = port->np_viu.viu_nrxr;
+	viu->viu_ntxr = port->np_viu.viu_ntxr;
+	memcpy(viu->viu_txfd, port->np_viu.viu_txfd, sizeof(viu->viu_txfd));
+	if (viu->viu_vlan != -1) {
+		snprintf(viu->viu_placement, sizeof(viu->viu_placement),
+		    "vlan %d, %s", viu->viu_vlan, port->np_viu.viu_placement);
+		memcpy(enaddr, port->np_enaddr, sizeof(port->np_enaddr));
+	} else {
+		snprintf(viu->viu_placement, sizeof(viu->viu_placement),
+		    "shared, %s", port->np_viu.viu_placement);
+	}
+	return 0;
+}
+
+
+void
+nmport_leave(struct virtif_user *viu)
+{
+	struct nmport *port = viu->viu_port, **portp;
+	struct virtif_user **viup;
+
+	pthread_mutex_lock(&portslock);
+	nmport_setactive(viu, 0);
+	pthread_mutex_lock(&port->np_lock);
+	if (viu->viu_vlan != -1) {
+		port->np_vlan[viu->viu_vlan] = NULL;
+	} else {
+		for (viup = &port->np_mac[MACHASH(viu->viu_enaddr)];
+		    *viup != viu; viup = &(*viup)->viu_machash)
+			continue;
+		*viup = viu->viu_machash;
+		for (viup = &port->np_maclist; *viup != viu;
+		    viup = &(*viup)->viu_macnext)
+			continue;
+		*viup = viu->viu_macnext;
+	}
+	pthread_mutex_unlock(&port->np_lock);
+	if (--port->np_refs == 0) {
+		for (portp = &ports; *portp != port;
+		    portp = &(*portp)->np_next)
+			continue;
+		*portp = port->np_next;
+		closeport(port);
+	}
+	pthread_mutex_unlock(&portslock);
+}
+
+/*
+ * Frames are delivered to a member only while it is up.  The port's
+ * receiver runs while any member is.  Called unscheduled.
+ */
+void
+nmport_setactive(struct virtif_user *viu, int active)
+{
+	struct nmport *port = viu->viu_port;
+
+	pthread_mutex_lock(&port->np_lock);
+	if (viu->viu_active != active) {
+		viu->viu_active = active;
+		if (active && port->np_nactive++ == 0)
+			vif_runctl_start(&port->np_viu.viu_runctl);
+		else if (!active && --port->np_nactive == 0)
+			vif_runctl_stop(&port->np_viu.viu_runctl);
+	}
+	pthread_mutex_unlock(&port->np_lock);
+}
+
+pthread_mutex_t *
+nmport_txlock(struct virtif_user *viu, int txring)
+{
+
+	return &viu->viu_port->np_txlock[txring];
+}
@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2026 The drv-netif-netmap contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * "loop": what is transmitted is received, like a cable plugged into
+ * its own port or into a second "loop" port of the same process.
+ *
+ * Here the sender plays the kernel for the receiving side: in
+ * NIOCTXSYNC each frame is put on the rx ring of the receiving port
+ * and its receiver is woken through the doorbell pipe once per sync.
+ * The receiver thread then delivers the frames as it would for a
+ * NIC, so the cost of the thread handoff and of scheduling stays in
+ * the measurement.  On the same port a frame is passed by swapping
+ * the buffers of the tx and the rx slot.  Between two ports, which
+ * have separate regions, it is copied.  Frames which find the rx
+ * ring full are dropped.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <net/if.h>
+#include <net/netmap.h>
+#include <net/netmap_user.h>
+
+#include "if_virt.h"
+#include "virtif_cycles.h"
+#include "rumpcomp_vif.h"
+#include "netmapif_user.h"
+#include "netmapif_synth.h"
+
+struct loop;
+
+/*
+ * Ports which pair with each other.  The pair lock is held by a
+ * sender for the duration of a NIOCTXSYNC, so that the other end
+ * cannot go away while its rx ring is being filled.
+ */
+struct looppair {
+	char lpp_name[32];
+	pthread_mutex_t lpp_lock;
+	struct loop *lpp_end[2];	/* NULL until the port is ready */
+	int lpp_used[2];
+	int lpp_refs;
+	struct looppair *lpp_next;
+};
+
+static pthread_mutex_t pairslock = PTHREAD_MUTEX_INITIALIZER;
+static struct looppair *pairs;
+
+struct loop {
+	struct nmsynth *lp_ns;
+	struct looppair *lp_pair;	/* NULL: loop to ourselves */
+	int lp_end;
+
+	/* sender state */
+	struct loop *lp_dst;		/* receiver of this NIOCTXSYNC */
+	uint32_t lp_dsttail;
+	uint64_t lp_swapped;
+	uint64_t lp_copied;
+	uint64_t lp_drops;
+};
+
+static int
+loop_opt(struct nmsynth_params *nsp, const char *opt, const char *val)
+{
+
+	if (strcmp(opt, "pair") != 0 || val == NULL)
+		return EINVAL;
+	if (strlen(val) >= sizeof(nsp->nsp_pair))
+		return ENAMETOOLONG;
+	strcpy(nsp->nsp_pair, val);
+	return 0;
+}
+
+/* claim an end of the named pair, creating it if need be */
+static int
+joinpair(struct loop *lp, const char *name)
+{
+	struct looppair *lpp;
+
+	pthread_mutex_lock(&pairslock);
+	for (lpp = pairs; lpp != NULL; lpp = lpp->lpp_next) {
+		if (strcmp(lpp->lpp_name, name) == 0 && lpp->lpp_refs < 2)
+			break;
+	}
+	if (lpp == NULL) {
+		if ((lpp = calloc(1, sizeof(*lpp))) == NULL) {
+			pthread_mutex_unlock(&pairslock);
+			return ENOMEM;
+		}
+		strcpy(lpp->lpp_name, name);
+		pthread_mutex_init(&lpp->lpp_lock, NULL);
+		lpp->lpp_next = pairs;
+		pairs = lpp;
+	}
+	lp->lp_end = lpp->lpp_used[0];
+	lpp->lpp_used[lp->lp_end] = 1;
+	lpp->lpp_refs++;
+	lp->lp_pair = lpp;
+	pthread_mutex_unlock(&pairslock);
+	return 0;
+}
+
+static void
+leavepair(struct loop *lp)
+{
+	struct looppair *lpp = lp->lp_pair, **lppp;
+
+	pthread_mutex_lock(&lpp->lpp_lock);
+	lpp->lpp_end[lp->lp_end] = NULL;
+	pthread_mutex_unlock(&lpp->lpp_lock);
+
+	pthread_mutex_lock(&pairslock);
+	lpp->lpp_used[lp->lp_end] = 0;
+	if (--lpp->lpp_refs == 0) {
+		for (lppp = &pairs; *lppp != lpp; lppp = &(*lppp)->lpp_next)
+			continue;
+		*lppp = lpp->lpp_next;
+		pthread_mutex_destroy(&lpp->lpp_lock);
+		free(lpp);
+	}
+	pthread_mutex_unlock(&pairslock);
+}
+
+static int
+loop_open(struct nmsynth *ns, const struct nmsynth_params *nsp,
+	const uint8_t *enaddr)
+{
+	struct loop *lp;
+	int rv;
+
+	if ((lp = calloc(1, sizeof(*lp))) == NULL)
+		return errno;
+	lp->lp_ns = ns;
+	if (nsp->nsp_pair[0] != '\0') {
+		if ((rv = joinpair(lp, nsp->nsp_pair)) != 0) {
+			free(lp);
+			return rv;
+		}
+		snprintf(ns->ns_descr, sizeof(ns->ns_descr),
+		    "loop to pair %s", nsp->nsp_pair);
+	} else {
+		snprintf(ns->ns_descr, sizeof(ns->ns_descr), "loop");
+	}
+	ns->ns_modearg = lp;
+	return 0;
+}
+
+/* our rx ring exists now, so the other end may fill it */
+static void
+loop_stage(struct nmsynth *ns)
+{
+	struct loop *lp = ns->ns_modearg;
+
+	if (lp->lp_pair == NULL)
+		return;
+	pthread_mutex_lock(&lp->lp_pair->lpp_lock);
+	lp->lp_pair->lpp_end[lp->lp_end] = lp;
+	pthread_mutex_unlock(&lp->lp_pair->lpp_lock);
+}
+
+/* frames arrive through nsm_tx of the sending port */
+static int
+loop_rxsync(struct nmsynth *ns, struct timespec *wait)
+{
+
+	__sync_synchronize();
+	return 0;
+}
+
+static void
+loop_txbegin(struct nmsynth *ns)
+{
+	struct loop *lp = ns->ns_modearg;
+
+	if (lp->lp_pair != NULL) {
+		pthread_mutex_lock(&lp->lp_pair->lpp_lock);
+		lp->lp_dst = lp->lp_pair->lpp_end[!lp->lp_end];
+	} else {
+		lp->lp_dst = lp;
+	}
+	if (lp->lp_dst != NULL)
+		lp->lp_dsttail = lp->lp_dst->lp_ns->ns_rxring->tail;
+}
+
+static void
+loop_tx(struct nmsynth *ns, struct netmap_slot *slot)
+{
+	struct loop *lp = ns->ns_modearg, *dst = lp->lp_dst;
+	struct netmap_ring *ring;
+	struct netmap_slot *rs;
+	uint32_t lim, idx;
+
+	if (dst == NULL) {
+		lp->lp_drops++;		/* nothing plugged in */
+		return;
+	}
+	ring = dst->lp_ns->ns_rxring;
+	lim = ring->head == 0 ? ring->num_slots-1 : ring->head-1;
+	if (lp->lp_dsttail == lim) {
+		lp->lp_drops++;
+		return;
+	}
+
+	rs = &ring->slot[lp->lp_dsttail];
+	if (dst == lp) {
+		idx = rs->buf_idx;
+		rs->buf_idx = slot->buf_idx;
+		slot->buf_idx = idx;
+		slot->flags |= NS_BUF_CHANGED;
+		lp->lp_swapped++;
+	} else {
+		memcpy(NMSYNTH_BUF(dst->lp_ns, rs->buf_idx),
+		    NMSYNTH_BUF(ns, slot->buf_idx), slot->len);
+		lp->lp_copied++;
+	}
+	rs->len = slot->len;
+	rs->flags = NS_BUF_CHANGED;
+	lp->lp_dsttail = nm_ring_next(ring, lp->lp_dsttail);
+}
+
+static void
+loop_txdone(struct nmsynth *ns)
+{
+	struct loop *lp = ns->ns_modearg, *dst = lp->lp_dst;
+	struct netmap_ring *ring;
+	char c = 0;
+
+	if (dst != NULL) {
+		ring = dst->lp_ns->ns_rxring;
+		if (ring->tail != lp->lp_dsttail) {
+			/* slots first, then the tail which publishes them */
+			__sync_synchronize();
+			ring->tail = lp->lp_dsttail;
+			(void)write(dst->lp_ns->ns_bellfd, &c, 1);
+		}
+	}
+	if (lp->lp_pair != NULL)
+		pthread_mutex_unlock(&lp->lp_pair->lpp_lock);
+}
+
+static void
+loop_close(struct nmsynth *ns)
+{
+	struct loop *lp = ns->ns_modearg;
+
+	if (lp->lp_pair != NULL)
+		leavepair(lp);
+	if (lp->lp_swapped + lp->lp_copied + lp->lp_drops)
+		fprintf(stderr, "netmap:loop: %" PRIu64 " frames swapped, %"
+		    PRIu64 " copied, %" PRIu64 " dropped\n",
+		    lp->lp_swapped, lp->lp_copied, lp->lp_drops);
+	free(lp);
+}
+
+const struct nmsynth_mode nmsynth_loop = {
+	.nsm_name = "loop",
+	.nsm_opt = loop_opt,
+	.nsm_open = loop_open,
+	.nsm_stage = loop_stage,
+	.nsm_rxsync = loop_rxsync,
+	.nsm_tx = loop_tx,
+	.nsm_txbegin = loop_txbegin,
+	.nsm_txdone = loop_txdone,
+	.nsm_close = loop_close,
+};
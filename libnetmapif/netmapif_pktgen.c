@@ -0,0 +1,468 @@
+/*
+ * Copyright (c) 2026 The drv-netif-netmap contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * "pktgen": generate UDP and/or TCP over IPv4 frames into the receive
+ * path, as fast as the stack takes them or at a given rate.  One
+ * template frame per flow (and per size, if sizes vary) is built and
+ * checksummed into a netmap buffer when the interface is created, so
+ * generating a frame only points an rx slot at a template.  What is
+ * measured is thus the cost of the receiver and the stack alone.
+ *
+ * At a given rate, frames which are due while the rx ring is full
+ * are dropped like a NIC would drop them, so that the generator does
+ * not slow down to the stack's pace unnoticed.
+ */
+
+#include <sys/types.h>
+
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <net/if.h>
+#include <netinet/in.h>
+#include <net/netmap.h>
+#include <net/netmap_user.h>
+
+#include "if_virt.h"
+#include "virtif_cycles.h"
+#include "rumpcomp_vif.h"
+#include "netmapif_user.h"
+#include "netmapif_synth.h"
+
+#define PKTGEN_MAXFLOWS	65536
+#define PKTGEN_NSIZES	256	/* templates at least, if sizes vary */
+#define PKTGEN_MINSIZE	60	/* Ethernet minimum without the FCS */
+#define PKTGEN_MAXSIZE	1514
+
+#define PKTGEN_SPORT	1024	/* source ports count up from here */
+#define PKTGEN_NSPORT	64512
+
+struct pktgen {
+	uint32_t pg_ntempl;
+	uint16_t *pg_len;	/* frame length of each template */
+
+	double pg_rate;
+	uint64_t pg_count;
+
+	/* receiver state */
+	uint32_t pg_next;	/* next template */
+	int pg_started;
+	int pg_done;		/* pg_count generated */
+	int pg_reported;
+	struct timespec pg_start;
+	uint64_t pg_gen;	/* generated, including dropped */
+	uint64_t pg_fed;	/* put on the rx ring */
+	uint64_t pg_drops;	/* due while the ring was full */
+#ifdef VIRTIF_CYCLES
+	uint64_t pg_cstart;
+#endif
+
+	/* sender state */
+	uint64_t pg_txframes;
+
+	/* template parameters, used by pktgen_stage() */
+	unsigned int pg_flows;
+	unsigned int pg_minsize, pg_maxsize;
+	int pg_proto;
+	uint32_t pg_src, pg_dst;
+	uint16_t pg_dport;
+	uint8_t pg_enaddr[6];
+};
+
+static const uint8_t pktgen_srcaddr[6] = { 0x02, 0, 0, 0, 0, 0x01 };
+
+static int
+parsesize(const char *val, unsigned int *minp, unsigned int *maxp)
+{
+	unsigned long lo, hi;
+	char *ep;
+
+	lo = hi = strtoul(val, &ep, 10);
+	if (*ep == '-')
+		hi = strtoul(ep+1, &ep, 10);
+	if (*ep != '\0' || lo < PKTGEN_MINSIZE || hi > PKTGEN_MAXSIZE
+	    || lo > hi)
+		return EINVAL;
+	*minp = lo;
+	*maxp = hi;
+	return 0;
+}
+
+static int
+pktgen_opt(struct nmsynth_params *nsp, const char *opt, const char *val)
+{
+	struct in_addr in;
+	unsigned long v;
+	char *ep;
+
+	if (val == NULL)
+		return EINVAL;
+
+	if (strcmp(opt, "rate") == 0) {
+		nsp->nsp_rate = strtod(val, &ep);
+		if (*ep != '\0' || nsp->nsp_rate < 0)
+			return EINVAL;
+	} else if (strcmp(opt, "count") == 0) {
+		nsp->nsp_count = strtoull(val, &ep, 10);
+		if (*ep != '\0')
+			return EINVAL;
+	} else if (strcmp(opt, "flows") == 0) {
+		v = strtoul(val, &ep, 10);
+		if (*ep != '\0' || v < 1 || v > PKTGEN_MAXFLOWS)
+			return EINVAL;
+		nsp->nsp_flows = v;
+	} else if (strcmp(opt, "size") == 0) {
+		return parsesize(val, &nsp->nsp_minsize, &nsp->nsp_maxsize);
+	} else if (strcmp(opt, "proto") == 0) {
+		if (strcmp(val, "udp") == 0)
+			nsp->nsp_proto = IPPROTO_UDP;
+		else if (strcmp(val, "tcp") == 0)
+			nsp->nsp_proto = IPPROTO_TCP;
+		else if (strcmp(val, "mix") == 0)
+			nsp->nsp_proto = 0;
+		else
+			return EINVAL;
+	} else if (strcmp(opt, "src") == 0 || strcmp(opt, "dst") == 0) {
+		if (inet_pton(AF_INET, val, &in) != 1)
+			return EINVAL;
+		if (opt[0] == 's')
+			nsp->nsp_src = in.s_addr;
+		else
+			nsp->nsp_dst = in.s_addr;
+	} else if (strcmp(opt, "port") == 0) {
+		v = strtoul(val, &ep, 10);
+		if (*ep != '\0' || v < 1 || v > 65535)
+			return EINVAL;
+		nsp->nsp_dport = v;
+	} else {
+		return EINVAL;
+	}
+	return 0;
+}
+
+static void pktgen_close(struct nmsynth *);
+
+static int
+pktgen_open(struct nmsynth *ns, const struct nmsynth_params *nsp,
+	const uint8_t *enaddr)
+{
+	struct pktgen *pg;
+	const char *proto;
+
+	if ((pg = calloc(1, sizeof(*pg))) == NULL)
+		return errno;
+	ns->ns_modearg = pg;
+	pg->pg_rate = nsp->nsp_rate;
+	pg->pg_count = nsp->nsp_count;
+	pg->pg_flows = nsp->nsp_flows;
+	pg->pg_minsize = nsp->nsp_minsize;
+	pg->pg_maxsize = nsp->nsp_maxsize;
+	pg->pg_proto = nsp->nsp_proto;
+	pg->pg_src = ntohl(nsp->nsp_src);
+	pg->pg_dst = ntohl(nsp->nsp_dst);
+	pg->pg_dport = nsp->nsp_dport;
+	memcpy(pg->pg_enaddr, enaddr, sizeof(pg->pg_enaddr));
+
+	pg->pg_ntempl = pg->pg_flows;
+	if (pg->pg_minsize != pg->pg_maxsize && pg->pg_ntempl < PKTGEN_NSIZES)
+		pg->pg_ntempl = PKTGEN_NSIZES;
+	/*
+	 * Templates are sent in turn, so with an even number of them
+	 * the protocols of a mix alternate frame by frame; an odd
+	 * number of flows then sends each flow with both.
+	 */
+	if (pg->pg_proto == 0 && (pg->pg_ntempl & 1))
+		pg->pg_ntempl *= 2;
+	if ((pg->pg_len = calloc(pg->pg_ntempl, sizeof(*pg->pg_len))) == NULL) {
+		pktgen_close(ns);
+		return ENOMEM;
+	}
+	ns->ns_nextra = pg->pg_ntempl;
+
+	proto = pg->pg_proto == IPPROTO_UDP ? "udp"
+	    : pg->pg_proto == IPPROTO_TCP ? "tcp" : "udp+tcp";
+	if (pg->pg_rate > 0)
+		snprintf(ns->ns_descr, sizeof(ns->ns_descr),
+		    "pktgen %s, %u flows, %u-%u bytes, %g pps", proto,
+		    pg->pg_flows, pg->pg_minsize, pg->pg_maxsize, pg->pg_rate);
+	else
+		snprintf(ns->ns_descr, sizeof(ns->ns_descr),
+		    "pktgen %s, %u flows, %u-%u bytes", proto,
+		    pg->pg_flows, pg->pg_minsize, pg->pg_maxsize);
+	return 0;
+}
+
+static void
+put16(uint8_t *p, uint16_t v)
+{
+
+	p[0] = v >> 8;
+	p[1] = v & 0xff;
+}
+
+static void
+put32(uint8_t *p, uint32_t v)
+{
+
+	put16(p, v >> 16);
+	put16(p+2, v & 0xffff);
+}
+
+static uint32_t
+cksum_add(uint32_t sum, const uint8_t *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		sum += p[i] << 8 | p[i+1];
+	if (len & 1)
+		sum += p[len-1] << 8;
+	return sum;
+}
+
+static uint16_t
+cksum_fold(uint32_t sum)
+{
+
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum & 0xffff;
+}
+
+/*
+ * Ethernet, IPv4 without options and a UDP header or a bare TCP ACK,
+ * padded with zeroes to len.  A TCP segment for no connection makes
+ * the stack answer with a RST, which exercises the transmit path too.
+ */
+static void
+buildframe(struct pktgen *pg, uint8_t *b, unsigned int len,
+	uint32_t flow, int proto)
+{
+	uint8_t *ip = b + 14, *l4 = ip + 20;
+	uint32_t src, sum;
+	uint16_t l4len, ck;
+
+	memset(b, 0, len);
+	memcpy(b, pg->pg_enaddr, 6);
+	memcpy(b + 6, pktgen_srcaddr, 6);
+	put16(b + 12, 0x0800);
+
+	src = pg->pg_src + flow / PKTGEN_NSPORT;
+	l4len = len - 14 - 20;
+	ip[0] = 0x45;
+	put16(ip + 2, len - 14);
+	put16(ip + 4, flow & 0xffff);
+	put16(ip + 6, 0x4000);			/* DF */
+	ip[8] = 64;
+	ip[9] = proto;
+	put32(ip + 12, src);
+	put32(ip + 16, pg->pg_dst);
+	put16(ip + 10, cksum_fold(cksum_add(0, ip, 20)));
+
+	put16(l4, PKTGEN_SPORT + flow % PKTGEN_NSPORT);
+	put16(l4 + 2, pg->pg_dport);
+	if (proto == IPPROTO_UDP) {
+		put16(l4 + 4, l4len);
+	} else {
+		put32(l4 + 4, flow);		/* seq */
+		l4[12] = 5 << 4;
+		l4[13] = 0x10;			/* ACK */
+		put16(l4 + 14, 65535);
+	}
+
+	/* pseudo header, then the segment */
+	sum = cksum_add(0, ip + 12, 8) + proto + l4len;
+	ck = cksum_fold(cksum_add(sum, l4, l4len));
+	if (proto == IPPROTO_UDP && ck == 0)
+		ck = 0xffff;
+	put16(l4 + (proto == IPPROTO_UDP ? 6 : 16), ck);
+}
+
+static void
+pktgen_stage(struct nmsynth *ns)
+{
+	struct pktgen *pg = ns->ns_modearg;
+	uint32_t i, seed = 1;
+	unsigned int len;
+	int proto;
+
+	for (i = 0; i < pg->pg_ntempl; i++) {
+		len = pg->pg_minsize;
+		if (pg->pg_maxsize != pg->pg_minsize) {
+			/* xorshift, so that every run uses the same sizes */
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			len += seed % (pg->pg_maxsize - pg->pg_minsize + 1);
+		}
+		proto = pg->pg_proto ? pg->pg_proto
+		    : (i & 1) ? IPPROTO_TCP : IPPROTO_UDP;
+		pg->pg_len[i] = len;
+		buildframe(pg, (uint8_t *)NMSYNTH_BUF(ns, ns->ns_extra + i),
+		    len, i % pg->pg_flows, proto);
+	}
+}
+
+static uint64_t
+nsdiff(const struct timespec *a, const struct timespec *b)
+{
+
+	return (a->tv_sec - b->tv_sec) * 1000000000ULL
+	    + a->tv_nsec - b->tv_nsec;
+}
+
+/* what the stack has taken, i.e. not what is still on the ring */
+static void
+report(struct pktgen *pg, struct netmap_ring *ring,
+	const struct timespec *now)
+{
+	uint64_t ns = nsdiff(now, &pg->pg_start), delivered;
+	double secs = ns / 1e9;
+
+	pg->pg_reported = 1;
+	delivered = pg->pg_fed
+	    - (ring->tail + ring->num_slots - ring->head) % ring->num_slots;
+	if (delivered == 0)
+		return;
+	fprintf(stderr, "netmap:pktgen: %" PRIu64
+	    " frames in %.3f s: %.0f pps, %.1f ns/frame", delivered, secs,
+	    secs > 0 ? delivered / secs : 0, (double)ns / delivered);
+#ifdef VIRTIF_CYCLES
+	fprintf(stderr, ", %" PRIu64 " cycles/frame",
+	    (vif_cycles() - pg->pg_cstart) / delivered);
+#endif
+	fprintf(stderr, "; %" PRIu64 " dropped, %" PRIu64
+	    " frames transmitted\n", pg->pg_drops, pg->pg_txframes);
+}
+
+static int
+pktgen_rxsync(struct nmsynth *ns, struct timespec *wait)
+{
+	struct pktgen *pg = ns->ns_modearg;
+	struct netmap_ring *ring = ns->ns_rxring;
+	struct netmap_slot *slot;
+	struct timespec now;
+	uint64_t due, elapsed, next;
+	uint32_t lim, room, n;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (pg->pg_done) {
+		if (!pg->pg_reported && nm_ring_empty(ring))
+			report(pg, ring, &now);
+		return 0;
+	}
+	if (!pg->pg_started) {
+		pg->pg_start = now;
+#ifdef VIRTIF_CYCLES
+		pg->pg_cstart = vif_cycles();
+#endif
+		pg->pg_started = 1;
+	}
+
+	wait->tv_sec = wait->tv_nsec = 0;
+	lim = ring->head == 0 ? ring->num_slots-1 : ring->head-1;
+	room = (lim + ring->num_slots - ring->tail) % ring->num_slots;
+	n = room;
+	if (pg->pg_rate > 0) {
+		elapsed = nsdiff(&now, &pg->pg_start);
+		due = (uint64_t)(elapsed / 1e9 * pg->pg_rate);
+		if (pg->pg_count && due > pg->pg_count)
+			due = pg->pg_count;
+		if (due <= pg->pg_gen) {
+			next = (uint64_t)((pg->pg_gen+1) * 1e9 / pg->pg_rate);
+			next = next > elapsed ? next - elapsed : 0;
+			wait->tv_sec = next / 1000000000;
+			wait->tv_nsec = next % 1000000000;
+			return 1;
+		}
+		/* a ring's worth may queue up, the rest is lost */
+		if (due - pg->pg_gen > ring->num_slots) {
+			pg->pg_drops += due - pg->pg_gen - ring->num_slots;
+			pg->pg_gen = due - ring->num_slots;
+		}
+		if (due - pg->pg_gen < n)
+			n = due - pg->pg_gen;
+	}
+	if (pg->pg_count && pg->pg_count - pg->pg_gen < n)
+		n = pg->pg_count - pg->pg_gen;
+
+	for (pg->pg_gen += n; n > 0; n--) {
+		slot = &ring->slot[ring->tail];
+		slot->buf_idx = ns->ns_extra + pg->pg_next;
+		slot->len = pg->pg_len[pg->pg_next];
+		slot->flags = NS_BUF_CHANGED;
+		ring->tail = nm_ring_next(ring, ring->tail);
+		pg->pg_fed++;
+		if (++pg->pg_next == pg->pg_ntempl)
+			pg->pg_next = 0;
+	}
+
+	if (pg->pg_count && pg->pg_gen == pg->pg_count) {
+		pg->pg_done = 1;
+		return 0;
+	}
+	return 1;
+}
+
+static void
+pktgen_tx(struct nmsynth *ns, struct netmap_slot *slot)
+{
+	struct pktgen *pg = ns->ns_modearg;
+
+	pg->pg_txframes++;
+}
+
+static void
+pktgen_close(struct nmsynth *ns)
+{
+	struct pktgen *pg = ns->ns_modearg;
+	struct timespec now;
+
+	if (pg->pg_started && !pg->pg_reported) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		report(pg, ns->ns_rxring, &now);
+	}
+	free(pg->pg_len);
+	free(pg);
+}
+
+const struct nmsynth_mode nmsynth_pktgen = {
+	.nsm_name = "pktgen",
+	.nsm_opt = pktgen_opt,
+	.nsm_open = pktgen_open,
+	.nsm_stage = pktgen_stage,
+	.nsm_rxsync = pktgen_rxsync,
+	.nsm_tx = pktgen_tx,
+	.nsm_close = pktgen_close,
+};
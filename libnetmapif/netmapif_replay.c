@@ -0,0 +1,591 @@
+/*
+ * Copyright (c) 2026 The drv-netif-netmap contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * "replay": play a pcap or pcapng trace into the receive path, as
+ * fast as possible or with the trace's own timing (scaled).  The
+ * trace is memory-mapped and indexed when the interface is created,
+ * and up to REPLAY_MAXSTAGE frames are staged into netmap buffers
+ * then, so that replaying them only points rx slots at the staged
+ * buffers.  Transmitted frames are counted and dropped, or written
+ * to a pcap file.  The achieved rate is reported on stderr once the
+ * trace has been played.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <net/if.h>
+#include <net/netmap.h>
+#include <net/netmap_user.h>
+
+#include "if_virt.h"
+#include "virtif_cycles.h"
+#include "rumpcomp_vif.h"
+#include "netmapif_user.h"
+#include "netmapif_synth.h"
+
+#define REPLAY_MAXSTAGE	65536		/* 128MB of staged frames */
+
+struct replay_frame {
+	const uint8_t *rf_data;
+	uint32_t rf_len;
+	uint32_t rf_buf;	/* staged into this buffer, 0 if not */
+	uint64_t rf_ts;		/* ns since the first frame */
+};
+
+struct replay {
+	uint8_t *rp_map;
+	size_t rp_mapsz;
+
+	struct replay_frame *rp_frames;
+	size_t rp_nframes;
+	size_t rp_maxframes;
+	size_t rp_nskipped;	/* too large for a buffer or not Ethernet */
+
+	double rp_speed;
+	unsigned long rp_repeat;
+	int rp_rewrite;
+	uint8_t rp_enaddr[6];
+
+	/* receiver state */
+	size_t rp_next;
+	unsigned long rp_pass;
+	struct timespec rp_t0;	/* start of the current pass */
+	int rp_started;
+	int rp_done;		/* all passes fed */
+	int rp_reported;
+	struct timespec rp_start;
+	uint64_t rp_fed;
+	uint64_t rp_fedbytes;
+#ifdef VIRTIF_CYCLES
+	uint64_t rp_cstart;
+#endif
+
+	/* sender state */
+	FILE *rp_out;
+	uint64_t rp_txframes;
+	uint64_t rp_txbytes;
+};
+
+static int
+replay_opt(struct nmsynth_params *nsp, const char *opt, const char *val)
+{
+	char *ep;
+
+	if (strcmp(opt, "rewrite") == 0 && val == NULL) {
+		nsp->nsp_rewrite = 1;
+		return 0;
+	}
+	if (val == NULL)
+		return EINVAL;
+
+	if (strcmp(opt, "file") == 0) {
+		if (strlen(val) >= sizeof(nsp->nsp_file))
+			return ENAMETOOLONG;
+		strcpy(nsp->nsp_file, val);
+	} else if (strcmp(opt, "out") == 0) {
+		if (strlen(val) >= sizeof(nsp->nsp_out))
+			return ENAMETOOLONG;
+		strcpy(nsp->nsp_out, val);
+	} else if (strcmp(opt, "speed") == 0) {
+		nsp->nsp_speed = strtod(val, &ep);
+		if (*ep != '\0' || nsp->nsp_speed < 0)
+			return EINVAL;
+	} else if (strcmp(opt, "repeat") == 0) {
+		nsp->nsp_repeat = strtoul(val, &ep, 10);
+		if (*ep != '\0')
+			return EINVAL;
+	} else {
+		return EINVAL;
+	}
+	return 0;
+}
+
+static uint32_t
+rd32(const uint8_t *p, int swap)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return swap ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t
+rd16(const uint8_t *p, int swap)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return swap ? __builtin_bswap16(v) : v;
+}
+
+static int
+addframe(struct replay *rp, const uint8_t *data, uint32_t len, uint64_t ts)
+{
+	struct replay_frame *rf;
+	size_t n;
+
+	if (len == 0 || len > NMSYNTH_BUFSZ) {
+		rp->rp_nskipped++;
+		return 0;
+	}
+	if (rp->rp_nframes == rp->rp_maxframes) {
+		n = rp->rp_maxframes ? 2*rp->rp_maxframes : 1024;
+		if ((rf = realloc(rp->rp_frames, n * sizeof(*rf))) == NULL)
+			return ENOMEM;
+		rp->rp_frames = rf;
+		rp->rp_maxframes = n;
+	}
+	rf = &rp->rp_frames[rp->rp_nframes++];
+	rf->rf_data = data;
+	rf->rf_len = len;
+	rf->rf_buf = 0;
+	rf->rf_ts = ts;
+	return 0;
+}
+
+/* classic pcap, microsecond or nanosecond timestamps, either order */
+static int
+parsepcap(struct replay *rp, const uint8_t *p, size_t len)
+{
+	uint32_t magic, caplen;
+	uint64_t ts, mult;
+	size_t off;
+	int swap, rv;
+
+	memcpy(&magic, p, sizeof(magic));
+	swap = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+	magic = rd32(p, swap);
+	mult = magic == 0xa1b23c4d ? 1 : 1000;
+	if (rd32(p + 20, swap) != 1 /* LINKTYPE_ETHERNET */)
+		return EPROTONOSUPPORT;
+
+	for (off = 24; off + 16 <= len; off += 16 + caplen) {
+		caplen = rd32(p + off + 8, swap);
+		if (caplen > len - off - 16)
+			break;
+		ts = rd32(p + off, swap) * 1000000000ULL
+		    + rd32(p + off + 4, swap) * mult;
+		if ((rv = addframe(rp, p + off + 16, caplen, ts)) != 0)
+			return rv;
+	}
+	return 0;
+}
+
+/* pcapng: Ethernet frames from enhanced and simple packet blocks */
+#define PCAPNG_MAXIF	16
+
+static int
+parsepcapng(struct replay *rp, const uint8_t *p, size_t len)
+{
+	struct {
+		int ethernet;
+		uint32_t snaplen;
+		uint64_t units;		/* timestamp units per second */
+	} ifs[PCAPNG_MAXIF];
+	const uint8_t *b;
+	uint32_t type, blen, caplen, ifid, olen, code, i;
+	uint64_t ts, lastts = 0;
+	unsigned int nifs = 0;
+	size_t off, o;
+	int swap = 0, rv;
+
+	for (off = 0; off + 12 <= len; off += blen) {
+		b = p + off;
+		type = rd32(b, swap);
+		if (type == 0x0a0d0d0a) {
+			swap = rd32(b + 8, 0) != 0x1a2b3c4d;
+			nifs = 0;
+		}
+		blen = rd32(b + 4, swap);
+		if (blen < 12 || blen > len - off || (blen & 3))
+			break;
+
+		switch (type) {
+		case 1:	/* interface description */
+			if (nifs == PCAPNG_MAXIF || blen < 20)
+				break;
+			ifs[nifs].ethernet = rd16(b + 8, swap) == 1;
+			ifs[nifs].snaplen = rd32(b + 12, swap);
+			ifs[nifs].units = 1000000;
+			for (o = 16; o + 4 <= blen - 4;
+			    o += 4 + ((olen+3) & ~3)) {
+				code = rd16(b + o, swap);
+				olen = rd16(b + o + 2, swap);
+				if (code == 0 || o + 4 + olen > blen - 4)
+					break;
+				if (code == 9 /* if_tsresol */ && olen >= 1) {
+					if (b[o+4] & 0x80) {
+						ifs[nifs].units =
+						    1ULL << (b[o+4] & 0x3f);
+					} else {
+						ifs[nifs].units = 1;
+						for (i = 0; i < b[o+4]
+						    && i < 19; i++)
+							ifs[nifs].units *= 10;
+					}
+				}
+			}
+			nifs++;
+			break;
+		case 6:	/* enhanced packet */
+			if (blen < 32)
+				break;
+			ifid = rd32(b + 8, swap);
+			caplen = rd32(b + 20, swap);
+			if (ifid >= nifs || !ifs[ifid].ethernet
+			    || caplen > blen - 32) {
+				rp->rp_nskipped++;
+				break;
+			}
+			ts = (uint64_t)rd32(b + 12, swap) << 32
+			    | rd32(b + 16, swap);
+			lastts = ts / ifs[ifid].units * 1000000000ULL
+			    + (uint64_t)((long double)(ts % ifs[ifid].units)
+			    * 1e9 / ifs[ifid].units);
+			if ((rv = addframe(rp, b + 28, caplen, lastts)) != 0)
+				return rv;
+			break;
+		case 3:	/* simple packet, no timestamp */
+			if (blen < 16 || nifs == 0 || !ifs[0].ethernet) {
+				rp->rp_nskipped++;
+				break;
+			}
+			caplen = rd32(b + 8, swap);
+			if (caplen > blen - 16)
+				caplen = blen - 16;
+			if (ifs[0].snaplen && caplen > ifs[0].snaplen)
+				caplen = ifs[0].snaplen;
+			if ((rv = addframe(rp, b + 12, caplen, lastts)) != 0)
+				return rv;
+			break;
+		default:
+			break;
+		}
+	}
+	return 0;
+}
+
+static int
+loadtrace(struct replay *rp, const char *path)
+{
+	struct stat sb;
+	uint32_t magic;
+	uint64_t base, prev;
+	size_t i;
+	int fd, rv;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return errno;
+	if (fstat(fd, &sb) == -1 || sb.st_size < 24) {
+		rv = errno ? errno : EINVAL;
+		close(fd);
+		return rv;
+	}
+	rp->rp_mapsz = sb.st_size;
+	rp->rp_map = mmap(NULL, rp->rp_mapsz, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (rp->rp_map == MAP_FAILED) {
+		rp->rp_map = NULL;
+		return errno;
+	}
+	(void)madvise(rp->rp_map, rp->rp_mapsz, MADV_SEQUENTIAL);
+
+	memcpy(&magic, rp->rp_map, sizeof(magic));
+	switch (magic) {
+	case 0xa1b2c3d4: case 0xd4c3b2a1:
+	case 0xa1b23c4d: case 0x4d3cb2a1:
+		rv = parsepcap(rp, rp->rp_map, rp->rp_mapsz);
+		break;
+	case 0x0a0d0d0a:
+		rv = parsepcapng(rp, rp->rp_map, rp->rp_mapsz);
+		break;
+	default:
+		rv = EINVAL;	/* neither pcap nor pcapng */
+		break;
+	}
+	if (rv == 0 && rp->rp_nframes == 0)
+		rv = ENOENT;
+	if (rv != 0)
+		return rv;
+
+	/* relative to the first frame, and never backwards */
+	base = prev = rp->rp_frames[0].rf_ts;
+	for (i = 0; i < rp->rp_nframes; i++) {
+		if (rp->rp_frames[i].rf_ts < prev)
+			rp->rp_frames[i].rf_ts = prev;
+		prev = rp->rp_frames[i].rf_ts;
+		rp->rp_frames[i].rf_ts -= base;
+	}
+	return 0;
+}
+
+static int
+openout(struct replay *rp, const char *path)
+{
+	struct {
+		uint32_t magic;
+		uint16_t major, minor;
+		int32_t thiszone;
+		uint32_t sigfigs, snaplen, linktype;
+	} hdr = { 0xa1b23c4d, 2, 4, 0, 0, 65535, 1 };
+
+	if ((rp->rp_out = fopen(path, "w")) == NULL)
+		return errno;
+	if (fwrite(&hdr, sizeof(hdr), 1, rp->rp_out) != 1) {
+		fclose(rp->rp_out);
+		rp->rp_out = NULL;
+		return EIO;
+	}
+	return 0;
+}
+
+static void replay_close(struct nmsynth *);
+
+static int
+replay_open(struct nmsynth *ns, const struct nmsynth_params *nsp,
+	const uint8_t *enaddr)
+{
+	struct replay *rp;
+	int rv;
+
+	if (nsp->nsp_file[0] == '\0') {
+		fprintf(stderr, "netmap:replay: no trace, use file=\n");
+		return EINVAL;
+	}
+	if ((rp = calloc(1, sizeof(*rp))) == NULL)
+		return errno;
+	ns->ns_modearg = rp;
+	rp->rp_speed = nsp->nsp_speed;
+	rp->rp_repeat = nsp->nsp_repeat;
+	rp->rp_rewrite = nsp->nsp_rewrite;
+	memcpy(rp->rp_enaddr, enaddr, sizeof(rp->rp_enaddr));
+
+	if ((rv = loadtrace(rp, nsp->nsp_file)) != 0) {
+		fprintf(stderr, "netmap:replay: cannot use %s: %s\n",
+		    nsp->nsp_file, strerror(rv));
+		replay_close(ns);
+		return rv;
+	}
+	if (nsp->nsp_out[0] && (rv = openout(rp, nsp->nsp_out)) != 0) {
+		fprintf(stderr, "netmap:replay: cannot write %s: %s\n",
+		    nsp->nsp_out, strerror(rv));
+		replay_close(ns);
+		return rv;
+	}
+
+	ns->ns_nextra = rp->rp_nframes < REPLAY_MAXSTAGE
+	    ? rp->rp_nframes : REPLAY_MAXSTAGE;
+	if (rp->rp_speed > 0)
+		snprintf(ns->ns_descr, sizeof(ns->ns_descr),
+		    "replay of %zu frames at %gx", rp->rp_nframes,
+		    rp->rp_speed);
+	else
+		snprintf(ns->ns_descr, sizeof(ns->ns_descr),
+		    "replay of %zu frames", rp->rp_nframes);
+	if (rp->rp_nskipped)
+		fprintf(stderr, "netmap:replay: %s: skipped %zu frames\n",
+		    nsp->nsp_file, rp->rp_nskipped);
+	return 0;
+}
+
+static void
+copyframe(struct replay *rp, uint8_t *dst, const struct replay_frame *rf)
+{
+
+	memcpy(dst, rf->rf_data, rf->rf_len);
+	if (rp->rp_rewrite && rf->rf_len >= 6 && (dst[0] & 1) == 0)
+		memcpy(dst, rp->rp_enaddr, sizeof(rp->rp_enaddr));
+}
+
+static void
+replay_stage(struct nmsynth *ns)
+{
+	struct replay *rp = ns->ns_modearg;
+	struct replay_frame *rf;
+	uint32_t i;
+
+	for (i = 0; i < ns->ns_nextra; i++) {
+		rf = &rp->rp_frames[i];
+		rf->rf_buf = ns->ns_extra + i;
+		copyframe(rp, (uint8_t *)NMSYNTH_BUF(ns, rf->rf_buf), rf);
+	}
+}
+
+static uint64_t
+nsdiff(const struct timespec *a, const struct timespec *b)
+{
+
+	return (a->tv_sec - b->tv_sec) * 1000000000ULL
+	    + a->tv_nsec - b->tv_nsec;
+}
+
+static void
+report(struct replay *rp, const struct timespec *now)
+{
+	uint64_t ns = nsdiff(now, &rp->rp_start);
+	double secs = ns / 1e9;
+
+	rp->rp_reported = 1;
+	if (rp->rp_fed == 0)
+		return;
+	fprintf(stderr, "netmap:replay: %" PRIu64 " frames, %" PRIu64
+	    " bytes in %.3f s: %.0f pps, %.1f ns/frame",
+	    rp->rp_fed, rp->rp_fedbytes, secs,
+	    secs > 0 ? rp->rp_fed / secs : 0, (double)ns / rp->rp_fed);
+#ifdef VIRTIF_CYCLES
+	fprintf(stderr, ", %" PRIu64 " cycles/frame",
+	    (vif_cycles() - rp->rp_cstart) / rp->rp_fed);
+#endif
+	fprintf(stderr, "; %" PRIu64 " frames transmitted\n",
+	    rp->rp_txframes);
+}
+
+static int
+replay_rxsync(struct nmsynth *ns, struct timespec *wait)
+{
+	struct replay *rp = ns->ns_modearg;
+	struct netmap_ring *ring = ns->ns_rxring;
+	struct netmap_slot *slot;
+	struct replay_frame *rf;
+	struct timespec now;
+	uint64_t due, elapsed;
+	uint32_t lim;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (rp->rp_done) {
+		/* the rate counts until the stack has taken everything */
+		if (!rp->rp_reported && nm_ring_empty(ring))
+			report(rp, &now);
+		return 0;
+	}
+	if (!rp->rp_started) {
+		rp->rp_start = rp->rp_t0 = now;
+#ifdef VIRTIF_CYCLES
+		rp->rp_cstart = vif_cycles();
+#endif
+		rp->rp_started = 1;
+	}
+
+	wait->tv_sec = wait->tv_nsec = 0;
+	lim = ring->head == 0 ? ring->num_slots-1 : ring->head-1;
+	while (ring->tail != lim) {
+		rf = &rp->rp_frames[rp->rp_next];
+		if (rp->rp_speed > 0) {
+			due = (uint64_t)(rf->rf_ts / rp->rp_speed);
+			elapsed = nsdiff(&now, &rp->rp_t0);
+			if (due > elapsed) {
+				wait->tv_sec = (due - elapsed) / 1000000000;
+				wait->tv_nsec = (due - elapsed) % 1000000000;
+				return 1;
+			}
+		}
+
+		slot = &ring->slot[ring->tail];
+		if (rf->rf_buf) {
+			slot->buf_idx = rf->rf_buf;
+		} else {
+			slot->buf_idx = NMSYNTH_RXBUF(ring->tail);
+			copyframe(rp, (uint8_t *)NMSYNTH_BUF(ns,
+			    slot->buf_idx), rf);
+		}
+		slot->len = rf->rf_len;
+		slot->flags = NS_BUF_CHANGED;
+		ring->tail = nm_ring_next(ring, ring->tail);
+		rp->rp_fed++;
+		rp->rp_fedbytes += rf->rf_len;
+
+		if (++rp->rp_next == rp->rp_nframes) {
+			rp->rp_next = 0;
+			if (++rp->rp_pass == rp->rp_repeat) {
+				rp->rp_done = 1;
+				return 0;
+			}
+			rp->rp_t0 = now;
+		}
+	}
+	return 1;
+}
+
+static void
+replay_tx(struct nmsynth *ns, struct netmap_slot *slot)
+{
+	struct replay *rp = ns->ns_modearg;
+	struct timespec now;
+	uint32_t rec[4];
+
+	rp->rp_txframes++;
+	rp->rp_txbytes += slot->len;
+	if (rp->rp_out == NULL)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	rec[0] = now.tv_sec;
+	rec[1] = now.tv_nsec;
+	rec[2] = rec[3] = slot->len;
+	(void)fwrite(rec, sizeof(rec), 1, rp->rp_out);
+	(void)fwrite(NMSYNTH_BUF(ns, slot->buf_idx), slot->len, 1, rp->rp_out);
+}
+
+static void
+replay_close(struct nmsynth *ns)
+{
+	struct replay *rp = ns->ns_modearg;
+	struct timespec now;
+
+	if (rp->rp_started && !rp->rp_reported) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		report(rp, &now);
+	}
+	if (rp->rp_out)
+		fclose(rp->rp_out);
+	if (rp->rp_map)
+		munmap(rp->rp_map, rp->rp_mapsz);
+	free(rp->rp_frames);
+	free(rp);
+}
+
+const struct nmsynth_mode nmsynth_replay = {
+	.nsm_name = "replay",
+	.nsm_opt = replay_opt,
+	.nsm_open = replay_open,
+	.nsm_stage = replay_stage,
+	.nsm_rxsync = replay_rxsync,
+	.nsm_tx = replay_tx,
+	.nsm_close = replay_close,
+};
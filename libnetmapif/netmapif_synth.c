@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2026 The drv-netif-netmap contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Synthetic netmap ports: the region and the kernel side of the
+ * rings.  The modes live in their own files.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE	/* ppoll() */
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <net/if.h>
+#include <netinet/in.h>
+#include <net/netmap.h>
+#include <net/netmap_user.h>
+
+#include "if_virt.h"
+#include "virtif_cycles.h"
+#include "rumpcomp_vif.h"
+#include "netmapif_user.h"
+#include "netmapif_synth.h"
+
+static const struct nmsynth_mode *const modes[] = {
+	&nmsynth_replay,
+	&nmsynth_pktgen,
+	&nmsynth_loop,
+};
+#define NMODES (sizeof(modes) / sizeof(modes[0]))
+
+static const struct nmsynth_mode *
+findmode(const char *ifname)
+{
+	unsigned int i;
+
+	for (i = 0; i < NMODES; i++)
+		if (strcmp(ifname, modes[i]->nsm_name) == 0)
+			return modes[i];
+	return NULL;
+}
+
+/* defaults, before the link string options are applied */
+void
+nmsynth_init(struct nmsynth_params *nsp)
+{
+
+	nsp->nsp_repeat = 1;
+	nsp->nsp_flows = 1;
+	nsp->nsp_minsize = nsp->nsp_maxsize = 60;
+	nsp->nsp_proto = IPPROTO_UDP;
+	nsp->nsp_src = htonl(0x0a000001);	/* 10.0.0.1 */
+	nsp->nsp_dst = htonl(0x0a000002);	/* 10.0.0.2 */
+	nsp->nsp_dport = 9;			/* discard */
+}
+
+int
+nmsynth_match(const char *ifname)
+{
+
+	return findmode(ifname) != NULL;
+}
+
+int
+nmsynth_opt(const char *ifname, struct nmsynth_params *nsp,
+	const char *opt, const char *val)
+{
+	const struct nmsynth_mode *nsm;
+
+	if ((nsm = findmode(ifname)) == NULL)
+		return EINVAL;
+	return nsm->nsm_opt(nsp, opt, val);
+}
+
+/*
+ * Lay out the region like netmap does: the interface, the tx ring,
+ * the rx ring, then the buffers.  ring_ofs has room for the host
+ * rings, which do not exist here.
+ */
+#define ROUNDUP(x, a)	(((x) + (a)-1) & ~(size_t)((a)-1))
+
+static int
+allocregion(struct nmsynth *ns, struct virtif_user *viu)
+{
+	struct netmap_if *nifp;
+	struct netmap_ring *ring;
+	size_t nifsz, ringsz, bufoff, off[2];
+	uint32_t nbufs, i, r;
+
+	nifsz = ROUNDUP(sizeof(*nifp) + 4*sizeof(nifp->ring_ofs[0]), 64);
+	ringsz = ROUNDUP(sizeof(*ring)
+	    + NMSYNTH_NSLOTS*sizeof(struct netmap_slot), 4096);
+	off[0] = ROUNDUP(nifsz, 4096);
+	off[1] = off[0] + ringsz;
+	bufoff = off[1] + ringsz;
+	nbufs = 2*NMSYNTH_NSLOTS + ns->ns_nextra;
+
+	viu->nm_memsize = bufoff + (size_t)nbufs * NMSYNTH_BUFSZ;
+	viu->nm_mem = mmap(NULL, viu->nm_memsize, PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (viu->nm_mem == MAP_FAILED) {
+		viu->nm_mem = NULL;
+		return errno;
+	}
+
+	/* the "const" fields are the kernel's, and we are the kernel */
+	nifp = (void *)viu->nm_mem;
+	strncpy(nifp->ni_name, viu->viu_ifname, sizeof(nifp->ni_name));
+	*(uint32_t *)(uintptr_t)&nifp->ni_version = NETMAP_API;
+	*(uint32_t *)(uintptr_t)&nifp->ni_tx_rings = 1;
+	*(uint32_t *)(uintptr_t)&nifp->ni_rx_rings = 1;
+	*(ssize_t *)(uintptr_t)&nifp->ring_ofs[0] = off[0];
+	*(ssize_t *)(uintptr_t)&nifp->ring_ofs[1] = off[0];
+	*(ssize_t *)(uintptr_t)&nifp->ring_ofs[2] = off[1];
+	*(ssize_t *)(uintptr_t)&nifp->ring_ofs[3] = off[1];
+
+	for (r = 0; r < 2; r++) {
+		ring = (void *)(viu->nm_mem + off[r]);
+		*(int64_t *)(uintptr_t)&ring->buf_ofs = bufoff - off[r];
+		*(uint32_t *)(uintptr_t)&ring->num_slots = NMSYNTH_NSLOTS;
+		*(uint32_t *)(uintptr_t)&ring->nr_buf_size = NMSYNTH_BUFSZ;
+		*(uint16_t *)(uintptr_t)&ring->dir = r;
+		for (i = 0; i < NMSYNTH_NSLOTS; i++)
+			ring->slot[i].buf_idx = r*NMSYNTH_NSLOTS + i;
+		/* tx: all slots but one free, rx: empty */
+		ring->head = ring->cur = 0;
+		ring->tail = r == 0 ? NMSYNTH_NSLOTS-1 : 0;
+	}
+
+	viu->nm_nifp = nifp;
+	ns->ns_txring = NETMAP_TXRING(nifp, 0);
+	ns->ns_rxring = NETMAP_RXRING(nifp, 0);
+	ns->ns_extra = 2*NMSYNTH_NSLOTS;
+	return 0;
+}
+
+/*
+ * The receiver polls viu_fd, which is the read end of a pipe the
+ * modes may ring when they have frames for us.  Modes which produce
+ * frames on the receiver's own time leave it alone.
+ */
+int
+nmsynth_open(const struct netmapif_params *np, struct virtif_user *viu,
+	const uint8_t *enaddr)
+{
+	struct nmsynth *ns;
+	int bell[2], rv;
+
+	if ((ns = calloc(1, sizeof(*ns))) == NULL)
+		return errno;
+	ns->ns_mode = findmode(np->np_ifname);
+	strcpy(viu->viu_ifname, np->np_ifname);
+
+	if ((rv = ns->ns_mode->nsm_open(ns, &np->np_synth, enaddr)) != 0) {
+		free(ns);
+		return rv;
+	}
+	if ((rv = allocregion(ns, viu)) != 0) {
+		ns->ns_mode->nsm_close(ns);
+		free(ns);
+		return rv;
+	}
+	if (pipe(bell) == -1) {
+		rv = errno;
+		munmap(viu->nm_mem, viu->nm_memsize);
+		ns->ns_mode->nsm_close(ns);
+		free(ns);
+		return rv;
+	}
+	(void)vif_setnonblock(bell[0]);
+	(void)vif_setnonblock(bell[1]);
+	ns->ns_bellfd = bell[1];
+	viu->viu_fd = bell[0];
+
+	if (ns->ns_mode->nsm_stage)
+		ns->ns_mode->nsm_stage(ns);
+	viu->viu_synth = ns;
+	return 0;
+}
+
+/* the caller unmaps the region and closes viu_fd */
+void
+nmsynth_close(struct virtif_user *viu)
+{
+	struct nmsynth *ns = viu->viu_synth;
+
+	ns->ns_mode->nsm_close(ns);
+	close(ns->ns_bellfd);
+	free(ns);
+	viu->viu_synth = NULL;
+}
+
+void
+nmsynth_info(struct virtif_user *viu, char *buf, size_t buflen)
+{
+
+	snprintf(buf, buflen, "%s", viu->viu_synth->ns_descr);
+}
+
+/*
+ * In place of the receiver's poll(), which for a real port syncs the
+ * rx rings: let the mode fill the rx ring and sleep only if there is
+ * nothing to deliver yet.  The run control fd is polled in any case,
+ * so that a stop is noticed even when frames never stop coming.
+ */
+int
+nmsynth_poll(struct virtif_user *viu, struct pollfd *pfd, nfds_t nfds)
+{
+	struct nmsynth *ns = viu->viu_synth;
+	const struct nmsynth_mode *nsm = ns->ns_mode;
+	struct timespec ts, *tsp;
+	char buf[64];
+	int prv;
+
+	tsp = nsm->nsm_rxsync(ns, &ts) ? &ts : NULL;
+	if (!nm_ring_empty(ns->ns_rxring)) {
+		ts.tv_sec = ts.tv_nsec = 0;
+		tsp = &ts;
+	}
+
+	prv = ppoll(pfd, nfds, tsp, NULL);
+	if (prv > 0 && (pfd[0].revents & POLLIN)) {
+		while (read(pfd[0].fd, buf, sizeof(buf)) > 0)
+			continue;
+	}
+
+	if (nm_ring_empty(ns->ns_rxring))
+		(void)nsm->nsm_rxsync(ns, &ts);
+	return prv;
+}
+
+/* in place of NIOCRXSYNC, for a receiver which does not poll */
+void
+nmsynth_rxsync(struct virtif_user *viu)
+{
+	struct nmsynth *ns = viu->viu_synth;
+	struct timespec ts;
+
+	(void)ns->ns_mode->nsm_rxsync(ns, &ts);
+}
+
+/*
+ * In place of NIOCTXSYNC: everything between the last sync and head
+ * is handed to the mode and all slots but one are free again.
+ */
+void
+nmsynth_txsync(struct virtif_user *viu)
+{
+	struct nmsynth *ns = viu->viu_synth;
+	const struct nmsynth_mode *nsm = ns->ns_mode;
+	struct netmap_ring *ring = ns->ns_txring;
+
+	if (nsm->nsm_tx != NULL && ns->ns_txcur != ring->head) {
+		if (nsm->nsm_txbegin)
+			nsm->nsm_txbegin(ns);
+		for (; ns->ns_txcur != ring->head;
+		    ns->ns_txcur = nm_ring_next(ring, ns->ns_txcur))
+			nsm->nsm_tx(ns, &ring->slot[ns->ns_txcur]);
+		if (nsm->nsm_txdone)
+			nsm->nsm_txdone(ns);
+	}
+	ns->ns_txcur = ring->head;
+	ring->tail = ring->head == 0 ? ring->num_slots-1 : ring->head-1;
+}
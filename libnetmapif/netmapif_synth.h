@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2026 The drv-netif-netmap contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Synthetic port internals, shared by the core and the modes.
+ *
+ * The region has one tx and one rx ring of NMSYNTH_NSLOTS slots.
+ * Buffer indices 0..NSLOTS-1 belong to the tx slots, NSLOTS..2*NSLOTS-1
+ * to the rx slots and the mode may ask for extra buffers after those,
+ * e.g. to stage frames once and then only point rx slots at them.
+ */
+
+#define NMSYNTH_NSLOTS	1024
+#define NMSYNTH_BUFSZ	2048
+
+struct nmsynth;
+
+struct nmsynth_mode {
+	const char *nsm_name;
+
+	/* link string option; EINVAL if not ours */
+	int	(*nsm_opt)(struct nmsynth_params *, const char *, const char *);
+
+	/* set up, and set ns_nextra, before the region exists */
+	int	(*nsm_open)(struct nmsynth *, const struct nmsynth_params *,
+			    const uint8_t *);
+	/* the region now exists: fill the extra buffers */
+	void	(*nsm_stage)(struct nmsynth *);
+
+	/*
+	 * Receiver context, in place of NIOCRXSYNC: fill rx slots from
+	 * ring->tail up to (not including) ring->head-1 with frames due
+	 * by now and advance tail.  Returns non-zero if more frames will
+	 * be due later, with the time until then in *wait.
+	 */
+	int	(*nsm_rxsync)(struct nmsynth *, struct timespec *);
+
+	/* sender context, for every frame in NIOCTXSYNC, may be NULL */
+	void	(*nsm_tx)(struct nmsynth *, struct netmap_slot *);
+	/* around the nsm_tx calls of a NIOCTXSYNC with frames, may be NULL */
+	void	(*nsm_txbegin)(struct nmsynth *);
+	void	(*nsm_txdone)(struct nmsynth *);
+
+	void	(*nsm_close)(struct nmsynth *);
+};
+
+struct nmsynth {
+	const struct nmsynth_mode *ns_mode;
+	void *ns_modearg;
+	char ns_descr[64];		/* mode description, for humans */
+
+	struct netmap_ring *ns_txring;
+	struct netmap_ring *ns_rxring;
+	uint32_t ns_txcur;		/* next tx slot to consume */
+
+	uint32_t ns_nextra;		/* extra buffers wanted by the mode */
+	uint32_t ns_extra;		/* index of the first one */
+
+	int ns_bellfd;			/* write end of the viu_fd pipe */
+};
+
+#define NMSYNTH_BUF(ns, idx)	NETMAP_BUF((ns)->ns_rxring, (idx))
+#define NMSYNTH_RXBUF(i)	(NMSYNTH_NSLOTS + (i))	/* rx slot i's own */
+
+extern const struct nmsynth_mode nmsynth_replay;
+extern const struct nmsynth_mode nmsynth_pktgen;
+extern const struct nmsynth_mode nmsynth_loop;
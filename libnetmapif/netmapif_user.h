@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2013 Antti Kantee.  All Rights Reserved.
+ * Copyright (c) 2026 The drv-netif-netmap contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Internals of the netmap backend shared between its hypercall
+ * source files.
+ */
+
+struct nmsynth;
+struct nmport;
+
+#define NETMAPIF_MAXTXR	32	/* tx rings used, at most */
+#define NETMAPIF_BUDGET	256	/* frames delivered per wakeup */
+#define NETMAPIF_SHEDUSECS 200	/* drop in the ring this long on overload */
+
+struct virtif_user {
+	int viu_fd;
+	pthread_t viu_pt;
+	struct vif_runctl viu_runctl;
+
+	struct virtif_sc *viu_virtifsc;
+	char viu_ifname[IFNAMSIZ];
+	char viu_placement[48];	/* where the receiver runs, for humans */
+
+	void *nm_nifp; /* points to nifp if we use netmap */
+	char *nm_mem;	/* redundant */
+	size_t nm_memsize;
+
+	/*
+	 * The ring pairs we use start at viu_ring0.  Every tx ring is
+	 * bound to a descriptor of its own, so that NIOCTXSYNC on one
+	 * ring does not contend with a sender on another.  With a
+	 * single ring that is viu_fd.  The receiver polls viu_fd for
+	 * all the rings, or the descriptors of a subset (see "rings=").
+	 */
+	unsigned int viu_ring0;
+	unsigned int viu_nrxr;
+	unsigned int viu_ntxr;
+	int viu_txfd[NETMAPIF_MAXTXR];
+	unsigned int viu_nrxfd;
+	int viu_rxfd[NETMAPIF_MAXTXR];
+
+	/* non-NULL if there is no netmap port behind us, see below */
+	struct nmsynth *viu_synth;
+
+	/* non-NULL if we share the port with others, see netmapif_demux.c */
+	struct nmport *viu_port;
+	int viu_vlan;		/* our 802.1Q VLAN on it, -1: by address */
+	int viu_active;		/* frames are delivered to us */
+	uint8_t viu_enaddr[6];
+	struct virtif_user *viu_machash;	/* the port's address table */
+	struct virtif_user *viu_macnext;	/* all members by address */
+
+	struct vif_capture *viu_cap;	/* NULL if not capturing */
+	struct vif_coalesce viu_coal;
+
+	/* receive overload control, receiver only */
+	unsigned int viu_budget;
+	unsigned int viu_nextring;	/* deliver from this one first */
+	uint64_t viu_shedend;		/* ns, 0: not shedding */
+
+	/*
+	 * Statistics.  The rx counters are written only by the receiver
+	 * thread and the tx counters of a ring only by its senders.
+	 * Those hold the kernel's lock of the ring (or the tx lock of
+	 * a shared port) while they send, so no atomics are needed.
+	 * Readers sum them up and may see slightly stale values.
+	 */
+	unsigned int viu_nstatrings;
+	struct virtif_stats *viu_rxstats;	/* per rx ring */
+	struct virtif_stats *viu_txstats;	/* per tx ring */
+	struct virtif_stats viu_rcvstats;	/* receiver thread */
+
+#ifdef VIRTIF_CYCLES
+	/* rx stages are written by the receiver, tx stages by senders */
+	struct vif_cychist viu_cyc[VIFCYC_NSTAGES];
+#endif
+};
+
+/*
+ * Synthetic ports.  An interface name which is one of the mode names
+ * (e.g. "replay") selects a stand-in for a netmap port which needs
+ * neither a NIC nor the netmap module: a region laid out like the
+ * one NIOCREGIF maps is built in process memory, and the mode plays
+ * the part of the kernel in the receiver's poll and in NIOCTXSYNC.
+ * The packet path above the rings is the same as for a real port.
+ */
+struct nmsynth_params {
+	/* replay */
+	char nsp_file[256];	/* pcap or pcapng trace */
+	char nsp_out[256];	/* write transmitted frames here */
+	double nsp_speed;	/* 0: as fast as possible, else time scale */
+	unsigned long nsp_repeat; /* passes over the trace, 0: forever */
+	int nsp_rewrite;	/* unicast destination := our address */
+
+	/* pktgen */
+	double nsp_rate;	/* frames per second, 0: as fast as possible */
+	uint64_t nsp_count;	/* frames to generate, 0: forever */
+	unsigned int nsp_flows;	/* distinct 5-tuples */
+	unsigned int nsp_minsize; /* frame sizes, without the FCS */
+	unsigned int nsp_maxsize;
+	int nsp_proto;		/* IPPROTO_UDP, IPPROTO_TCP, 0: both */
+	uint32_t nsp_src;	/* IPv4 addresses, network byte order */
+	uint32_t nsp_dst;
+	uint16_t nsp_dport;
+
+	/* loop */
+	char nsp_pair[32];	/* pair with the other port of this name */
+};
+
+/*
+ * Parameters parsed from the link string, which is of the form
+ * "ifname[,option[=value]]...".
+ */
+struct netmapif_params {
+	char np_ifname[IFNAMSIZ];
+	int np_prefault;	/* fault in the whole mapping at create */
+	int np_mlock;		/* and keep it resident */
+	int np_hugepage;	/* advise the VM to use huge pages */
+	struct vif_cpuspec np_cpu;
+	struct vif_capspec np_cap;
+	struct nmsynth_params np_synth;
+	unsigned int np_ring0;	/* use np_nrings ring pairs from here */
+	unsigned int np_nrings;	/* 0: all */
+	int np_budget;		/* frames per receiver wakeup */
+	int np_vlan;		/* -1: no VLAN */
+	int np_shared;		/* share the port, demultiplex by address */
+	int np_hasmac;
+	uint8_t np_mac[6];	/* our address if np_hasmac */
+};
+
+int	netmapif_openport(const struct netmapif_params *, struct virtif_user *,
+			  uint8_t *);
+void	netmapif_closeport(struct virtif_user *);
+
+int	nmport_join(const struct netmapif_params *, struct virtif_user *,
+		    uint8_t *);
+void	nmport_leave(struct virtif_user *);
+void	nmport_setactive(struct virtif_user *, int);
+pthread_mutex_t *nmport_txlock(struct virtif_user *, int);
+
+void	nmsynth_init(struct nmsynth_params *);
+int	nmsynth_match(const char *);
+int	nmsynth_opt(const char *, struct nmsynth_params *,
+		    const char *, const char *);
+int	nmsynth_open(const struct netmapif_params *, struct virtif_user *,
+		     const uint8_t *);
+void	nmsynth_close(struct virtif_user *);
+void	nmsynth_info(struct virtif_user *, char *, size_t);
+int	nmsynth_poll(struct virtif_user *, struct pollfd *, nfds_t);
+void	nmsynth_rxsync(struct virtif_user *);
+void	nmsynth_txsync(struct virtif_user *);
@@ -24,6 +24,10 @@
  * SUCH DAMAGE.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE	/* pthread_attr_setaffinity_np(), ppoll() */
+#endif
+
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
@@ -34,6 +38,7 @@
 #include <fcntl.h>
 #include <ifaddrs.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
@@ -48,18 +53,10 @@
 #include <rump/rumpuser_component.h>
 
 #include "if_virt.h"
+#include "virtif_cycles.h"
 #include "rumpcomp_user.h"
-
-struct virtif_user {
-	int viu_fd;
-	int viu_dying;
-	pthread_t viu_pt;
-
-	struct virtif_sc *viu_virtifsc;
-
-	void *nm_nifp; /* points to nifp if we use netmap */
-	char *nm_mem;	/* redundant */
-};
+#include "rumpcomp_vif.h"
+#include "netmapif_user.h"
 
 #ifdef NETMAPIF_DEBUG
 #define DPRINTF(x) printf x
@@ -69,11 +66,181 @@ struct virtif_user {
 
 static int source_hwaddr(const char *, uint8_t *);
 
+/* "rings=N" or "rings=N-M" */
+static int
+parserings(const char *val, struct netmapif_params *np)
+{
+	unsigned long first, last;
+	char *ep;
+
+	first = last = strtoul(val, &ep, 10);
+	if (ep != val && *ep == '-') {
+		val = ep + 1;
+		last = strtoul(val, &ep, 10);
+	}
+	if (ep == val || *ep != '\0' || last < first || last - first >= NETMAPIF_MAXTXR
+	    || last > NETMAP_RING_MASK)
+		return EINVAL;
+	np->np_ring0 = first;
+	np->np_nrings = last - first + 1;
+	return 0;
+}
+
 static int
-opennetmap(const char *devstr, struct virtif_user *viu, uint8_t *enaddr)
+netmapopt(void *arg, const char *opt, const char *val)
 {
+	struct netmapif_params *np = arg;
+	unsigned long v;
+	char *ep;
+	int rv;
+
+	if (strcmp(opt, "prefault") == 0 && val == NULL) {
+		np->np_prefault = 1;
+	} else if (strcmp(opt, "mlock") == 0 && val == NULL) {
+		np->np_mlock = 1;
+	} else if (strcmp(opt, "hugepage") == 0 && val == NULL) {
+		np->np_hugepage = 1;
+	} else if (strcmp(opt, "cpu") == 0) {
+		return vif_cpuspec_parse(val, &np->np_cpu);
+	} else if (strcmp(opt, "rings") == 0 && val != NULL) {
+		return parserings(val, np);
+	} else if (strcmp(opt, "budget") == 0 && val != NULL) {
+		v = strtoul(val, &ep, 10);
+		if (*val == '\0' || *ep != '\0' || v < 1 || v > INT_MAX)
+			return EINVAL;
+		np->np_budget = v;
+	} else if (strcmp(opt, "vlan") == 0 && val != NULL) {
+		v = strtoul(val, &ep, 10);
+		if (*val == '\0' || *ep != '\0' || v < 1 || v > 4094
+		    || np->np_shared)
+			return EINVAL;
+		np->np_vlan = v;
+	} else if (strcmp(opt, "shared") == 0 && val == NULL) {
+		if (np->np_vlan != -1)
+			return EINVAL;
+		np->np_shared = 1;
+	} else if (strcmp(opt, "mac") == 0 && val != NULL) {
+		if (np->np_vlan != -1 || sscanf(val,
+		    "%2hhx:%2hhx:%2hhx:%2hhx:%2hhx:%2hhx",
+		    &np->np_mac[0], &np->np_mac[1], &np->np_mac[2],
+		    &np->np_mac[3], &np->np_mac[4], &np->np_mac[5]) != 6)
+			return EINVAL;
+		np->np_hasmac = np->np_shared = 1;
+	} else if ((rv = vif_capspec_opt(&np->np_cap, opt, val)) != EINVAL) {
+		return rv;
+	} else {
+		return nmsynth_opt(np->np_ifname, &np->np_synth, opt, val);
+	}
+	return 0;
+}
+
+static int
+parselinkstr(const char *linkstr, struct netmapif_params *np)
+{
+
+	memset(np, 0, sizeof(*np));
+	np->np_vlan = -1;
+	np->np_budget = NETMAPIF_BUDGET;
+	vif_cpuspec_init(&np->np_cpu);
+	vif_capspec_init(&np->np_cap);
+	nmsynth_init(&np->np_synth);
+	return vif_parselinkstr("netmapif", linkstr,
+	    np->np_ifname, sizeof(np->np_ifname), netmapopt, np);
+}
+
+#ifdef __linux__
+/*
+ * Report the page size the kernel actually backs the mapping with
+ * and how much of it is locked, as seen in /proc/self/smaps.
+ */
+static void
+reportbacking(void *addr, char *buf, size_t buflen)
+{
+	char line[256], kps[32] = "?", lck[32] = "?";
+	unsigned long start, end;
+	int found = 0;
+	FILE *fp;
+
+	snprintf(buf, buflen, "backing unknown");
+	if ((fp = fopen("/proc/self/smaps", "r")) == NULL)
+		return;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+			if (found)
+				break;
+			found = start == (unsigned long)addr;
+		} else if (found) {
+			sscanf(line, "KernelPageSize: %31[^\n]", kps);
+			sscanf(line, "Locked: %31[^\n]", lck);
+		}
+	}
+	fclose(fp);
+
+	snprintf(buf, buflen, "page size %s, locked %s", kps, lck);
+}
+#else
+static void
+reportbacking(void *addr, char *buf, size_t buflen)
+{
+
+	snprintf(buf, buflen, "backing unknown");
+}
+#endif
+
+/*
+ * Fault in (and optionally wire) the shared netmap region so that the
+ * first packets through each ring and buffer do not take page faults.
+ * This covers the rings, slots and all buffers, including the ones
+ * currently not attached to any slot.
+ */
+static void
+warmnetmap(const struct netmapif_params *np, struct virtif_user *viu,
+	int populated)
+{
+	char backing[128], thp[64] = "";
+	long pgsz = sysconf(_SC_PAGESIZE);
+	volatile char *p;
+	size_t off;
+
+	if (np->np_hugepage) {
+#ifdef MADV_HUGEPAGE
+		if (madvise(viu->nm_mem, viu->nm_memsize, MADV_HUGEPAGE) == 0)
+			snprintf(thp, sizeof(thp), ", THP advised");
+		else
+			snprintf(thp, sizeof(thp), ", THP advice rejected (%s)",
+			    strerror(errno));
+#else
+		snprintf(thp, sizeof(thp), ", THP not supported");
+#endif
+	}
+
+	if (np->np_prefault && !populated) {
+		for (off = 0; off < viu->nm_memsize; off += pgsz) {
+			p = viu->nm_mem + off;
+			(void)*p;
+		}
+	}
+
+	if (np->np_mlock && mlock(viu->nm_mem, viu->nm_memsize) == -1) {
+		fprintf(stderr, "netmap:%s: mlock failed: %s\n",
+		    np->np_ifname, strerror(errno));
+	}
+
+	reportbacking(viu->nm_mem, backing, sizeof(backing));
+	fprintf(stderr, "netmap:%s: %zu kB mapped%s%s, %s%s\n",
+	    np->np_ifname, viu->nm_memsize >> 10,
+	    np->np_prefault ? ", prefaulted" : "",
+	    np->np_mlock ? ", mlocked" : "", backing, thp);
+}
+
+static int
+opennetmap(const struct netmapif_params *np, struct virtif_user *viu,
+	uint8_t *enaddr)
+{
+	const char *devstr = np->np_ifname;
 	int fd = -1;
 	struct nmreq req;
+	int mflags, populated = 0;
 	int err = 0;
 
 	/* fprintf(stderr, "trying to use netmap on %s\n", devstr); */
@@ -87,17 +254,32 @@ opennetmap(const char *devstr, struct virtif_user *viu, uint8_t *enaddr)
 	req.nr_version = NETMAP_API;
 	strncpy(req.nr_name, devstr, sizeof(req.nr_name));
 	req.nr_ringid = NETMAP_NO_TX_POLL;
+	if (np->np_nrings) {
+		/* the others are bound by openrings() */
+		req.nr_flags = NR_REG_ONE_NIC;
+		req.nr_ringid |= np->np_ring0;
+	}
 	err = ioctl(fd, NIOCREGIF, &req);
 	if (err) {
+		err = errno;
 		fprintf(stderr, "Unable to register %s errno  %d\n",
 		    req.nr_name, errno);
 		goto out;
 	}
 	/* fprintf(stderr, "need %d MB\n", req.nr_memsize >> 20); */
 
+	mflags = MAP_SHARED;
+#ifdef MAP_POPULATE
+	if (np->np_prefault) {
+		mflags |= MAP_POPULATE;
+		populated = 1;
+	}
+#endif
+	viu->nm_memsize = req.nr_memsize;
 	viu->nm_mem = mmap(0, req.nr_memsize,
-	    PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+	    PROT_WRITE | PROT_READ, mflags, fd, 0);
 	if (viu->nm_mem == MAP_FAILED) {
+		err = errno;
 		fprintf(stderr, "Unable to mmap\n");
 		viu->nm_mem = NULL;
 		goto out;
@@ -105,6 +287,9 @@ opennetmap(const char *devstr, struct virtif_user *viu, uint8_t *enaddr)
 	viu->nm_nifp = NETMAP_IF(viu->nm_mem, req.nr_offset);
 	/* fprintf(stderr, "netmap:%s mem %d\n", devstr, req.nr_memsize); */
 
+	if (np->np_prefault || np->np_mlock || np->np_hugepage)
+		warmnetmap(np, viu, populated);
+
 	if (source_hwaddr(devstr, enaddr) != 0) {
 		if (strncmp(devstr, "vale", 4) != 0) {
 			fprintf(stderr, "netmap:%s: failed to retrieve "
@@ -116,10 +301,162 @@ opennetmap(const char *devstr, struct virtif_user *viu, uint8_t *enaddr)
 	if (err && fd != -1) {
 		close(fd);
 		fd = -1;
+		errno = err;
 	}
 	return fd;
 }
 
+/* bind ring pair "ring" of the port to a new descriptor */
+static int
+bindring(const struct netmapif_params *np, unsigned int ring)
+{
+	struct nmreq req;
+	int fd, error;
+
+	if ((fd = open("/dev/netmap", O_RDWR)) == -1)
+		return -1;
+	memset(&req, 0, sizeof(req));
+	req.nr_version = NETMAP_API;
+	strncpy(req.nr_name, np->np_ifname, sizeof(req.nr_name));
+	req.nr_flags = NR_REG_ONE_NIC;
+	req.nr_ringid = ring | NETMAP_NO_TX_POLL;
+	if (ioctl(fd, NIOCREGIF, &req) == -1) {
+		error = errno;
+		close(fd);
+		errno = error;
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Bind each ring pair we use to a descriptor of its own, on the
+ * region that is already mapped.  With all the rings, the receiver
+ * polls viu_fd and only tx uses the descriptors.  If binding them
+ * fails, all frames go to ring 0.  With a subset of the rings, viu_fd
+ * is bound to the first of them and the receiver polls them all.
+ */
+static int
+openrings(const struct netmapif_params *np, struct virtif_user *viu)
+{
+	struct netmap_if *nifp = viu->nm_nifp;
+	unsigned int i, n;
+	int fd;
+
+	viu->viu_ring0 = 0;
+	viu->viu_nrxr = nifp->ni_rx_rings;
+	viu->viu_ntxr = 1;
+	viu->viu_txfd[0] = viu->viu_fd;
+	viu->viu_nrxfd = 1;
+	viu->viu_rxfd[0] = viu->viu_fd;
+	if (viu->viu_synth != NULL)
+		return np->np_nrings ? EINVAL : 0;
+	if (np->np_nrings) {
+		viu->viu_ring0 = np->np_ring0;
+		viu->viu_nrxr = np->np_nrings;
+	}
+
+	if (np->np_nrings)
+		n = np->np_nrings;
+	else if ((n = nifp->ni_tx_rings) > NETMAPIF_MAXTXR)
+		n = NETMAPIF_MAXTXR;
+	if (n == 1)
+		return 0;
+
+	for (i = np->np_nrings ? 1 : 0; i < n; i++) {
+		if ((fd = bindring(np, viu->viu_ring0 + i)) == -1)
+			break;
+		viu->viu_txfd[i] = fd;
+	}
+	if (i < n) {
+		fprintf(stderr, "netmap:%s: cannot bind ring %u: %s%s\n",
+		    np->np_ifname, viu->viu_ring0 + i, strerror(errno),
+		    np->np_nrings ? "" : ", sending on ring 0 only");
+		fd = errno;
+		while (i-- > 0) {
+			if (viu->viu_txfd[i] != viu->viu_fd)
+				close(viu->viu_txfd[i]);
+		}
+		viu->viu_txfd[0] = viu->viu_fd;
+		return np->np_nrings ? fd : 0;
+	}
+	viu->viu_ntxr = n;
+	if (np->np_nrings) {
+		viu->viu_nrxfd = n;
+		memcpy(viu->viu_rxfd, viu->viu_txfd, n * sizeof(int));
+	}
+	return 0;
+}
+
+static unsigned int
+rxready(struct virtif_user *viu)
+{
+	struct netmap_if *nifp = viu->nm_nifp;
+	unsigned int i, n;
+
+	for (i = viu->viu_ring0, n = 0; i < viu->viu_ring0 + viu->viu_nrxr;
+	    i++)
+		n += nm_ring_space(NETMAP_RXRING(nifp, i));
+	return n;
+}
+
+/*
+ * Hold back a partial batch (see struct virtif_coalesce).  The wait
+ * is slept in quarters with only the run control descriptor polled,
+ * so that the rings are looked at again in between and a stop still
+ * ends it at once.
+ */
+static void
+coalesce(struct virtif_user *viu, struct pollfd *kick)
+{
+	struct vif_coalesce *vco = &viu->viu_coal;
+	struct timespec ts;
+	uint64_t now, end, step;
+	unsigned int n, nready, usecs;
+
+	nready = rxready(viu);
+	if ((usecs = vif_coalesce_wait(vco, nready)) == 0)
+		return;
+
+	step = usecs * 1000ULL / 4;
+	end = vif_nsecs() + usecs * 1000ULL;
+	while (nready < vco->vco_frames && (now = vif_nsecs()) < end) {
+		if (end - now < step)
+			step = end - now;
+		ts.tv_sec = 0;
+		ts.tv_nsec = step;
+		if (ppoll(kick, 1, &ts, NULL) > 0)
+			break;
+		if (viu->viu_synth != NULL) {
+			nmsynth_rxsync(viu);
+		} else {
+			for (n = 0; n < viu->viu_nrxfd; n++)
+				ioctl(viu->viu_rxfd[n], NIOCRXSYNC, NULL);
+		}
+		nready = rxready(viu);
+	}
+}
+
+/*
+ * Overload: drop whatever the rings hold without looking at it, let
+ * alone copying it or scheduling for it.  The stack works off its
+ * backlog meanwhile.
+ */
+static void
+shed(struct virtif_user *viu)
+{
+	struct netmap_if *nifp = viu->nm_nifp;
+	struct netmap_ring *ring;
+	unsigned int i;
+
+	for (i = viu->viu_ring0; i < viu->viu_ring0 + viu->viu_nrxr; i++) {
+		ring = NETMAP_RXRING(nifp, i);
+		viu->viu_rxstats[i].vs_drops[VIFSTAT_DROP_SHED]
+		    += nm_ring_space(ring);
+		ring->head = ring->cur = ring->tail;
+	}
+}
+
 /*
  * Note: this thread is the only one pulling packets off of any
  * given netmap instance
@@ -132,86 +469,274 @@ receiver(void *arg)
 	struct netmap_if *nifp = viu->nm_nifp;
 	struct netmap_ring *ring;
 	struct netmap_slot *slot;
-	struct pollfd pfd;
-	unsigned int i;
-	int prv;
+	struct virtif_stats *vs;
+	struct pollfd pfd[NETMAPIF_MAXTXR + 1];
+	unsigned int i, n, r, npkt;
+	int prv, overload;
+	VIFCYC_DECL(t);
 
 	rumpuser_component_kthread();
 
 	for (;;) {
-		pfd.fd = viu->viu_fd;
-		pfd.events = POLLIN;
-
-		if (viu->viu_dying) {
+		/* an interface which is down does not poll at all */
+		if (vif_runctl_wait(&viu->viu_runctl))
 			break;
+
+		for (n = 0; n < viu->viu_nrxfd; n++) {
+			pfd[n].fd = viu->viu_rxfd[n];
+			pfd[n].events = POLLIN;
 		}
+		pfd[n].fd = vif_runctl_fd(&viu->viu_runctl);
+		pfd[n].events = POLLIN;
 
-		prv = 0;
-		while (prv == 0) {
-			DPRINTF(("receive pkt via netmap\n"));
-			prv = poll(&pfd, 1, 1000);
-			if (prv > 0 || (prv < 0 && errno != EAGAIN))
-				break;
+		DPRINTF(("receive pkt via netmap\n"));
+		VIFCYC_STAMP(t);
+		if (viu->viu_synth != NULL)
+			prv = nmsynth_poll(viu, pfd, n + 1);
+		else
+			prv = poll(pfd, n + 1, -1);
+		VIFCYC_LAP(viu->viu_cyc, VIFCYC_POLL, t);
+		if (prv < 0) {
+			if (errno != EINTR && errno != EAGAIN) {
+				fprintf(stderr, "netmapif: poll failed: %s\n",
+				    strerror(errno));
+			}
+			continue;
 		}
-#if 0
-		/* XXX: report non-transient errors */
-		if (ring->avail == 0) {
-			rv = errno;
-			break;
+		if (pfd[n].revents & POLLIN) {
+			/* state changed, re-evaluate before delivering */
+			continue;
 		}
-#endif
-		for (i = 0; i < nifp->ni_rx_rings; i++) {
+		if (viu->viu_shedend != 0) {
+			if (vif_nsecs() < viu->viu_shedend) {
+				shed(viu);
+				continue;
+			}
+			viu->viu_shedend = 0;
+		}
+		coalesce(viu, &pfd[n]);
+
+		/*
+		 * Deliver up to a budget's worth of what the rings hold
+		 * within one scheduled section, starting with a different
+		 * ring every time.  What is left over waits for the next
+		 * pass, so that the threads of the stack get to run in
+		 * between.  VIF_DELIVERPKT copies the frame, so each slot
+		 * can be returned right away.
+		 */
+		npkt = 0;
+		overload = 0;
+		for (r = 0; r < viu->viu_nrxr && npkt < viu->viu_budget
+		    && !overload; r++) {
+			i = viu->viu_ring0 + (viu->viu_nextring + r)
+			    % viu->viu_nrxr;
 			ring = NETMAP_RXRING(nifp, i);
-			while (!nm_ring_empty(ring)) {
+			vs = &viu->viu_rxstats[i];
+			while (!nm_ring_empty(ring) && npkt < viu->viu_budget
+			    && !overload) {
 				slot = &ring->slot[ring->cur];
 				DPRINTF(("got pkt of size %d\n", slot->len));
 				iov.iov_base = NETMAP_BUF(ring, slot->buf_idx);
 				iov.iov_len = slot->len;
+				vs->vs_ipackets++;
+				vs->vs_ibytes += slot->len;
 
-				/* XXX: allow batch processing */
-				rumpuser_component_schedule(NULL);
-				VIF_DELIVERPKT(viu->viu_virtifsc, &iov, 1);
-				rumpuser_component_unschedule();
+				if (npkt++ == 0) {
+					VIFCYC_STAMP(t);
+					rumpuser_component_schedule(NULL);
+					VIFCYC_LAP(viu->viu_cyc,
+					    VIFCYC_SCHED, t);
+				}
+				VIF_CAPTURE(viu->viu_cap, &iov, 1, 0);
+				overload = VIF_DELIVERPKT(viu->viu_virtifsc,
+				    &iov, 1) == VIF_RXOVERLOAD;
 
 				ring->head = ring->cur = nm_ring_next(ring, ring->cur);
 			}
 		}
+		if (npkt)
+			rumpuser_component_unschedule();
+		if (++viu->viu_nextring == viu->viu_nrxr)
+			viu->viu_nextring = 0;
+		if (overload) {
+			viu->viu_shedend = vif_nsecs()
+			    + NETMAPIF_SHEDUSECS * 1000ULL;
+			shed(viu);
+		}
+		vif_stats_batch(&viu->viu_rcvstats, npkt);
+		vif_coalesce_batch(&viu->viu_coal, npkt);
 	}
 
 	rumpuser_component_kthread_release();
 	return NULL;
 }
 
+/* open the port for viu alone, or for the members of a shared port */
+int
+netmapif_openport(const struct netmapif_params *np, struct virtif_user *viu,
+	uint8_t *enaddr)
+{
+	int rv;
+
+	viu->viu_synth = NULL;
+	viu->viu_port = NULL;
+	viu->viu_vlan = -1;
+	if (nmsynth_match(np->np_ifname)) {
+		if (np->np_vlan != -1 || np->np_shared)
+			return EINVAL;
+		if ((rv = nmsynth_open(np, viu, enaddr)) != 0)
+			return rv;
+	} else if ((viu->viu_fd = opennetmap(np, viu, enaddr)) == -1) {
+		return errno;
+	}
+	if ((rv = openrings(np, viu)) != 0) {
+		netmapif_closeport(viu);
+		return rv;
+	}
+	return 0;
+}
+
+void
+netmapif_closeport(struct virtif_user *viu)
+{
+	unsigned int i;
+
+	for (i = 0; i < viu->viu_ntxr; i++) {
+		if (viu->viu_txfd[i] != viu->viu_fd)
+			close(viu->viu_txfd[i]);
+	}
+	if (viu->viu_synth != NULL)
+		nmsynth_close(viu);
+	munmap(viu->nm_mem, viu->nm_memsize);
+	close(viu->viu_fd);
+}
+
+static void
+closeport(struct virtif_user *viu)
+{
+
+	if (viu->viu_port != NULL)
+		nmport_leave(viu);
+	else
+		netmapif_closeport(viu);
+}
+
+static int
+allocstats(struct virtif_user *viu)
+{
+	struct netmap_if *nifp = viu->nm_nifp;
+	unsigned int n;
+
+	n = nifp->ni_rx_rings > nifp->ni_tx_rings
+	    ? nifp->ni_rx_rings : nifp->ni_tx_rings;
+	viu->viu_rxstats = calloc(n, sizeof(*viu->viu_rxstats));
+	viu->viu_txstats = calloc(n, sizeof(*viu->viu_txstats));
+	if (viu->viu_rxstats == NULL || viu->viu_txstats == NULL) {
+		free(viu->viu_rxstats);
+		free(viu->viu_txstats);
+		return ENOMEM;
+	}
+	memset(&viu->viu_rcvstats, 0, sizeof(viu->viu_rcvstats));
+	viu->viu_nstatrings = n;
+#ifdef VIRTIF_CYCLES
+	memset(viu->viu_cyc, 0, sizeof(viu->viu_cyc));
+#endif
+	return 0;
+}
+
+static void
+freestats(struct virtif_user *viu)
+{
+
+	free(viu->viu_rxstats);
+	free(viu->viu_txstats);
+}
+
 int
 VIFHYPER_CREATE(const char *devstr, struct virtif_sc *vif_sc, uint8_t *enaddr,
 	struct virtif_user **viup)
 {
 	struct virtif_user *viu = NULL;
+	struct netmapif_params np;
+	pthread_attr_t attr;
 	void *cookie;
 	int rv;
 
 	cookie = rumpuser_component_unschedule();
 
+	if ((rv = parselinkstr(devstr, &np)) != 0)
+		goto out;
+
 	viu = malloc(sizeof(*viu));
 	if (viu == NULL) {
 		rv = errno;
 		goto out;
 	}
 
-	viu->viu_fd = opennetmap(devstr, viu, enaddr);
-	if (viu->viu_fd == -1) {
-		rv = errno;
+	if ((np.np_vlan != -1 || np.np_shared) && !nmsynth_match(np.np_ifname))
+		rv = nmport_join(&np, viu, enaddr);
+	else
+		rv = netmapif_openport(&np, viu, enaddr);
+	if (rv != 0) {
+		free(viu);
+		viu = NULL;
+		goto out;
+	}
+	if ((rv = allocstats(viu)) != 0) {
+		closeport(viu);
+		free(viu);
+		viu = NULL;
+		goto out;
+	}
+	if ((rv = vif_runctl_init(&viu->viu_runctl)) != 0) {
+		freestats(viu);
+		closeport(viu);
+		free(viu);
+		viu = NULL;
+		goto out;
+	}
+	if ((rv = vif_capture_open(&viu->viu_cap, &np.np_cap,
+	    np.np_ifname)) != 0) {
+		vif_runctl_fini(&viu->viu_runctl);
+		freestats(viu);
+		closeport(viu);
 		free(viu);
+		viu = NULL;
 		goto out;
 	}
-	viu->viu_dying = 0;
 	viu->viu_virtifsc = vif_sc;
+	strcpy(viu->viu_ifname, np.np_ifname);
+	vif_coalesce_init(&viu->viu_coal);
+	viu->viu_budget = np.np_budget;
+	viu->viu_nextring = 0;
+	viu->viu_shedend = 0;
 
-	if ((rv = pthread_create(&viu->viu_pt, NULL, receiver, viu)) != 0) {
+	/* the receiver of a shared port is the port's */
+	if (viu->viu_port != NULL)
+		goto out;
+
+	pthread_attr_init(&attr);
+	if ((rv = vif_placethread(np.np_ifname, &np.np_cpu, -1, &attr,
+	    viu->viu_placement, sizeof(viu->viu_placement))) != 0) {
+		fprintf(stderr, "netmap:%s: cannot pin receiver: %s\n",
+		    np.np_ifname, strerror(rv));
+		snprintf(viu->viu_placement, sizeof(viu->viu_placement),
+		    "rx unpinned");
+		pthread_attr_destroy(&attr);
+		pthread_attr_init(&attr);
+	}
+	rv = pthread_create(&viu->viu_pt, &attr, receiver, viu);
+	pthread_attr_destroy(&attr);
+	if (rv != 0) {
 		printf("%s: pthread_create failed!\n",
 		    VIF_STRING(VIFHYPER_CREATE));
-		close(viu->viu_fd);
+		if (viu->viu_cap != NULL)
+			vif_capture_close(viu->viu_cap);
+		vif_runctl_fini(&viu->viu_runctl);
+		freestats(viu);
+		closeport(viu);
 		free(viu);
+		viu = NULL;
 	}
 
  out:
@@ -222,61 +747,228 @@ VIFHYPER_CREATE(const char *devstr, struct virtif_sc *vif_sc, uint8_t *enaddr,
 }
 
 void
-VIFHYPER_SEND(struct virtif_user *viu, struct iovec *iov, size_t iovlen)
+VIFHYPER_INFO(struct virtif_user *viu, char *buf, size_t buflen)
+{
+	struct netmap_if *nifp = viu->nm_nifp;
+	char descr[64];
+
+	if (viu->viu_synth != NULL) {
+		nmsynth_info(viu, descr, sizeof(descr));
+		snprintf(buf, buflen, "%s, %s", descr, viu->viu_placement);
+	} else if (viu->viu_nrxr != nifp->ni_rx_rings) {
+		snprintf(buf, buflen, "rings %u-%u, %s", viu->viu_ring0,
+		    viu->viu_ring0 + viu->viu_nrxr - 1, viu->viu_placement);
+	} else {
+		snprintf(buf, buflen, "%s", viu->viu_placement);
+	}
+}
+
+/* netmap slots carry bare frames, nothing to offload */
+int
+VIFHYPER_FLAGS(struct virtif_user *viu)
+{
+
+	return 0;
+}
+
+int
+VIFHYPER_STATS(struct virtif_user *viu, int ring, struct virtif_stats *vs)
+{
+	unsigned int i;
+
+	memset(vs, 0, sizeof(*vs));
+	if (ring >= (int)viu->viu_nstatrings)
+		return rumpuser_component_errtrans(ENOENT);
+
+	if (ring >= 0) {
+		vif_stats_add(vs, &viu->viu_rxstats[ring]);
+		vif_stats_add(vs, &viu->viu_txstats[ring]);
+		return 0;
+	}
+
+	for (i = 0; i < viu->viu_nstatrings; i++) {
+		vif_stats_add(vs, &viu->viu_rxstats[i]);
+		vif_stats_add(vs, &viu->viu_txstats[i]);
+	}
+	vif_stats_add(vs, &viu->viu_rcvstats);
+	return 0;
+}
+
+#ifdef VIRTIF_CYCLES
+struct vif_cychist *
+VIFHYPER_CYCLES(struct virtif_user *viu)
+{
+
+	return viu->viu_cyc;
+}
+#endif
+
+/*
+ * The receiver of a shared port serves all its members, so they
+ * cannot have settings of their own.
+ */
+int
+VIFHYPER_COALESCE(struct virtif_user *viu, struct virtif_coalesce *vc,
+	int set)
+{
+
+	if (viu->viu_port != NULL)
+		return rumpuser_component_errtrans(EOPNOTSUPP);
+	if (set)
+		vif_coalesce_set(&viu->viu_coal, vc);
+	vif_coalesce_get(&viu->viu_coal, vc);
+	return 0;
+}
+
+/* the kernel gives each cpu a ring of its own while there are enough */
+int
+VIFHYPER_TXRINGS(struct virtif_user *viu)
+{
+
+	return (int)viu->viu_ntxr;
+}
+
+/*
+ * Copy a batch of frames into the slots of the given tx ring and
+ * make them visible to the NIC with a single NIOCTXSYNC of that ring.
+ * Returns the number of frames queued; the rest were dropped for
+ * lack of ring space.
+ */
+int
+VIFHYPER_SEND(struct virtif_user *viu, int txring, struct iovec *iov,
+	const size_t *iovcnt, size_t npkt)
 {
 	void *cookie = NULL; /* XXXgcc */
 	struct netmap_if *nifp = viu->nm_nifp;
-	struct netmap_ring *ring = NETMAP_TXRING(nifp, 0);
+	struct netmap_ring *ring = NETMAP_TXRING(nifp, viu->viu_ring0 + txring);
+	struct virtif_stats *vs = &viu->viu_txstats[viu->viu_ring0 + txring];
+	int fd = viu->viu_txfd[txring];
 	char *p;
 	int retries;
 	int unscheduled = 0;
+	size_t pkt, sent = 0;
 	unsigned n;
+	int vtag;
+	VIFCYC_DECL(t);
 
-	DPRINTF(("sending pkt via netmap len %d\n", (int)iovlen));
-	for (retries = 10; !(n = nm_ring_space(ring)) && retries > 0; retries--) {
-		struct pollfd pfd;
-
-		if (!unscheduled) {
-			cookie = rumpuser_component_unschedule();
-			unscheduled = 1;
-		}
-		pfd.fd = viu->viu_fd;
-		pfd.events = POLLOUT;
-		DPRINTF(("cannot send on netmap, ring full\n"));
-		(void)poll(&pfd, 1, 500 /* ms */);
+	/* the other interfaces on a shared port use the same rings */
+	if (viu->viu_port != NULL) {
+		cookie = rumpuser_component_unschedule();
+		unscheduled = 1;
+		pthread_mutex_lock(nmport_txlock(viu, txring));
 	}
-	if (n > 0) {
+	vtag = viu->viu_vlan != -1 ? 4 : 0;
+
+	for (pkt = 0; pkt < npkt; iov += iovcnt[pkt], pkt++) {
 		unsigned int i;
 		int totlen = 0;
-		struct netmap_slot *slot = &ring->slot[ring->cur];
-#define MAX_BUF_SIZE 1900
-		p = NETMAP_BUF(ring, slot->buf_idx);
-		for (i = 0; totlen < MAX_BUF_SIZE && i < iovlen; i++) {
+		struct netmap_slot *slot;
+
+		DPRINTF(("sending pkt via netmap len %d\n",
+		    (int)iovcnt[pkt]));
+		for (retries = 10; !(n = nm_ring_space(ring)) && retries > 0;
+		    retries--) {
+			struct pollfd pfd;
+
+			if (!unscheduled) {
+				cookie = rumpuser_component_unschedule();
+				unscheduled = 1;
+			}
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			DPRINTF(("cannot send on netmap, ring full\n"));
+			(void)poll(&pfd, 1, 500 /* ms */);
+		}
+		if (n == 0)
+			break;
+
+		VIFCYC_STAMP(t);
+		slot = &ring->slot[ring->cur];
+#define MAX_BUF_SIZE (1900 - vtag)
+		p = NETMAP_BUF(ring, slot->buf_idx) + vtag;
+		for (i = 0; totlen < MAX_BUF_SIZE && i < iovcnt[pkt]; i++) {
 			int n = iov[i].iov_len;
 			if (totlen + n > MAX_BUF_SIZE) {
 				n = MAX_BUF_SIZE - totlen;
 				DPRINTF(("truncating long pkt"));
+				vs->vs_otruncated++;
 			}
 			memcpy(p + totlen, iov[i].iov_base, n);
 			totlen += n;
 		}
 #undef MAX_BUF_SIZE
-		slot->len = totlen;
+		if (vtag) {
+			/* move the addresses up front, the tag after them */
+			p -= vtag;
+			memmove(p, p + vtag, 12);
+			p[12] = 0x81;
+			p[13] = 0x00;
+			p[14] = viu->viu_vlan >> 8;
+			p[15] = viu->viu_vlan & 0xff;
+		}
+		slot->len = totlen + vtag;
 		ring->head = ring->cur = nm_ring_next(ring, ring->cur);
-		if (ioctl(viu->viu_fd, NIOCTXSYNC, NULL) < 0)
+		VIF_CAPTURE(viu->viu_cap, iov, iovcnt[pkt], 1);
+		VIFCYC_LAP(viu->viu_cyc, VIFCYC_TXCOPY, t);
+		vs->vs_opackets++;
+		vs->vs_obytes += totlen;
+		sent++;
+	}
+
+	if (sent > 0) {
+		VIFCYC_STAMP(t);
+		if (viu->viu_synth != NULL)
+			nmsynth_txsync(viu);
+		else if (ioctl(fd, NIOCTXSYNC, NULL) < 0)
 			perror("NIOCTXSYNC");
+		VIFCYC_LAP(viu->viu_cyc, VIFCYC_TXSYNC, t);
 	}
+	vs->vs_drops[VIFSTAT_DROP_TXFULL] += npkt - sent;
 
+	if (viu->viu_port != NULL)
+		pthread_mutex_unlock(nmport_txlock(viu, txring));
 	if (unscheduled)
 		rumpuser_component_schedule(cookie);
+	return (int)sent;
+}
+
+void
+VIFHYPER_START(struct virtif_user *viu)
+{
+	void *cookie;
+
+	if (viu->viu_port != NULL) {
+		cookie = rumpuser_component_unschedule();
+		nmport_setactive(viu, 1);
+		rumpuser_component_schedule(cookie);
+		return;
+	}
+	vif_runctl_start(&viu->viu_runctl);
+}
+
+void
+VIFHYPER_STOP(struct virtif_user *viu)
+{
+	void *cookie;
+
+	if (viu->viu_port != NULL) {
+		cookie = rumpuser_component_unschedule();
+		nmport_setactive(viu, 0);
+		rumpuser_component_schedule(cookie);
+		return;
+	}
+	vif_runctl_stop(&viu->viu_runctl);
 }
 
 void
 VIFHYPER_DYING(struct virtif_user *viu)
 {
 
-	/* no locking necessary.  it'll be seen eventually */
-	viu->viu_dying = 1;
+	if (viu->viu_port != NULL) {
+		VIFHYPER_STOP(viu);
+		return;
+	}
+	vif_runctl_dying(&viu->viu_runctl);
 }
 
 void
@@ -284,8 +976,16 @@ VIFHYPER_DESTROY(struct virtif_user *viu)
 {
 	void *cookie = rumpuser_component_unschedule();
 
-	pthread_join(viu->viu_pt, NULL);
-	close(viu->viu_fd);
+	if (viu->viu_port == NULL)
+		pthread_join(viu->viu_pt, NULL);
+	if (viu->viu_cap != NULL)
+		vif_capture_close(viu->viu_cap);
+#ifdef VIRTIF_CYCLES
+	vif_cycles_dump(viu->viu_ifname, viu->viu_cyc);
+#endif
+	vif_runctl_fini(&viu->viu_runctl);
+	freestats(viu);
+	closeport(viu);
 	free(viu);
 
 	rumpuser_component_schedule(cookie);
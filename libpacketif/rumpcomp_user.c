@@ -0,0 +1,837 @@
+/*
+ * Copyright (c) 2026 The drv-netif-netmap contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Linux packet socket backend.  Frames are received from memory-mapped
+ * TPACKET_V3 block rings, optionally spread over several sockets and
+ * receiver threads with PACKET_FANOUT, and sent through a TPACKET_V2
+ * tx ring which bypasses the qdisc layer and is flushed once per batch.
+ */
+
+#define _GNU_SOURCE	/* pthread_attr_setaffinity_np() */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <linux/ethtool.h>
+#include <linux/if_packet.h>
+#include <linux/sockios.h>
+
+#include <rump/rumpuser_component.h>
+
+#include "if_virt.h"
+#include "virtif_cycles.h"
+#include "rumpcomp_user.h"
+#include "rumpcomp_vif.h"
+
+/*
+ * Ring geometry.  A receive block is handed to us when it is full or
+ * after PKT_RXTMO milliseconds, whichever comes first; the receiver
+ * then harvests all blocks that are ready.
+ */
+#define PKT_RXBLKSZ	(256*1024)
+#define PKT_RXNBLK	16
+#define PKT_RXTMO	1		/* ms */
+#define PKT_RXFRAMESZ	2048		/* nominal, V3 frames are packed */
+
+#define PKT_TXFRAMESZ	2048
+#define PKT_TXBLKSZ	(64*1024)
+#define PKT_TXNBLK	8
+#define PKT_TXNFRAME	(PKT_TXNBLK * (PKT_TXBLKSZ / PKT_TXFRAMESZ))
+
+/* frame data follows the tpacket2 header and the sockaddr_ll slot */
+#define PKT_TXDATAOFF	(TPACKET2_HDRLEN - sizeof(struct sockaddr_ll))
+#define PKT_TXMAXLEN	(PKT_TXFRAMESZ - PKT_TXDATAOFF)
+
+/*
+ * Largest frame the stack takes: ether_input() drops anything longer.
+ * GRO or LRO on the host interface hands the socket coalesced frames
+ * of up to 64k, which are dropped here instead.
+ */
+#define PKT_MAXFRAME	(ETHER_MAX_LEN - ETHER_CRC_LEN + 4)	/* + VLAN */
+
+/* upper limit for "fanout=" */
+#define PKT_MAXRXQ	16
+
+/* one socket of the fanout group with its receiver */
+struct pktrxq {
+	struct virtif_user *rq_viu;
+	int rq_fd;
+	int rq_idx;
+	pthread_t rq_pt;
+	int rq_ptvalid;
+
+	uint8_t *rq_map;
+	unsigned int rq_blk;		/* next block to harvest */
+
+	struct virtif_stats rq_stats;	/* written only by the receiver */
+};
+
+struct virtif_user {
+	struct vif_runctl viu_runctl;	/* shared by all receivers */
+
+	struct virtif_sc *viu_virtifsc;
+	char viu_ifname[IFNAMSIZ];
+	char viu_placement[48];	/* where the receivers run, for humans */
+
+	int viu_nrxq;
+	struct pktrxq *viu_rxq;
+
+	int viu_txfd;
+	uint8_t *viu_txmap;
+	unsigned int viu_txcur;		/* next tx frame to fill */
+	struct virtif_stats viu_txstats; /* written only by senders */
+
+	struct vif_capture *viu_cap;	/* NULL if not capturing */
+};
+
+/* "ifname[,option[=value]]..." */
+struct packetif_params {
+	char pp_ifname[IFNAMSIZ];
+	struct vif_cpuspec pp_cpu;
+	int pp_fanout;
+	int pp_promisc;
+	struct vif_capspec pp_cap;
+};
+
+static int
+packetopt(void *arg, const char *opt, const char *val)
+{
+	struct packetif_params *pp = arg;
+	char *ep;
+
+	if (strcmp(opt, "cpu") == 0)
+		return vif_cpuspec_parse(val, &pp->pp_cpu);
+	if (strcmp(opt, "promisc") == 0 && val == NULL) {
+		pp->pp_promisc = 1;
+		return 0;
+	}
+	if (strcmp(opt, "fanout") == 0) {
+		if (val == NULL)
+			return EINVAL;
+		pp->pp_fanout = (int)strtol(val, &ep, 10);
+		if (*ep != '\0' || pp->pp_fanout < 1
+		    || pp->pp_fanout > PKT_MAXRXQ)
+			return EINVAL;
+		return 0;
+	}
+	return vif_capspec_opt(&pp->pp_cap, opt, val);
+}
+
+/*
+ * With GRO or LRO on, TCP frames arrive coalesced beyond what the
+ * stack takes.  The settings belong to the host, so just say so.
+ */
+static void
+checkgro(const char *ifname)
+{
+	struct ethtool_value ev;
+	struct ifreq ifr;
+	int s, gro = 0, lro = 0;
+
+	if ((s = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		return;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name)-1);
+	ifr.ifr_data = (void *)&ev;
+
+	ev.cmd = ETHTOOL_GGRO;
+	if (ioctl(s, SIOCETHTOOL, &ifr) == 0)
+		gro = ev.data != 0;
+	ev.cmd = ETHTOOL_GFLAGS;
+	if (ioctl(s, SIOCETHTOOL, &ifr) == 0)
+		lro = (ev.data & ETH_FLAG_LRO) != 0;
+	close(s);
+
+	if (gro || lro) {
+		fprintf(stderr, "packetif:%s: %s is on, coalesced frames "
+		    "will be dropped; turn it off with ethtool -K %s %s off\n",
+		    ifname, gro ? "GRO" : "LRO", ifname, gro ? "gro" : "lro");
+	}
+}
+
+static int
+bindif(int fd, int ifindex, int proto)
+{
+	struct sockaddr_ll sll;
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = proto;
+	sll.sll_ifindex = ifindex;
+	if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) == -1)
+		return errno;
+	return 0;
+}
+
+#define PKT_FANOUTTYPE	(PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG)
+
+/*
+ * Join the fanout group.  Group ids are shared by the whole network
+ * namespace, and joining an existing group with the same type just
+ * works, so the first socket must get an id nobody uses: from the
+ * kernel where it can hand one out, else by trying ids until one is
+ * not refused.  The latter still cannot tell an unused id from a
+ * group of the same type, which is why UNIQUEID is preferred.
+ */
+static int
+joinfanout(int fd, int idx, int *fanoutid)
+{
+	int v, tries;
+
+	if (idx > 0) {
+		v = *fanoutid | PKT_FANOUTTYPE << 16;
+		if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT,
+		    &v, sizeof(v)) == -1)
+			return errno;
+		return 0;
+	}
+
+#ifdef PACKET_FANOUT_FLAG_UNIQUEID
+	{
+		socklen_t len = sizeof(v);
+
+		v = (PKT_FANOUTTYPE | PACKET_FANOUT_FLAG_UNIQUEID) << 16;
+		if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT,
+		    &v, sizeof(v)) == 0) {
+			if (getsockopt(fd, SOL_PACKET, PACKET_FANOUT,
+			    &v, &len) == -1)
+				return errno;
+			*fanoutid = v & 0xffff;
+			return 0;
+		}
+		/* EINVAL: a kernel before 4.4, pick an id ourselves */
+		if (errno != EINVAL)
+			return errno;
+	}
+#endif
+	for (tries = 0; tries < 16; tries++) {
+		v = *fanoutid | PKT_FANOUTTYPE << 16;
+		if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT,
+		    &v, sizeof(v)) == 0)
+			return 0;
+		if (errno != EINVAL && errno != EEXIST && errno != EALREADY)
+			return errno;
+		/* an odd step, so that all ids come round */
+		*fanoutid = (*fanoutid + 0x3b1) & 0xffff;
+	}
+	return EADDRINUSE;
+}
+
+/*
+ * Open one receive socket: a TPACKET_V3 ring, bound to the interface
+ * and, with several receivers, joined to the fanout group so that
+ * the host spreads flows over them.
+ */
+static int
+openrx(const struct packetif_params *pp, int ifindex, int *fanoutid,
+	struct pktrxq *rq)
+{
+	struct tpacket_req3 req;
+	struct packet_mreq mr;
+	int fd, rv, v = TPACKET_V3;
+
+	/* protocol 0: receive nothing until the ring is in place */
+	if ((fd = socket(AF_PACKET, SOCK_RAW, 0)) == -1)
+		return errno;
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = PKT_RXBLKSZ;
+	req.tp_block_nr = PKT_RXNBLK;
+	req.tp_frame_size = PKT_RXFRAMESZ;
+	req.tp_frame_nr = PKT_RXBLKSZ / PKT_RXFRAMESZ * PKT_RXNBLK;
+	req.tp_retire_blk_tov = PKT_RXTMO;
+
+	if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &v, sizeof(v)) == -1
+	    || setsockopt(fd, SOL_PACKET, PACKET_RX_RING,
+	      &req, sizeof(req)) == -1) {
+		rv = errno;
+		fprintf(stderr, "packetif:%s: cannot set up rx ring: %s\n",
+		    pp->pp_ifname, strerror(rv));
+		goto bad;
+	}
+#ifdef PACKET_IGNORE_OUTGOING
+	{
+		int one = 1;
+
+		(void)setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING,
+		    &one, sizeof(one));
+	}
+#endif
+
+	rq->rq_map = mmap(NULL, PKT_RXBLKSZ * PKT_RXNBLK,
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, fd, 0);
+	if (rq->rq_map == MAP_FAILED) {
+		/* MAP_LOCKED may exceed RLIMIT_MEMLOCK, try without */
+		rq->rq_map = mmap(NULL, PKT_RXBLKSZ * PKT_RXNBLK,
+		    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	if (rq->rq_map == MAP_FAILED) {
+		rv = errno;
+		rq->rq_map = NULL;
+		goto bad;
+	}
+
+	if ((rv = bindif(fd, ifindex, htons(ETH_P_ALL))) != 0)
+		goto bad;
+
+	if (pp->pp_promisc) {
+		memset(&mr, 0, sizeof(mr));
+		mr.mr_ifindex = ifindex;
+		mr.mr_type = PACKET_MR_PROMISC;
+		if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+		    &mr, sizeof(mr)) == -1) {
+			rv = errno;
+			goto bad;
+		}
+	}
+
+	if (pp->pp_fanout > 1) {
+		if ((rv = joinfanout(fd, rq->rq_idx, fanoutid)) != 0) {
+			fprintf(stderr, "packetif:%s: cannot join fanout "
+			    "group: %s\n", pp->pp_ifname, strerror(rv));
+			goto bad;
+		}
+	}
+
+	rq->rq_fd = fd;
+	return 0;
+
+ bad:
+	if (rq->rq_map) {
+		munmap(rq->rq_map, PKT_RXBLKSZ * PKT_RXNBLK);
+		rq->rq_map = NULL;
+	}
+	close(fd);
+	return rv;
+}
+
+/*
+ * The tx socket uses protocol 0 so that it does not receive, and
+ * PACKET_QDISC_BYPASS (where available) so that frames go straight
+ * to the driver.
+ */
+static int
+opentx(const struct packetif_params *pp, int ifindex, struct virtif_user *viu)
+{
+	struct tpacket_req req;
+	int fd, rv, v = TPACKET_V2;
+
+	if ((fd = socket(AF_PACKET, SOCK_RAW, 0)) == -1)
+		return errno;
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = PKT_TXBLKSZ;
+	req.tp_block_nr = PKT_TXNBLK;
+	req.tp_frame_size = PKT_TXFRAMESZ;
+	req.tp_frame_nr = PKT_TXNFRAME;
+
+	if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &v, sizeof(v)) == -1
+	    || setsockopt(fd, SOL_PACKET, PACKET_TX_RING,
+	      &req, sizeof(req)) == -1) {
+		rv = errno;
+		fprintf(stderr, "packetif:%s: cannot set up tx ring: %s\n",
+		    pp->pp_ifname, strerror(rv));
+		close(fd);
+		return rv;
+	}
+#ifdef PACKET_QDISC_BYPASS
+	{
+		int one = 1;
+
+		(void)setsockopt(fd, SOL_PACKET, PACKET_QDISC_BYPASS,
+		    &one, sizeof(one));
+	}
+#endif
+
+	viu->viu_txmap = mmap(NULL, PKT_TXBLKSZ * PKT_TXNBLK,
+	    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (viu->viu_txmap == MAP_FAILED) {
+		rv = errno;
+		viu->viu_txmap = NULL;
+		close(fd);
+		return rv;
+	}
+	if ((rv = bindif(fd, ifindex, 0)) != 0) {
+		munmap(viu->viu_txmap, PKT_TXBLKSZ * PKT_TXNBLK);
+		viu->viu_txmap = NULL;
+		close(fd);
+		return rv;
+	}
+
+	viu->viu_txfd = fd;
+	return 0;
+}
+
+static void
+closerx(struct pktrxq *rq)
+{
+
+	if (rq->rq_ptvalid)
+		pthread_join(rq->rq_pt, NULL);
+	if (rq->rq_map)
+		munmap(rq->rq_map, PKT_RXBLKSZ * PKT_RXNBLK);
+	if (rq->rq_fd != -1)
+		close(rq->rq_fd);
+}
+
+static struct tpacket_block_desc *
+rxblock(struct pktrxq *rq)
+{
+
+	return (void *)(rq->rq_map + rq->rq_blk * PKT_RXBLKSZ);
+}
+
+/*
+ * Wait until the block at the head of the ring has been retired to
+ * us, then harvest every ready block, each frame delivered straight
+ * from the ring within a single scheduled section.  Frames whose
+ * VLAN tag was stripped by the NIC get it back on the way up.
+ */
+static void *
+receiver(void *arg)
+{
+	struct pktrxq *rq = arg;
+	struct virtif_user *viu = rq->rq_viu;
+	struct virtif_stats *vs = &rq->rq_stats;
+	struct tpacket_block_desc *bd;
+	struct tpacket3_hdr *ph;
+	struct sockaddr_ll *sll;
+	struct iovec iov[3];
+	uint8_t *frame, vtag[4];
+	uint16_t tpid;
+	struct pollfd pfd[2];
+	unsigned int i, npkt;
+	int prv;
+
+	rumpuser_component_kthread();
+
+	for (;;) {
+		if (vif_runctl_wait(&viu->viu_runctl))
+			break;
+
+		bd = rxblock(rq);
+		if ((bd->hdr.bh1.block_status & TP_STATUS_USER) == 0) {
+			pfd[0].fd = rq->rq_fd;
+			pfd[0].events = POLLIN;
+			pfd[1].fd = vif_runctl_fd(&viu->viu_runctl);
+			pfd[1].events = POLLIN;
+
+			prv = poll(pfd, 2, -1);
+			if (prv < 0 && errno != EINTR && errno != EAGAIN) {
+				fprintf(stderr, "packetif: poll failed: %s\n",
+				    strerror(errno));
+			}
+			continue;
+		}
+
+		npkt = 0;
+		while (bd->hdr.bh1.block_status & TP_STATUS_USER) {
+			__sync_synchronize();
+			ph = (void *)((uint8_t *)bd
+			    + bd->hdr.bh1.offset_to_first_pkt);
+			for (i = 0; i < bd->hdr.bh1.num_pkts; i++,
+			    ph = (void *)((uint8_t *)ph + ph->tp_next_offset)) {
+				sll = (void *)((uint8_t *)ph
+				    + TPACKET_ALIGN(sizeof(*ph)));
+				if (sll->sll_pkttype == PACKET_OUTGOING)
+					continue;
+				if (ph->tp_snaplen < ETHER_ADDR_LEN*2)
+					continue;
+				if (ph->tp_len > PKT_MAXFRAME) {
+					vs->vs_drops[VIFSTAT_DROP_OVERSIZE]++;
+					continue;
+				}
+
+				frame = (uint8_t *)ph + ph->tp_mac;
+				iov[0].iov_base = frame;
+				iov[0].iov_len = ph->tp_snaplen;
+				if (ph->tp_status & TP_STATUS_VLAN_VALID) {
+					tpid = (ph->tp_status
+					    & TP_STATUS_VLAN_TPID_VALID)
+					    ? ph->hv1.tp_vlan_tpid
+					    : ETHERTYPE_VLAN;
+					vtag[0] = tpid >> 8;
+					vtag[1] = tpid & 0xff;
+					vtag[2] = ph->hv1.tp_vlan_tci >> 8;
+					vtag[3] = ph->hv1.tp_vlan_tci & 0xff;
+					iov[0].iov_len = ETHER_ADDR_LEN*2;
+					iov[1].iov_base = vtag;
+					iov[1].iov_len = sizeof(vtag);
+					iov[2].iov_base =
+					    frame + ETHER_ADDR_LEN*2;
+					iov[2].iov_len = ph->tp_snaplen
+					    - ETHER_ADDR_LEN*2;
+				}
+				vs->vs_ipackets++;
+				vs->vs_ibytes += ph->tp_snaplen;
+				VIF_CAPTURE(viu->viu_cap, iov,
+				    (ph->tp_status & TP_STATUS_VLAN_VALID)
+				    ? 3 : 1, 0);
+
+				if (npkt++ == 0)
+					rumpuser_component_schedule(NULL);
+				VIF_DELIVERPKT(viu->viu_virtifsc, iov,
+				    (ph->tp_status & TP_STATUS_VLAN_VALID)
+				    ? 3 : 1);
+			}
+
+			__sync_synchronize();
+			bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+			rq->rq_blk = (rq->rq_blk + 1) % PKT_RXNBLK;
+			bd = rxblock(rq);
+		}
+		if (npkt)
+			rumpuser_component_unschedule();
+		vif_stats_batch(vs, npkt);
+	}
+
+	rumpuser_component_kthread_release();
+	return NULL;
+}
+
+static int
+createrx(struct virtif_user *viu, struct pktrxq *rq, int idx,
+	const struct packetif_params *pp, int ifindex, int *fanoutid)
+{
+	pthread_attr_t attr;
+	char place[sizeof(viu->viu_placement)];
+	int rv;
+
+	rq->rq_viu = viu;
+	rq->rq_idx = idx;
+	rq->rq_fd = -1;
+	if ((rv = openrx(pp, ifindex, fanoutid, rq)) != 0)
+		return rv;
+
+	pthread_attr_init(&attr);
+	if (vif_placethread(pp->pp_ifname, &pp->pp_cpu,
+	    pp->pp_fanout > 1 ? idx : -1, &attr, place, sizeof(place)) != 0) {
+		snprintf(place, sizeof(place), "rx unpinned");
+		pthread_attr_destroy(&attr);
+		pthread_attr_init(&attr);
+	}
+	if (idx == 0) {
+		if (pp->pp_fanout > 1 && pp->pp_cpu.vc_first >= 0) {
+			snprintf(viu->viu_placement,
+			    sizeof(viu->viu_placement),
+			    "fanout %d, rx cpu %d-%d", pp->pp_fanout,
+			    pp->pp_cpu.vc_first, pp->pp_cpu.vc_last);
+		} else if (pp->pp_fanout > 1) {
+			snprintf(viu->viu_placement,
+			    sizeof(viu->viu_placement),
+			    "fanout %d, %s", pp->pp_fanout, place);
+		} else {
+			strcpy(viu->viu_placement, place);
+		}
+	}
+
+	rv = pthread_create(&rq->rq_pt, &attr, receiver, rq);
+	pthread_attr_destroy(&attr);
+	if (rv == 0)
+		rq->rq_ptvalid = 1;
+	return rv;
+}
+
+int
+VIFHYPER_CREATE(const char *devstr, struct virtif_sc *vif_sc, uint8_t *enaddr,
+	struct virtif_user **viup)
+{
+	static unsigned int instance;
+	struct virtif_user *viu = NULL;
+	struct packetif_params pp;
+	void *cookie;
+	int i, ifindex, fanoutid, rv;
+
+	cookie = rumpuser_component_unschedule();
+
+	memset(&pp, 0, sizeof(pp));
+	vif_cpuspec_init(&pp.pp_cpu);
+	vif_capspec_init(&pp.pp_cap);
+	pp.pp_fanout = 1;
+	if ((rv = vif_parselinkstr("packetif", devstr, pp.pp_ifname,
+	    sizeof(pp.pp_ifname), packetopt, &pp)) != 0)
+		goto out;
+
+	if ((ifindex = if_nametoindex(pp.pp_ifname)) == 0) {
+		rv = errno;
+		fprintf(stderr, "packetif: %s: no such interface\n",
+		    pp.pp_ifname);
+		goto out;
+	}
+
+	viu = calloc(1, sizeof(*viu));
+	if (viu == NULL) {
+		rv = errno;
+		goto out;
+	}
+	viu->viu_rxq = calloc(pp.pp_fanout, sizeof(*viu->viu_rxq));
+	if (viu->viu_rxq == NULL) {
+		rv = errno;
+		free(viu);
+		viu = NULL;
+		goto out;
+	}
+	if ((rv = opentx(&pp, ifindex, viu)) != 0) {
+		free(viu->viu_rxq);
+		free(viu);
+		viu = NULL;
+		goto out;
+	}
+	if (vif_gethwaddr(pp.pp_ifname, enaddr) != 0) {
+		fprintf(stderr, "packetif:%s: failed to retrieve "
+		    "MAC address\n", pp.pp_ifname);
+	}
+	checkgro(pp.pp_ifname);
+	if ((rv = vif_runctl_init(&viu->viu_runctl)) != 0) {
+		munmap(viu->viu_txmap, PKT_TXBLKSZ * PKT_TXNBLK);
+		close(viu->viu_txfd);
+		free(viu->viu_rxq);
+		free(viu);
+		viu = NULL;
+		goto out;
+	}
+	if ((rv = vif_capture_open(&viu->viu_cap, &pp.pp_cap,
+	    pp.pp_ifname)) != 0) {
+		vif_runctl_fini(&viu->viu_runctl);
+		munmap(viu->viu_txmap, PKT_TXBLKSZ * PKT_TXNBLK);
+		close(viu->viu_txfd);
+		free(viu->viu_rxq);
+		free(viu);
+		viu = NULL;
+		goto out;
+	}
+	viu->viu_virtifsc = vif_sc;
+	strcpy(viu->viu_ifname, pp.pp_ifname);
+
+	/* where the kernel cannot pick a group id, start from this one */
+	fanoutid = (getpid() ^ (instance++ << 8) ^ ifindex) & 0xffff;
+	for (i = 0; i < pp.pp_fanout; i++) {
+		if ((rv = createrx(viu, &viu->viu_rxq[i], i, &pp,
+		    ifindex, &fanoutid)) != 0)
+			break;
+	}
+	if (rv != 0) {
+		vif_runctl_dying(&viu->viu_runctl);
+		for (; i >= 0; i--)
+			closerx(&viu->viu_rxq[i]);
+		if (viu->viu_cap != NULL)
+			vif_capture_close(viu->viu_cap);
+		vif_runctl_fini(&viu->viu_runctl);
+		munmap(viu->viu_txmap, PKT_TXBLKSZ * PKT_TXNBLK);
+		close(viu->viu_txfd);
+		free(viu->viu_rxq);
+		free(viu);
+		viu = NULL;
+		goto out;
+	}
+	viu->viu_nrxq = pp.pp_fanout;
+
+ out:
+	rumpuser_component_schedule(cookie);
+
+	*viup = viu;
+	return rumpuser_component_errtrans(rv);
+}
+
+void
+VIFHYPER_INFO(struct virtif_user *viu, char *buf, size_t buflen)
+{
+
+	snprintf(buf, buflen, "%s", viu->viu_placement);
+}
+
+int
+VIFHYPER_FLAGS(struct virtif_user *viu)
+{
+
+	return 0;
+}
+
+/*
+ * The kernel already coalesces into ring blocks, which it retires
+ * when full or after PKT_RXTMO.
+ */
+int
+VIFHYPER_COALESCE(struct virtif_user *viu, struct virtif_coalesce *vc,
+	int set)
+{
+
+	return rumpuser_component_errtrans(EOPNOTSUPP);
+}
+
+/* the single PACKET_TX_RING has one writer at a time */
+int
+VIFHYPER_TXRINGS(struct virtif_user *viu)
+{
+
+	return 1;
+}
+
+/* every fanout member is reported as a ring, tx goes with ring 0 */
+int
+VIFHYPER_STATS(struct virtif_user *viu, int ring, struct virtif_stats *vs)
+{
+	int i;
+
+	memset(vs, 0, sizeof(*vs));
+	if (ring >= viu->viu_nrxq)
+		return rumpuser_component_errtrans(ENOENT);
+	for (i = 0; i < viu->viu_nrxq; i++) {
+		if (ring < 0 || ring == i)
+			vif_stats_add(vs, &viu->viu_rxq[i].rq_stats);
+	}
+	if (ring <= 0)
+		vif_stats_add(vs, &viu->viu_txstats);
+	return 0;
+}
+
+/*
+ * Copy a batch of frames into tx ring frames and hand them to the
+ * host with a single send().  Returns the number of frames queued;
+ * the rest were dropped for lack of ring space.
+ */
+int
+VIFHYPER_SEND(struct virtif_user *viu, int txring, struct iovec *iov,
+	const size_t *iovcnt, size_t npkt)
+{
+	void *cookie = NULL; /* XXXgcc */
+	struct virtif_stats *vs = &viu->viu_txstats;
+	struct tpacket2_hdr *th;
+	struct pollfd pfd;
+	uint8_t *p;
+	size_t pkt, sent = 0, i, n, totlen;
+	int retries, unscheduled = 0;
+
+	for (pkt = 0; pkt < npkt; iov += iovcnt[pkt], pkt++) {
+		th = (void *)(viu->viu_txmap + viu->viu_txcur*PKT_TXFRAMESZ);
+		for (retries = 10; retries > 0; retries--) {
+			if (th->tp_status & TP_STATUS_WRONG_FORMAT) {
+				/* the host refused it, reclaim the frame */
+				th->tp_status = TP_STATUS_AVAILABLE;
+			}
+			if (th->tp_status == TP_STATUS_AVAILABLE)
+				break;
+
+			if (!unscheduled) {
+				cookie = rumpuser_component_unschedule();
+				unscheduled = 1;
+			}
+			/* kick what is queued so far, then wait for room */
+			(void)send(viu->viu_txfd, NULL, 0, MSG_DONTWAIT);
+			pfd.fd = viu->viu_txfd;
+			pfd.events = POLLOUT;
+			(void)poll(&pfd, 1, 500 /* ms */);
+		}
+		if (retries == 0)
+			break;
+		__sync_synchronize();
+
+		p = (uint8_t *)th + PKT_TXDATAOFF;
+		for (i = 0, totlen = 0;
+		    totlen < PKT_TXMAXLEN && i < iovcnt[pkt]; i++) {
+			n = iov[i].iov_len;
+			if (totlen + n > PKT_TXMAXLEN) {
+				n = PKT_TXMAXLEN - totlen;
+				vs->vs_otruncated++;
+			}
+			memcpy(p + totlen, iov[i].iov_base, n);
+			totlen += n;
+		}
+		th->tp_len = totlen;
+		__sync_synchronize();
+		th->tp_status = TP_STATUS_SEND_REQUEST;
+		viu->viu_txcur = (viu->viu_txcur + 1) % PKT_TXNFRAME;
+		VIF_CAPTURE(viu->viu_cap, iov, iovcnt[pkt], 1);
+
+		vs->vs_opackets++;
+		vs->vs_obytes += totlen;
+		sent++;
+	}
+
+	if (sent > 0 && send(viu->viu_txfd, NULL, 0, MSG_DONTWAIT) == -1
+	    && errno != EAGAIN && errno != ENOBUFS)
+		perror("packetif: send");
+	vs->vs_drops[VIFSTAT_DROP_TXFULL] += npkt - sent;
+
+	if (unscheduled)
+		rumpuser_component_schedule(cookie);
+	return (int)sent;
+}
+
+void
+VIFHYPER_START(struct virtif_user *viu)
+{
+
+	vif_runctl_start(&viu->viu_runctl);
+}
+
+void
+VIFHYPER_STOP(struct virtif_user *viu)
+{
+
+	vif_runctl_stop(&viu->viu_runctl);
+}
+
+void
+VIFHYPER_DYING(struct virtif_user *viu)
+{
+
+	vif_runctl_dying(&viu->viu_runctl);
+}
+
+void
+VIFHYPER_DESTROY(struct virtif_user *viu)
+{
+	void *cookie = rumpuser_component_unschedule();
+	int i;
+
+	for (i = 0; i < viu->viu_nrxq; i++)
+		closerx(&viu->viu_rxq[i]);
+	if (viu->viu_cap != NULL)
+		vif_capture_close(viu->viu_cap);
+	vif_runctl_fini(&viu->viu_runctl);
+	munmap(viu->viu_txmap, PKT_TXBLKSZ * PKT_TXNBLK);
+	close(viu->viu_txfd);
+	free(viu->viu_rxq);
+	free(viu);
+
+	rumpuser_component_schedule(cookie);
+}
@@ -0,0 +1,926 @@
+/*
+ * Copyright (c) 2026 The drv-netif-netmap contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * vhost-user backend.  We act as the driver side (the part a VMM
+ * plays for a guest): all memory, the two split virtqueues (0 rx,
+ * 1 tx) and their packet buffers, lives in one memfd region which
+ * is handed to the device, e.g. a userspace switch, over the unix
+ * socket control channel.  Packets then move through the shared
+ * rings, with eventfd kicks and calls only when the other side asks
+ * for them, and no system calls per packet.
+ *
+ * Descriptor addresses are offsets into the region (guest physical
+ * address 0 is the start of the region).  Little-endian hosts only,
+ * as virtio 1.0 rings are little-endian.
+ */
+
+#define _GNU_SOURCE	/* memfd_create(), pthread_attr_setaffinity_np() */
+
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/virtio_config.h>
+#include <linux/virtio_net.h>
+#include <linux/virtio_ring.h>
+
+#include <rump/rumpuser_component.h>
+
+#include "if_virt.h"
+#include "virtif_cycles.h"
+#include "rumpcomp_user.h"
+#include "rumpcomp_vif.h"
+
+#if BYTE_ORDER != LITTLE_ENDIAN
+#error vhost-user backend supports only little-endian hosts
+#endif
+
+#define VHU_QSZ		256		/* descriptors per virtqueue */
+#define VHU_RXBUFSZ	2048
+#define VHU_TXSLOTSZ	2048
+#define VHU_TSOSLOTSZ	(65536 + 2048)	/* header, ether and a 64k TSO frame */
+#define VHU_MAXRXIOV	64		/* buffers per merged rx frame */
+
+#define VHU_RXQ		0
+#define VHU_TXQ		1
+
+/* vhost-user messages, see vhost-user.rst in the QEMU sources */
+#define VHOST_USER_GET_FEATURES		1
+#define VHOST_USER_SET_FEATURES		2
+#define VHOST_USER_SET_OWNER		3
+#define VHOST_USER_SET_MEM_TABLE	5
+#define VHOST_USER_SET_VRING_NUM	8
+#define VHOST_USER_SET_VRING_ADDR	9
+#define VHOST_USER_SET_VRING_BASE	10
+#define VHOST_USER_SET_VRING_KICK	12
+#define VHOST_USER_SET_VRING_CALL	13
+
+#define VHOST_USER_VERSION		0x1
+#define VHOST_USER_REPLY		0x4
+
+struct vhu_region {
+	uint64_t vr_gpa;
+	uint64_t vr_size;
+	uint64_t vr_uaddr;
+	uint64_t vr_mmapoff;
+};
+
+struct vhu_msg {
+	uint32_t vm_request;
+	uint32_t vm_flags;
+	uint32_t vm_size;
+	union {
+		uint64_t u64;
+		struct {
+			uint32_t index;
+			uint32_t num;
+		} state;
+		struct {
+			uint32_t index;
+			uint32_t flags;
+			uint64_t desc;
+			uint64_t used;
+			uint64_t avail;
+			uint64_t log;
+		} addr;
+		struct {
+			uint32_t nregions;
+			uint32_t padding;
+			struct vhu_region regions[1];
+		} mem;
+	} vm_u;
+} __attribute__((__packed__));
+#define VHU_HDRSZ offsetof(struct vhu_msg, vm_u)
+
+#define F(b)	((uint64_t)1 << (b))
+#define VHU_WANTFEATURES \
+    (F(VIRTIO_F_VERSION_1) | F(VIRTIO_F_ANY_LAYOUT) | \
+     F(VIRTIO_NET_F_MRG_RXBUF) | \
+     F(VIRTIO_NET_F_CSUM) | F(VIRTIO_NET_F_GUEST_CSUM) | \
+     F(VIRTIO_NET_F_HOST_TSO4) | F(VIRTIO_NET_F_HOST_TSO6))
+
+struct vhuq {
+	struct vring_desc *vq_desc;
+	struct vring_avail *vq_avail;
+	struct vring_used *vq_used;
+	uint16_t vq_lastused;	/* next used entry we look at */
+	uint16_t vq_availidx;	/* our copy of avail->idx */
+	int vq_kickfd;		/* we -> device */
+	int vq_callfd;		/* device -> us */
+};
+
+struct virtif_user {
+	int viu_sock;
+	pthread_t viu_pt;
+	struct vif_runctl viu_runctl;
+
+	struct virtif_sc *viu_virtifsc;
+	char viu_path[108];
+	char viu_placement[48];	/* where the receiver runs, for humans */
+
+	/* the shared region */
+	int viu_memfd;
+	uint8_t *viu_mem;
+	size_t viu_memsz;
+	size_t viu_rxbufoff;
+	size_t viu_txbufoff;
+	size_t viu_txslotsz;
+
+	uint64_t viu_features;	/* negotiated */
+	size_t viu_hdrsz;	/* virtio-net header in front of frames */
+	int viu_mrg;		/* mergeable rx buffers */
+	int viu_vnethdr;	/* offloads: frames carry a vif_vnethdr */
+	int viu_tso;		/* ... and the device takes TSO frames */
+
+	struct vhuq viu_q[2];
+
+	/* tx slots not in flight, used only by senders */
+	uint16_t viu_txfree[VHU_QSZ];
+	unsigned int viu_ntxfree;
+	unsigned int viu_txdescs;	/* descriptors per tx slot */
+
+	/* written by the receiver and by senders holding the tx ring lock */
+	struct virtif_stats viu_rxstats;
+	struct virtif_stats viu_txstats;
+
+	struct vif_capture *viu_cap;	/* NULL if not capturing */
+};
+
+/* "socketpath[,option[=value]]..." */
+struct vhostif_params {
+	char vp_path[108];
+	struct vif_cpuspec vp_cpu;
+	int vp_nooffload;
+	struct vif_capspec vp_cap;
+};
+
+static int
+vhostopt(void *arg, const char *opt, const char *val)
+{
+	struct vhostif_params *vp = arg;
+
+	if (strcmp(opt, "cpu") == 0)
+		return vif_cpuspec_parse(val, &vp->vp_cpu);
+	if (strcmp(opt, "nooffload") == 0 && val == NULL) {
+		vp->vp_nooffload = 1;
+		return 0;
+	}
+	return vif_capspec_opt(&vp->vp_cap, opt, val);
+}
+
+/*
+ * Send a control message, with a file descriptor if fd != -1, and
+ * read the reply if one is expected.
+ */
+static int
+vhumsg(struct virtif_user *viu, struct vhu_msg *msg, size_t plen, int fd,
+	int wantreply)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct msghdr mh;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	ssize_t nn;
+
+	msg->vm_flags = VHOST_USER_VERSION;
+	msg->vm_size = plen;
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = msg;
+	iov.iov_len = VHU_HDRSZ + plen;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if (fd != -1) {
+		memset(cbuf, 0, sizeof(cbuf));
+		mh.msg_control = cbuf;
+		mh.msg_controllen = sizeof(cbuf);
+		cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+	}
+	if (sendmsg(viu->viu_sock, &mh, 0) != (ssize_t)iov.iov_len)
+		return errno ? errno : EIO;
+
+	if (!wantreply)
+		return 0;
+	nn = recv(viu->viu_sock, msg, VHU_HDRSZ, MSG_WAITALL);
+	if (nn != (ssize_t)VHU_HDRSZ || (msg->vm_flags & VHOST_USER_REPLY) == 0
+	    || msg->vm_size > sizeof(msg->vm_u))
+		return EPROTO;
+	if (msg->vm_size && recv(viu->viu_sock, &msg->vm_u, msg->vm_size,
+	    MSG_WAITALL) != (ssize_t)msg->vm_size)
+		return EPROTO;
+	return 0;
+}
+
+/* lay out the region: per queue desc, avail and used, then the buffers */
+#define VHU_PGSZ	4096
+#define VHU_ROUND(x)	(((x) + VHU_PGSZ-1) & ~(size_t)(VHU_PGSZ-1))
+#define VHU_DESCSZ	VHU_ROUND(sizeof(struct vring_desc) * VHU_QSZ)
+#define VHU_AVAILSZ	VHU_ROUND(sizeof(uint16_t) * (3 + VHU_QSZ))
+#define VHU_USEDSZ	VHU_ROUND(sizeof(uint16_t) * 3 \
+			    + sizeof(struct vring_used_elem) * VHU_QSZ)
+#define VHU_QMEMSZ	(VHU_DESCSZ + VHU_AVAILSZ + VHU_USEDSZ)
+
+static int
+allocmem(struct virtif_user *viu)
+{
+	uint8_t *q;
+	int i;
+
+	viu->viu_txslotsz = viu->viu_tso ? VHU_TSOSLOTSZ : VHU_TXSLOTSZ;
+	viu->viu_rxbufoff = 2 * VHU_QMEMSZ;
+	viu->viu_txbufoff = viu->viu_rxbufoff + VHU_QSZ * VHU_RXBUFSZ;
+	viu->viu_memsz = viu->viu_txbufoff + VHU_QSZ * viu->viu_txslotsz;
+
+	if ((viu->viu_memfd = memfd_create("vhostif", MFD_CLOEXEC)) == -1)
+		return errno;
+	if (ftruncate(viu->viu_memfd, viu->viu_memsz) == -1)
+		return errno;
+	viu->viu_mem = mmap(NULL, viu->viu_memsz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, viu->viu_memfd, 0);
+	if (viu->viu_mem == MAP_FAILED) {
+		viu->viu_mem = NULL;
+		return errno;
+	}
+
+	for (i = 0; i < 2; i++) {
+		q = viu->viu_mem + i * VHU_QMEMSZ;
+		viu->viu_q[i].vq_desc = (void *)q;
+		viu->viu_q[i].vq_avail = (void *)(q + VHU_DESCSZ);
+		viu->viu_q[i].vq_used = (void *)(q + VHU_DESCSZ + VHU_AVAILSZ);
+	}
+	return 0;
+}
+
+/*
+ * Every rx descriptor is one buffer, all of them initially available.
+ * Tx descriptors are fixed to their slot as well: one descriptor per
+ * slot with ANY_LAYOUT, otherwise a header and a data descriptor.
+ * Completed tx slots are reclaimed lazily, so tx does not interrupt.
+ */
+static void
+initrings(struct virtif_user *viu)
+{
+	struct vhuq *rx = &viu->viu_q[VHU_RXQ], *tx = &viu->viu_q[VHU_TXQ];
+	uint64_t slot;
+	unsigned int i, d;
+
+	for (i = 0; i < VHU_QSZ; i++) {
+		rx->vq_desc[i].addr = viu->viu_rxbufoff + i * VHU_RXBUFSZ;
+		rx->vq_desc[i].len = VHU_RXBUFSZ;
+		rx->vq_desc[i].flags = VRING_DESC_F_WRITE;
+		rx->vq_avail->ring[i] = i;
+	}
+	rx->vq_availidx = VHU_QSZ;
+	__atomic_store_n(&rx->vq_avail->idx, rx->vq_availidx, __ATOMIC_RELEASE);
+
+	viu->viu_txdescs = (viu->viu_features
+	    & (F(VIRTIO_F_VERSION_1) | F(VIRTIO_F_ANY_LAYOUT))) ? 1 : 2;
+	for (i = 0, d = 0; d < VHU_QSZ; i++, d += viu->viu_txdescs) {
+		slot = viu->viu_txbufoff + i * viu->viu_txslotsz;
+		tx->vq_desc[d].addr = slot;
+		if (viu->viu_txdescs == 2) {
+			tx->vq_desc[d].len = viu->viu_hdrsz;
+			tx->vq_desc[d].flags = VRING_DESC_F_NEXT;
+			tx->vq_desc[d].next = d+1;
+			tx->vq_desc[d+1].addr = slot + viu->viu_hdrsz;
+		}
+		viu->viu_txfree[i] = d;
+	}
+	viu->viu_ntxfree = i;
+	tx->vq_avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+}
+
+static uint8_t *
+txslot(struct virtif_user *viu, uint16_t head)
+{
+
+	return viu->viu_mem + viu->viu_txbufoff
+	    + (head / viu->viu_txdescs) * viu->viu_txslotsz;
+}
+
+/*
+ * Negotiate features.  Offloads are used only as a set: the device
+ * must take and hand out partial checksums, and TSO towards the device
+ * is used if it takes both v4 and v6.  Large frames from the device
+ * are never asked for: the stack here would drop them.
+ */
+static int
+negotiate(struct virtif_user *viu, const struct vhostif_params *vp)
+{
+	struct vhu_msg msg;
+	uint64_t f;
+	int rv;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.vm_request = VHOST_USER_SET_OWNER;
+	if ((rv = vhumsg(viu, &msg, 0, -1, 0)) != 0)
+		return rv;
+
+	msg.vm_request = VHOST_USER_GET_FEATURES;
+	if ((rv = vhumsg(viu, &msg, 0, -1, 1)) != 0)
+		return rv;
+	f = msg.vm_u.u64 & VHU_WANTFEATURES;
+
+	if (vp->vp_nooffload || (f & F(VIRTIO_NET_F_CSUM)) == 0
+	    || (f & F(VIRTIO_NET_F_GUEST_CSUM)) == 0) {
+		f &= ~(F(VIRTIO_NET_F_CSUM) | F(VIRTIO_NET_F_GUEST_CSUM)
+		    | F(VIRTIO_NET_F_HOST_TSO4) | F(VIRTIO_NET_F_HOST_TSO6));
+	}
+	if ((f & F(VIRTIO_NET_F_HOST_TSO4)) == 0
+	    || (f & F(VIRTIO_NET_F_HOST_TSO6)) == 0)
+		f &= ~(F(VIRTIO_NET_F_HOST_TSO4) | F(VIRTIO_NET_F_HOST_TSO6));
+
+	viu->viu_features = f;
+	viu->viu_mrg = (f & F(VIRTIO_NET_F_MRG_RXBUF)) != 0;
+	viu->viu_vnethdr = (f & F(VIRTIO_NET_F_CSUM)) != 0;
+	viu->viu_tso = (f & F(VIRTIO_NET_F_HOST_TSO4)) != 0;
+	viu->viu_hdrsz = (f & (F(VIRTIO_F_VERSION_1)
+	    | F(VIRTIO_NET_F_MRG_RXBUF)))
+	    ? sizeof(struct virtio_net_hdr_mrg_rxbuf)
+	    : sizeof(struct virtio_net_hdr);
+
+	msg.vm_request = VHOST_USER_SET_FEATURES;
+	msg.vm_u.u64 = f;
+	return vhumsg(viu, &msg, sizeof(msg.vm_u.u64), -1, 0);
+}
+
+static int
+setupqueue(struct virtif_user *viu, int idx)
+{
+	struct vhuq *vq = &viu->viu_q[idx];
+	struct vhu_msg msg;
+	int rv;
+
+	if ((vq->vq_kickfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1
+	    || (vq->vq_callfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		return errno;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.vm_request = VHOST_USER_SET_VRING_NUM;
+	msg.vm_u.state.index = idx;
+	msg.vm_u.state.num = VHU_QSZ;
+	if ((rv = vhumsg(viu, &msg, sizeof(msg.vm_u.state), -1, 0)) != 0)
+		return rv;
+
+	msg.vm_request = VHOST_USER_SET_VRING_BASE;
+	msg.vm_u.state.index = idx;
+	msg.vm_u.state.num = 0;
+	if ((rv = vhumsg(viu, &msg, sizeof(msg.vm_u.state), -1, 0)) != 0)
+		return rv;
+
+	/* ring addresses are in our address space, see SET_MEM_TABLE */
+	msg.vm_request = VHOST_USER_SET_VRING_ADDR;
+	msg.vm_u.addr.index = idx;
+	msg.vm_u.addr.flags = 0;
+	msg.vm_u.addr.desc = (uintptr_t)vq->vq_desc;
+	msg.vm_u.addr.used = (uintptr_t)vq->vq_used;
+	msg.vm_u.addr.avail = (uintptr_t)vq->vq_avail;
+	msg.vm_u.addr.log = 0;
+	if ((rv = vhumsg(viu, &msg, sizeof(msg.vm_u.addr), -1, 0)) != 0)
+		return rv;
+
+	msg.vm_request = VHOST_USER_SET_VRING_CALL;
+	msg.vm_u.u64 = idx;
+	if ((rv = vhumsg(viu, &msg, sizeof(msg.vm_u.u64),
+	    vq->vq_callfd, 0)) != 0)
+		return rv;
+
+	/* the kick fd comes last, it starts the ring */
+	msg.vm_request = VHOST_USER_SET_VRING_KICK;
+	msg.vm_u.u64 = idx;
+	return vhumsg(viu, &msg, sizeof(msg.vm_u.u64), vq->vq_kickfd, 0);
+}
+
+static int
+openvhost(const struct vhostif_params *vp, struct virtif_user *viu)
+{
+	struct sockaddr_un sun;
+	struct vhu_msg msg;
+	int rv;
+
+	if ((viu->viu_sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return errno;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, vp->vp_path, sizeof(sun.sun_path)-1);
+	if (connect(viu->viu_sock, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		rv = errno;
+		fprintf(stderr, "vhostif: cannot connect to %s: %s\n",
+		    vp->vp_path, strerror(rv));
+		return rv;
+	}
+
+	if ((rv = negotiate(viu, vp)) != 0
+	    || (rv = allocmem(viu)) != 0)
+		return rv;
+	initrings(viu);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.vm_request = VHOST_USER_SET_MEM_TABLE;
+	msg.vm_u.mem.nregions = 1;
+	msg.vm_u.mem.regions[0].vr_gpa = 0;
+	msg.vm_u.mem.regions[0].vr_size = viu->viu_memsz;
+	msg.vm_u.mem.regions[0].vr_uaddr = (uintptr_t)viu->viu_mem;
+	msg.vm_u.mem.regions[0].vr_mmapoff = 0;
+	if ((rv = vhumsg(viu, &msg, sizeof(msg.vm_u.mem),
+	    viu->viu_memfd, 0)) != 0)
+		return rv;
+
+	if ((rv = setupqueue(viu, VHU_RXQ)) != 0
+	    || (rv = setupqueue(viu, VHU_TXQ)) != 0) {
+		fprintf(stderr, "vhostif:%s: cannot set up virtqueues: %s\n",
+		    vp->vp_path, strerror(rv));
+		return rv;
+	}
+	return 0;
+}
+
+static void
+closevhost(struct virtif_user *viu)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (viu->viu_q[i].vq_kickfd != -1)
+			close(viu->viu_q[i].vq_kickfd);
+		if (viu->viu_q[i].vq_callfd != -1)
+			close(viu->viu_q[i].vq_callfd);
+	}
+	if (viu->viu_sock != -1)
+		close(viu->viu_sock);
+	if (viu->viu_mem)
+		munmap(viu->viu_mem, viu->viu_memsz);
+	if (viu->viu_memfd != -1)
+		close(viu->viu_memfd);
+}
+
+/* publish new avail entries and kick the device unless it opted out */
+static void
+vhupublish(struct vhuq *vq)
+{
+	uint64_t one = 1;
+
+	__atomic_store_n(&vq->vq_avail->idx, vq->vq_availidx,
+	    __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if ((__atomic_load_n(&vq->vq_used->flags, __ATOMIC_RELAXED)
+	    & VRING_USED_F_NO_NOTIFY) == 0)
+		(void)write(vq->vq_kickfd, &one, sizeof(one));
+}
+
+/*
+ * Deliver everything in the used ring within one scheduled section,
+ * gathering the buffers of merged frames into one iovec array, then
+ * give all buffers back and kick the device once.
+ */
+static void *
+receiver(void *arg)
+{
+	struct virtif_user *viu = arg;
+	struct vhuq *vq = &viu->viu_q[VHU_RXQ];
+	struct virtif_stats *vs = &viu->viu_rxstats;
+	struct virtio_net_hdr_mrg_rxbuf *hdr;
+	struct vring_used_elem *ue;
+	struct iovec iov[1 + VHU_MAXRXIOV];
+	struct pollfd pfd[2];
+	uint64_t cnt;
+	uint16_t usedidx, nbufs, j;
+	uint32_t id, ulen;
+	unsigned int npkt, niov, len;
+	int prv, bad;
+
+#define RXBUF(id) (viu->viu_mem + viu->viu_rxbufoff + (id) * VHU_RXBUFSZ)
+#define USED(i) (&vq->vq_used->ring[(uint16_t)(i) % VHU_QSZ])
+
+	rumpuser_component_kthread();
+
+	for (;;) {
+		if (vif_runctl_wait(&viu->viu_runctl))
+			break;
+
+		usedidx = __atomic_load_n(&vq->vq_used->idx, __ATOMIC_ACQUIRE);
+		if (usedidx == vq->vq_lastused) {
+			pfd[0].fd = vq->vq_callfd;
+			pfd[0].events = POLLIN;
+			pfd[1].fd = vif_runctl_fd(&viu->viu_runctl);
+			pfd[1].events = POLLIN;
+
+			prv = poll(pfd, 2, -1);
+			if (prv < 0 && errno != EINTR && errno != EAGAIN) {
+				fprintf(stderr, "vhostif: poll failed: %s\n",
+				    strerror(errno));
+			}
+			if (pfd[0].revents & POLLIN)
+				(void)read(vq->vq_callfd, &cnt, sizeof(cnt));
+			continue;
+		}
+
+		npkt = 0;
+		while (vq->vq_lastused != usedidx) {
+			/*
+			 * The used ring is written by the device: read each
+			 * entry once and check it before it is used to find
+			 * a buffer in our memory.
+			 */
+			ue = USED(vq->vq_lastused);
+			id = ue->id;
+			ulen = ue->len;
+			bad = id >= VHU_QSZ || ulen > VHU_RXBUFSZ;
+			nbufs = 1;
+			hdr = NULL;
+			if (id < VHU_QSZ) {
+				hdr = (void *)RXBUF(id);
+				j = viu->viu_mrg ? hdr->num_buffers : 1;
+				if (j > VHU_QSZ)
+					bad = 1;
+				else if (j > 1)
+					nbufs = j;
+			}
+			if ((uint16_t)(usedidx - vq->vq_lastused) < nbufs)
+				break;	/* device bug, wait for the rest */
+
+			niov = 0;
+			len = 0;
+			j = 0;
+			if (!bad) {
+				if (viu->viu_vnethdr) {
+					iov[niov].iov_base = hdr;
+					iov[niov].iov_len =
+					    sizeof(struct vif_vnethdr);
+					niov++;
+				}
+				len = ulen > viu->viu_hdrsz
+				    ? ulen - viu->viu_hdrsz : 0;
+				iov[niov].iov_base =
+				    (uint8_t *)hdr + viu->viu_hdrsz;
+				iov[niov].iov_len = len;
+				niov++;
+			}
+			for (j = 1; !bad && j < nbufs
+			    && niov < sizeof(iov) / sizeof(iov[0]); j++) {
+				ue = USED(vq->vq_lastused + j);
+				id = ue->id;
+				ulen = ue->len;
+				if (id >= VHU_QSZ || ulen > VHU_RXBUFSZ) {
+					bad = 1;
+					break;
+				}
+				iov[niov].iov_base = RXBUF(id);
+				iov[niov].iov_len = ulen;
+				len += ulen;
+				niov++;
+			}
+
+			if (bad || j < nbufs || len == 0) {
+				vs->vs_drops[VIFSTAT_DROP_COPY]++;
+			} else {
+				vs->vs_ipackets++;
+				vs->vs_ibytes += len;
+				VIF_CAPTURE(viu->viu_cap,
+				    iov + viu->viu_vnethdr,
+				    niov - viu->viu_vnethdr, 0);
+				if (npkt++ == 0)
+					rumpuser_component_schedule(NULL);
+				VIF_DELIVERPKT(viu->viu_virtifsc, iov, niov);
+			}
+
+			/* a bad id is no buffer of ours, it cannot go back */
+			for (j = 0; j < nbufs; j++) {
+				id = USED(vq->vq_lastused + j)->id;
+				if (id < VHU_QSZ)
+					vq->vq_avail->ring[vq->vq_availidx++
+					    % VHU_QSZ] = id;
+			}
+			vq->vq_lastused += nbufs;
+		}
+		if (npkt)
+			rumpuser_component_unschedule();
+		vhupublish(vq);
+		vif_stats_batch(vs, npkt);
+	}
+
+#undef USED
+#undef RXBUF
+
+	rumpuser_component_kthread_release();
+	return NULL;
+}
+
+int
+VIFHYPER_CREATE(const char *devstr, struct virtif_sc *vif_sc, uint8_t *enaddr,
+	struct virtif_user **viup)
+{
+	struct virtif_user *viu = NULL;
+	struct vhostif_params vp;
+	pthread_attr_t attr;
+	void *cookie;
+	int i, rv;
+
+	cookie = rumpuser_component_unschedule();
+
+	memset(&vp, 0, sizeof(vp));
+	vif_cpuspec_init(&vp.vp_cpu);
+	vif_capspec_init(&vp.vp_cap);
+	if ((rv = vif_parselinkstr("vhostif", devstr, vp.vp_path,
+	    sizeof(vp.vp_path), vhostopt, &vp)) != 0)
+		goto out;
+
+	viu = calloc(1, sizeof(*viu));
+	if (viu == NULL) {
+		rv = errno;
+		goto out;
+	}
+	viu->viu_sock = viu->viu_memfd = -1;
+	for (i = 0; i < 2; i++)
+		viu->viu_q[i].vq_kickfd = viu->viu_q[i].vq_callfd = -1;
+
+	if ((rv = openvhost(&vp, viu)) != 0) {
+		closevhost(viu);
+		free(viu);
+		viu = NULL;
+		goto out;
+	}
+	if ((rv = vif_runctl_init(&viu->viu_runctl)) != 0) {
+		closevhost(viu);
+		free(viu);
+		viu = NULL;
+		goto out;
+	}
+	if ((rv = vif_capture_open(&viu->viu_cap, &vp.vp_cap,
+	    "vhost")) != 0) {
+		vif_runctl_fini(&viu->viu_runctl);
+		closevhost(viu);
+		free(viu);
+		viu = NULL;
+		goto out;
+	}
+	viu->viu_virtifsc = vif_sc;
+	strcpy(viu->viu_path, vp.vp_path);
+
+	/* the device is a local process, there is no NIC to be near */
+	pthread_attr_init(&attr);
+	if (vif_placethread("", &vp.vp_cpu, -1, &attr,
+	    viu->viu_placement, sizeof(viu->viu_placement)) != 0) {
+		snprintf(viu->viu_placement, sizeof(viu->viu_placement),
+		    "rx unpinned");
+		pthread_attr_destroy(&attr);
+		pthread_attr_init(&attr);
+	}
+	rv = pthread_create(&viu->viu_pt, &attr, receiver, viu);
+	pthread_attr_destroy(&attr);
+	if (rv != 0) {
+		if (viu->viu_cap != NULL)
+			vif_capture_close(viu->viu_cap);
+		vif_runctl_fini(&viu->viu_runctl);
+		closevhost(viu);
+		free(viu);
+		viu = NULL;
+	}
+
+ out:
+	rumpuser_component_schedule(cookie);
+
+	*viup = viu;
+	return rumpuser_component_errtrans(rv);
+}
+
+void
+VIFHYPER_INFO(struct virtif_user *viu, char *buf, size_t buflen)
+{
+
+	snprintf(buf, buflen, "%s%s%s%s", viu->viu_placement,
+	    viu->viu_mrg ? ", mrg_rxbuf" : "",
+	    viu->viu_vnethdr ? ", csum" : "",
+	    viu->viu_tso ? ", tso" : "");
+}
+
+int
+VIFHYPER_FLAGS(struct virtif_user *viu)
+{
+
+	return (viu->viu_vnethdr ? VIFFLAG_VNETHDR : 0)
+	    | (viu->viu_tso ? VIFFLAG_TSO : 0);
+}
+
+/* not implemented for the virtqueues */
+int
+VIFHYPER_COALESCE(struct virtif_user *viu, struct virtif_coalesce *vc,
+	int set)
+{
+
+	return rumpuser_component_errtrans(EOPNOTSUPP);
+}
+
+/* there is one tx virtqueue, and it takes a single producer */
+int
+VIFHYPER_TXRINGS(struct virtif_user *viu)
+{
+
+	return 1;
+}
+
+int
+VIFHYPER_STATS(struct virtif_user *viu, int ring, struct virtif_stats *vs)
+{
+
+	memset(vs, 0, sizeof(*vs));
+	if (ring > 0)
+		return rumpuser_component_errtrans(ENOENT);
+	vif_stats_add(vs, &viu->viu_rxstats);
+	vif_stats_add(vs, &viu->viu_txstats);
+	return 0;
+}
+
+/* take back the tx slots the device is done with */
+static void
+reclaimtx(struct virtif_user *viu)
+{
+	struct vhuq *vq = &viu->viu_q[VHU_TXQ];
+	uint32_t id;
+	uint16_t usedidx;
+
+	usedidx = __atomic_load_n(&vq->vq_used->idx, __ATOMIC_ACQUIRE);
+	for (; vq->vq_lastused != usedidx; vq->vq_lastused++) {
+		id = vq->vq_used->ring[vq->vq_lastused % VHU_QSZ].id;
+		/* only heads of our slots, and never more than we have */
+		if (id >= VHU_QSZ || id % viu->viu_txdescs != 0
+		    || viu->viu_ntxfree == VHU_QSZ / viu->viu_txdescs)
+			continue;
+		viu->viu_txfree[viu->viu_ntxfree++] = id;
+	}
+}
+
+/*
+ * Wait for the device to complete tx slots.  The tx queue normally
+ * runs without interrupts; ask for one while we wait.
+ */
+static void
+waittx(struct virtif_user *viu)
+{
+	struct vhuq *vq = &viu->viu_q[VHU_TXQ];
+	struct pollfd pfd;
+	uint64_t cnt;
+
+	vq->vq_avail->flags = 0;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&vq->vq_used->idx, __ATOMIC_ACQUIRE)
+	    == vq->vq_lastused) {
+		pfd.fd = vq->vq_callfd;
+		pfd.events = POLLIN;
+		(void)poll(&pfd, 1, 500 /* ms */);
+	}
+	(void)read(vq->vq_callfd, &cnt, sizeof(cnt));
+	vq->vq_avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+}
+
+/*
+ * Copy a batch of frames into tx slots, make them available and kick
+ * the device once.  Returns the number of frames queued; the rest
+ * were dropped for lack of slots.
+ */
+int
+VIFHYPER_SEND(struct virtif_user *viu, int txring, struct iovec *iov,
+	const size_t *iovcnt, size_t npkt)
+{
+	void *cookie = NULL; /* XXXgcc */
+	struct vhuq *vq = &viu->viu_q[VHU_TXQ];
+	struct virtif_stats *vs = &viu->viu_txstats;
+	size_t pkt, sent = 0, i, n, totlen, maxlen, first;
+	uint16_t head;
+	uint8_t *p;
+	int retries, unscheduled = 0;
+
+	maxlen = viu->viu_txslotsz - viu->viu_hdrsz;
+	for (pkt = 0; pkt < npkt; iov += iovcnt[pkt], pkt++) {
+		for (retries = 10; viu->viu_ntxfree == 0 && retries > 0;
+		    retries--) {
+			reclaimtx(viu);
+			if (viu->viu_ntxfree > 0)
+				break;
+			if (!unscheduled) {
+				cookie = rumpuser_component_unschedule();
+				unscheduled = 1;
+			}
+			vhupublish(vq);
+			waittx(viu);
+		}
+		if (viu->viu_ntxfree == 0)
+			break;
+
+		head = viu->viu_txfree[--viu->viu_ntxfree];
+		p = txslot(viu, head);
+		memset(p, 0, viu->viu_hdrsz);
+		first = 0;
+		if (viu->viu_vnethdr) {
+			memcpy(p, iov[0].iov_base, sizeof(struct vif_vnethdr));
+			first = 1;
+		}
+		p += viu->viu_hdrsz;
+		for (i = first, totlen = 0;
+		    totlen < maxlen && i < iovcnt[pkt]; i++) {
+			n = iov[i].iov_len;
+			if (totlen + n > maxlen) {
+				n = maxlen - totlen;
+				vs->vs_otruncated++;
+			}
+			memcpy(p + totlen, iov[i].iov_base, n);
+			totlen += n;
+		}
+		if (viu->viu_txdescs == 2)
+			vq->vq_desc[head+1].len = totlen;
+		else
+			vq->vq_desc[head].len = viu->viu_hdrsz + totlen;
+		vq->vq_avail->ring[vq->vq_availidx++ % VHU_QSZ] = head;
+		VIF_CAPTURE(viu->viu_cap, iov + first, iovcnt[pkt] - first, 1);
+
+		vs->vs_opackets++;
+		vs->vs_obytes += totlen;
+		sent++;
+	}
+
+	if (sent > 0)
+		vhupublish(vq);
+	vs->vs_drops[VIFSTAT_DROP_TXFULL] += npkt - sent;
+
+	if (unscheduled)
+		rumpuser_component_schedule(cookie);
+	return (int)sent;
+}
+
+void
+VIFHYPER_START(struct virtif_user *viu)
+{
+
+	vif_runctl_start(&viu->viu_runctl);
+}
+
+void
+VIFHYPER_STOP(struct virtif_user *viu)
+{
+
+	vif_runctl_stop(&viu->viu_runctl);
+}
+
+void
+VIFHYPER_DYING(struct virtif_user *viu)
+{
+
+	vif_runctl_dying(&viu->viu_runctl);
+}
+
+void
+VIFHYPER_DESTROY(struct virtif_user *viu)
+{
+	void *cookie = rumpuser_component_unschedule();
+
+	pthread_join(viu->viu_pt, NULL);
+	if (viu->viu_cap != NULL)
+		vif_capture_close(viu->viu_cap);
+	vif_runctl_fini(&viu->viu_runctl);
+	/* closing the socket tells the device to stop using our memory */
+	closevhost(viu);
+	free(viu);
+
+	rumpuser_component_schedule(cookie);
+}
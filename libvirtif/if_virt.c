@@ -29,12 +29,15 @@
 __KERNEL_RCSID(0, "$NetBSD: if_virt.c,v 1.36 2013/07/04 11:46:51 pooka Exp $");
 
 #include <sys/param.h>
+#include <sys/atomic.h>
 #include <sys/condvar.h>
+#include <sys/cpu.h>
 #include <sys/fcntl.h>
 #include <sys/kernel.h>
 #include <sys/kmem.h>
 #include <sys/kthread.h>
 #include <sys/mutex.h>
+#include <sys/percpu.h>
 #include <sys/poll.h>
 #include <sys/sockio.h>
 #include <sys/socketvar.h>
@@ -47,6 +50,10 @@ __KERNEL_RCSID(0, "$NetBSD: if_virt.c,v 1.36 2013/07/04 11:46:51 pooka Exp $");
 
 #include <netinet/in.h>
 #include <netinet/in_var.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
 
 #include <rump/rump.h>
 
@@ -54,6 +61,7 @@ __KERNEL_RCSID(0, "$NetBSD: if_virt.c,v 1.36 2013/07/04 11:46:51 pooka Exp $");
 #include "rump_net_private.h"
 
 #include "if_virt.h"
+#include "virtif_cycles.h"
 #include "rumpcomp_user.h"
 
 /*
@@ -62,31 +70,187 @@ __KERNEL_RCSID(0, "$NetBSD: if_virt.c,v 1.36 2013/07/04 11:46:51 pooka Exp $");
  * hypercall implementation.
  */
 
+/*
+ * Where the network stack supports it, the interface is MPSAFE:
+ * received frames are queued on the per-cpu input queue instead of
+ * going through ether_input() under the big lock, so that several
+ * receivers can run at once.  Such stacks also have if_transmit,
+ * which we use to send without going through if_snd.
+ *
+ * The NetBSD sources this driver is normally built with predate
+ * IFEF_MPSAFE and if_percpuq.  There the input pipeline plays the
+ * part of the per-cpu input queue and is always used: receivers
+ * only queue their frames, and the pipeline thread takes the kernel
+ * lock once per pass to input them.
+ */
+#ifdef IFEF_MPSAFE
+#define VIF_MPSAFE
+#endif
+
 static int	virtif_init(struct ifnet *);
 static int	virtif_ioctl(struct ifnet *, u_long, void *);
 static void	virtif_start(struct ifnet *);
 static void	virtif_stop(struct ifnet *, int);
+#ifdef VIF_MPSAFE
+static int	virtif_transmit(struct ifnet *, struct mbuf *);
+#endif
 
 struct virtif_sc {
 	struct ethercom sc_ec;
 	struct virtif_user *sc_viu;
+	int sc_vflags;		/* VIFFLAG_*, from the hypercall layer */
+	kmutex_t sc_txlock;	/* serializes virtif_start() */
+	struct virtif_txring *sc_txr;	/* [sc_ntxr] */
+	int sc_ntxr;
+	uint32_t *sc_txmap;	/* [ncpu], the tx ring of each cpu */
 
 	int sc_num;
 	char *sc_linkstr;
 	size_t sc_linkstrlen;
+
+	/* drops noticed on this side of the hypercall boundary, atomic */
+	uint64_t sc_drops[VIFSTAT_NDROP];
+
+	percpu_t *sc_mcache;	/* struct virtif_mcache */
+	struct virtif_pipeline *sc_pipeline;	/* NULL until started */
+
+#ifdef VIRTIF_CYCLES
+	/* owned by the hypercall layer, we just add our stages */
+	struct vif_cychist *sc_cyc;
+#endif
+};
+
+/*
+ * Receive mbufs, ready to be filled: packet header mbufs with and
+ * without a cluster.  The cache is per cpu, so that the receivers,
+ * which enter the kernel on different virtual cpus, do not share
+ * it.  An empty cache is refilled by VIF_MC_STEP, a receiver batch,
+ * so that no single frame pays for many allocations while the
+ * receiver holds the cpu.  A refill which fails to allocate means
+ * the pools are running dry.  From then on, whenever the cache is
+ * below VIF_MC_STEP it is topped up again, and the stack is reported
+ * as overloaded until such a top-up succeeds.
+ */
+#define VIF_MC_STEP	32
+#define VIF_MCACHESZ	(2*VIF_MC_STEP)
+#define VIF_MC_HDR	0	/* data up to MHLEN */
+#define VIF_MC_CLUSTER	1	/* up to MCLBYTES */
+
+struct virtif_mcache {
+	int mc_n[2];
+	bool mc_short[2];
+	struct mbuf *mc_m[2][VIF_MCACHESZ];
+};
+
+/*
+ * Backend tx rings.  Each cpu sends on a ring of its own, so that
+ * senders on different cpus do not contend.  If there are more cpus
+ * than rings, the cpus left over share the last ring.  The lock of a
+ * ring still serializes the senders on it: VIFHYPER_SEND() gives up
+ * the cpu, and another thread may then send from the same cpu.
+ */
+struct virtif_txring {
+	kmutex_t tr_lock __aligned(COHERENCY_UNIT);
 };
 
 static int  virtif_clone(struct if_clone *, int);
 static int  virtif_unclone(struct ifnet *);
+static void virtif_mdrain(void *, void *, struct cpu_info *);
+
+/*
+ * Input pipeline.  With IFF_LINK0 set when the interface is brought
+ * up, or always on a stack which is not MPSAFE, the receivers only
+ * build mbufs and queue them, and a kernel thread of the interface's
+ * own runs the protocol input.  That thread can then fall behind a
+ * burst without holding up the receivers, which keep draining the
+ * rings into the queues.  Each virtual cpu has its own single-producer
+ * single-consumer queue.  There is no preemption inside
+ * VIF_DELIVERPKT, so the receiver running on a cpu is the only
+ * producer of that cpu's queue.  The input thread is the only
+ * consumer of all the queues.  Frames which find their queue full
+ * are dropped.
+ */
+#define VIF_PIPESZ	1024	/* per cpu */
+#define VIF_PIPEHIWAT	(VIF_PIPESZ - VIF_PIPESZ/4)	/* overloaded */
+
+struct virtif_pipe {
+	/* producer: the receiver on this cpu */
+	volatile u_int pp_prod __aligned(COHERENCY_UNIT);
+	uint64_t pp_enqueued;
+	uint64_t pp_drops;
+
+	/* consumer: the input thread */
+	volatile u_int pp_cons __aligned(COHERENCY_UNIT);
+	u_int pp_maxocc;
+
+	struct mbuf *pp_m[VIF_PIPESZ] __aligned(COHERENCY_UNIT);
+};
+
+struct virtif_pipeline {
+	struct virtif_sc *pl_sc;
+	kmutex_t pl_lock;
+	kcondvar_t pl_cv;
+	volatile bool pl_sleeping;	/* the thread waits for pl_cv */
+	bool pl_dying;
+	uint64_t pl_wakeups;
+	struct lwp *pl_lwp;
+
+	u_int pl_npipe;
+	struct virtif_pipe *pl_pipe;	/* [ncpu] */
+};
+
+static void virtif_pipestart(struct virtif_sc *);
+static void virtif_pipestop(struct virtif_sc *);
 
 struct if_clone VIF_CLONER =
     IF_CLONE_INITIALIZER(VIF_NAME, virtif_clone, virtif_unclone);
 
+static void
+virtif_txsetup(struct virtif_sc *sc)
+{
+	int i;
+	u_int c;
+
+	sc->sc_ntxr = VIFHYPER_TXRINGS(sc->sc_viu);
+	sc->sc_txr = kmem_zalloc(sc->sc_ntxr * sizeof(*sc->sc_txr), KM_SLEEP);
+	for (i = 0; i < sc->sc_ntxr; i++)
+		mutex_init(&sc->sc_txr[i].tr_lock, MUTEX_DEFAULT, IPL_NONE);
+	sc->sc_txmap = kmem_alloc(ncpu * sizeof(*sc->sc_txmap), KM_SLEEP);
+	for (c = 0; c < ncpu; c++)
+		sc->sc_txmap[c] = MIN(c, sc->sc_ntxr - 1);
+}
+
+static void
+virtif_txteardown(struct virtif_sc *sc)
+{
+	int i;
+
+	if (sc->sc_txr == NULL)
+		return;
+	for (i = 0; i < sc->sc_ntxr; i++)
+		mutex_destroy(&sc->sc_txr[i].tr_lock);
+	kmem_free(sc->sc_txr, sc->sc_ntxr * sizeof(*sc->sc_txr));
+	kmem_free(sc->sc_txmap, ncpu * sizeof(*sc->sc_txmap));
+}
+
+/* the ring of the cpu we are on, the thread may move on afterwards */
+static int
+virtif_txring(struct virtif_sc *sc)
+{
+	int ring;
+
+	kpreempt_disable();
+	ring = sc->sc_txmap[cpu_index(curcpu())];
+	kpreempt_enable();
+	return ring;
+}
+
 static int
 virtif_create(struct ifnet *ifp)
 {
 	uint8_t enaddr[ETHER_ADDR_LEN] = { 0xb2, 0x0a, 0x00, 0x0b, 0x0e, 0x01 };
 	char enaddrstr[3*ETHER_ADDR_LEN];
+	char info[64];
 	struct virtif_sc *sc = ifp->if_softc;
 	int error;
 
@@ -101,10 +265,39 @@ virtif_create(struct ifnet *ifp)
 		return error;
 	}
 	IFQ_SET_READY(&ifp->if_snd);
+	virtif_txsetup(sc);
+
+	/*
+	 * With the virtio-net header the host takes and hands up
+	 * partially checksummed (and possibly TSO) frames, so offer
+	 * the offloads and have them on by default.
+	 */
+	sc->sc_vflags = VIFHYPER_FLAGS(sc->sc_viu);
+	if (sc->sc_vflags & VIFFLAG_VNETHDR) {
+		ifp->if_capabilities =
+		    IFCAP_CSUM_TCPv4_Tx | IFCAP_CSUM_TCPv4_Rx |
+		    IFCAP_CSUM_UDPv4_Tx | IFCAP_CSUM_UDPv4_Rx |
+		    IFCAP_CSUM_TCPv6_Tx | IFCAP_CSUM_TCPv6_Rx |
+		    IFCAP_CSUM_UDPv6_Tx | IFCAP_CSUM_UDPv6_Rx;
+		ifp->if_csum_flags_tx = M_CSUM_TCPv4 | M_CSUM_UDPv4 |
+		    M_CSUM_TCPv6 | M_CSUM_UDPv6;
+		ifp->if_csum_flags_rx = M_CSUM_TCPv4 | M_CSUM_UDPv4 |
+		    M_CSUM_TCPv6 | M_CSUM_UDPv6;
+		if (sc->sc_vflags & VIFFLAG_TSO) {
+			ifp->if_capabilities |= IFCAP_TSOv4 | IFCAP_TSOv6;
+			ifp->if_csum_flags_tx |= M_CSUM_TSOv4 | M_CSUM_TSOv6;
+		}
+		ifp->if_capenable = ifp->if_capabilities;
+	}
+#ifdef VIRTIF_CYCLES
+	sc->sc_cyc = VIFHYPER_CYCLES(sc->sc_viu);
+#endif
 
 	ether_ifattach(ifp, enaddr);
 	ether_snprintf(enaddrstr, sizeof(enaddrstr), enaddr);
-	aprint_normal_ifnet(ifp, "Ethernet address %s\n", enaddrstr);
+	VIFHYPER_INFO(sc->sc_viu, info, sizeof(info));
+	aprint_normal_ifnet(ifp, "Ethernet address %s%s%s\n", enaddrstr,
+	    info[0] ? ", " : "", info);
 
 	return 0;
 }
@@ -118,6 +311,8 @@ virtif_clone(struct if_clone *ifc, int num)
 
 	sc = kmem_zalloc(sizeof(*sc), KM_SLEEP);
 	sc->sc_num = num;
+	sc->sc_mcache = percpu_alloc(sizeof(struct virtif_mcache));
+	mutex_init(&sc->sc_txlock, MUTEX_DEFAULT, IPL_NONE);
 	ifp = &sc->sc_ec.ec_if;
 	snprintf(ifp->if_xname, sizeof(ifp->if_xname), "%s%d", VIF_NAME, num);
 	ifp->if_softc = sc;
@@ -129,6 +324,10 @@ virtif_clone(struct if_clone *ifc, int num)
 	ifp->if_stop = virtif_stop;
 	ifp->if_mtu = ETHERMTU;
 	ifp->if_dlt = DLT_EN10MB;
+#ifdef VIF_MPSAFE
+	ifp->if_extflags = IFEF_MPSAFE;
+	ifp->if_transmit = virtif_transmit;
+#endif
 
 	if_attach(ifp);
 
@@ -145,6 +344,8 @@ virtif_clone(struct if_clone *ifc, int num)
 	error = virtif_create(ifp);
 	if (error) {
 		if_detach(ifp);
+		percpu_free(sc->sc_mcache, sizeof(struct virtif_mcache));
+		mutex_destroy(&sc->sc_txlock);
 		kmem_free(sc, sizeof(*sc));
 		ifp->if_softc = NULL;
 	}
@@ -164,12 +365,20 @@ virtif_unclone(struct ifnet *ifp)
 	if_down(ifp);
 
 	VIFHYPER_DESTROY(sc->sc_viu);
+	if (sc->sc_pipeline != NULL)
+		virtif_pipestop(sc);
 
-	kmem_free(sc, sizeof(*sc));
-
+	/* the ifnet is part of the softc, and queued frames point to it */
 	ether_ifdetach(ifp);
 	if_detach(ifp);
 
+	/* no receiver is left to use the caches */
+	percpu_foreach(sc->sc_mcache, virtif_mdrain, NULL);
+	percpu_free(sc->sc_mcache, sizeof(struct virtif_mcache));
+	virtif_txteardown(sc);
+	mutex_destroy(&sc->sc_txlock);
+	kmem_free(sc, sizeof(*sc));
+
 	return 0;
 }
 
@@ -181,10 +390,136 @@ virtif_init(struct ifnet *ifp)
 	if (sc->sc_viu == NULL)
 		return ENXIO;
 
+	/* once started, the pipeline stays until the interface is gone */
+#ifdef VIF_MPSAFE
+	if ((ifp->if_flags & IFF_LINK0) && sc->sc_pipeline == NULL)
+#else
+	if (sc->sc_pipeline == NULL)
+#endif
+		virtif_pipestart(sc);
+
 	ifp->if_flags |= IFF_RUNNING;
+	VIFHYPER_START(sc->sc_viu);
 	return 0;
 }
 
+static void
+virtif_pipestats(struct virtif_pipeline *pl, struct virtif_pipestats *ps)
+{
+	struct virtif_pipe *pp;
+	u_int c;
+
+	memset(ps, 0, sizeof(*ps));
+	ps->ps_wakeups = pl->pl_wakeups;
+	for (c = 0; c < pl->pl_npipe; c++) {
+		pp = &pl->pl_pipe[c];
+		ps->ps_enqueued += pp->pp_enqueued;
+		ps->ps_drops += pp->pp_drops;
+		ps->ps_occupancy += pp->pp_prod - pp->pp_cons;
+		if (pp->pp_maxocc > ps->ps_maxoccupancy)
+			ps->ps_maxoccupancy = pp->pp_maxocc;
+	}
+}
+
+static int
+virtif_getstats(struct virtif_sc *sc, struct ifdrv *ifd)
+{
+	struct virtif_stats vs;
+	struct virtif_pipestats ps;
+	struct virtif_coalesce vc;
+	size_t len;
+	int i, ring, rv;
+
+	switch (ifd->ifd_cmd) {
+	case VIRTIF_GSTATS:
+		if (ifd->ifd_len < sizeof(vs))
+			return EINVAL;
+		if ((rv = VIFHYPER_STATS(sc->sc_viu, -1, &vs)) != 0)
+			return rv;
+		for (i = 0; i < VIFSTAT_NDROP; i++)
+			vs.vs_drops[i] += sc->sc_drops[i];
+		return copyout(&vs, ifd->ifd_data, sizeof(vs));
+
+	case VIRTIF_GRINGSTATS:
+		for (ring = 0, len = 0;; ring++, len += sizeof(vs)) {
+			rv = VIFHYPER_STATS(sc->sc_viu, ring, &vs);
+			if (rv == ENOENT)
+				break;
+			if (rv)
+				return rv;
+			if (len + sizeof(vs) > ifd->ifd_len)
+				continue;
+			if ((rv = copyout(&vs,
+			    (uint8_t *)ifd->ifd_data + len, sizeof(vs))) != 0)
+				return rv;
+		}
+		/* as with SIOCGLINKSTR, ifd_len is only returned on success */
+		ifd->ifd_len = len;
+		return 0;
+
+	case VIRTIF_GPIPESTATS:
+		if (sc->sc_pipeline == NULL)
+			return ENOENT;
+		if (ifd->ifd_len < sizeof(ps))
+			return EINVAL;
+		virtif_pipestats(sc->sc_pipeline, &ps);
+		return copyout(&ps, ifd->ifd_data, sizeof(ps));
+
+	case VIRTIF_GTXMAP:
+		len = MIN(ifd->ifd_len / sizeof(*sc->sc_txmap), ncpu)
+		    * sizeof(*sc->sc_txmap);
+		if (len > 0 && (rv = copyout(sc->sc_txmap, ifd->ifd_data,
+		    len)) != 0)
+			return rv;
+		ifd->ifd_len = ncpu * sizeof(*sc->sc_txmap);
+		return 0;
+
+	case VIRTIF_GCOALESCE:
+		if (ifd->ifd_len < sizeof(vc))
+			return EINVAL;
+		if ((rv = VIFHYPER_COALESCE(sc->sc_viu, &vc, 0)) != 0)
+			return rv;
+		ifd->ifd_len = sizeof(vc);
+		return copyout(&vc, ifd->ifd_data, sizeof(vc));
+
+#ifdef VIRTIF_CYCLES
+	case VIRTIF_GCYCLES:
+		len = MIN(ifd->ifd_len / sizeof(*sc->sc_cyc), VIFCYC_NSTAGES)
+		    * sizeof(*sc->sc_cyc);
+		if (len > 0 && (rv = copyout(sc->sc_cyc, ifd->ifd_data,
+		    len)) != 0)
+			return rv;
+		ifd->ifd_len = VIFCYC_NSTAGES * sizeof(*sc->sc_cyc);
+		return 0;
+#endif
+
+	default:
+		return ENOTTY;
+	}
+}
+
+static int
+virtif_setparam(struct virtif_sc *sc, struct ifdrv *ifd)
+{
+	struct virtif_coalesce vc;
+	int rv;
+
+	switch (ifd->ifd_cmd) {
+	case VIRTIF_SCOALESCE:
+		if (ifd->ifd_len < sizeof(vc))
+			return EINVAL;
+		if ((rv = copyin(ifd->ifd_data, &vc, sizeof(vc))) != 0)
+			return rv;
+		if (vc.vc_frames > VIFCOAL_MAXFRAMES
+		    || vc.vc_usecs > VIFCOAL_MAXUSECS)
+			return EINVAL;
+		return VIFHYPER_COALESCE(sc->sc_viu, &vc, 1);
+
+	default:
+		return ENOTTY;
+	}
+}
+
 static int
 virtif_ioctl(struct ifnet *ifp, u_long cmd, void *data)
 {
@@ -263,6 +598,20 @@ virtif_ioctl(struct ifnet *ifp, u_long cmd, void *data)
 		}
 		break;
 #endif /* RUMP_VIF_LINKSTR */
+	case SIOCGDRVSPEC:
+		if (sc->sc_viu == NULL) {
+			rv = ENXIO;
+			break;
+		}
+		rv = virtif_getstats(sc, data);
+		break;
+	case SIOCSDRVSPEC:
+		if (sc->sc_viu == NULL) {
+			rv = ENXIO;
+			break;
+		}
+		rv = virtif_setparam(sc, data);
+		break;
 	default:
 		if (!sc->sc_linkstr)
 			rv = ENXIO;
@@ -276,85 +625,647 @@ virtif_ioctl(struct ifnet *ifp, u_long cmd, void *data)
 	return rv;
 }
 
+/*
+ * Locate the transport header of an IPv4 or IPv6 frame.  Returns its
+ * offset and the protocol, or -1 for anything else.
+ */
+static int
+virtif_l4hdr(struct mbuf *m, int *protop, bool *v6p)
+{
+	struct ip ip;
+	struct ip6_hdr ip6;
+	struct ip6_ext ext;
+	uint16_t etype;
+	int off, nxt, len = m->m_pkthdr.len;
+
+	off = ETHER_HDR_LEN;
+	if (len < off)
+		return -1;
+	m_copydata(m, off - sizeof(etype), sizeof(etype), &etype);
+	if (ntohs(etype) == ETHERTYPE_VLAN) {
+		off += ETHER_VLAN_ENCAP_LEN;
+		if (len < off)
+			return -1;
+		m_copydata(m, off - sizeof(etype), sizeof(etype), &etype);
+	}
+
+	switch (ntohs(etype)) {
+	case ETHERTYPE_IP:
+		if (len < off + (int)sizeof(ip))
+			return -1;
+		m_copydata(m, off, sizeof(ip), &ip);
+		*protop = ip.ip_p;
+		*v6p = false;
+		return off + ip.ip_hl * 4;
+
+	case ETHERTYPE_IPV6:
+		if (len < off + (int)sizeof(ip6))
+			return -1;
+		m_copydata(m, off, sizeof(ip6), &ip6);
+		off += sizeof(ip6);
+		nxt = ip6.ip6_nxt;
+		while (nxt == IPPROTO_HOPOPTS || nxt == IPPROTO_ROUTING
+		    || nxt == IPPROTO_DSTOPTS) {
+			if (len < off + (int)sizeof(ext))
+				return -1;
+			m_copydata(m, off, sizeof(ext), &ext);
+			nxt = ext.ip6e_nxt;
+			off += (ext.ip6e_len + 1) * 8;
+		}
+		*protop = nxt;
+		*v6p = true;
+		return off;
+
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Describe the checksum and segmentation work the stack left for
+ * the interface in a virtio-net header.
+ */
+static void
+virtif_txoffload(struct mbuf *m, struct vif_vnethdr *vh)
+{
+	struct tcphdr th;
+	uint32_t sum;
+	int off, proto;
+	bool v6;
+
+	memset(vh, 0, sizeof(*vh));
+	if ((m->m_pkthdr.csum_flags & (M_CSUM_TCPv4 | M_CSUM_UDPv4 |
+	    M_CSUM_TCPv6 | M_CSUM_UDPv6 | M_CSUM_TSOv4 | M_CSUM_TSOv6)) == 0)
+		return;
+	if ((off = virtif_l4hdr(m, &proto, &v6)) == -1)
+		return;
+
+	vh->vh_flags = VIF_VNET_F_NEEDS_CSUM;
+	vh->vh_csum_start = off;
+	if (proto == IPPROTO_TCP) {
+		vh->vh_csum_offset = offsetof(struct tcphdr, th_sum);
+	} else {
+		vh->vh_csum_offset = offsetof(struct udphdr, uh_sum);
+	}
+
+	if ((m->m_pkthdr.csum_flags & (M_CSUM_TSOv4 | M_CSUM_TSOv6)) == 0)
+		return;
+	if (proto != IPPROTO_TCP || m->m_pkthdr.len < off + (int)sizeof(th))
+		return;
+
+	/*
+	 * For TSO our stack leaves the length out of the pseudo-header
+	 * sum, while the host's segmentation expects it in.
+	 */
+	m_copydata(m, off, sizeof(th), &th);
+	sum = th.th_sum + htons(m->m_pkthdr.len - off);
+	sum = (sum & 0xffff) + (sum >> 16);
+	th.th_sum = sum;
+	m_copyback(m, off + offsetof(struct tcphdr, th_sum),
+	    sizeof(th.th_sum), &th.th_sum);
+
+	vh->vh_gso_type = v6 ? VIF_VNET_GSO_TCPV6 : VIF_VNET_GSO_TCPV4;
+	vh->vh_gso_size = m->m_pkthdr.segsz;
+	vh->vh_hdr_len = off + th.th_off * 4;
+}
+
+#ifdef VIF_MPSAFE
+/* take the length back out of the TSO pseudo-header sum */
+static void
+virtif_txoffload_undo(struct mbuf *m, const struct vif_vnethdr *vh)
+{
+	uint16_t ck;
+	uint32_t sum;
+	int off = vh->vh_csum_start;
+
+	if (vh->vh_gso_type == 0)
+		return;
+	m_copydata(m, off + offsetof(struct tcphdr, th_sum), sizeof(ck), &ck);
+	sum = ck + (uint16_t)~htons(m->m_pkthdr.len - off);
+	sum = (sum & 0xffff) + (sum >> 16);
+	ck = sum;
+	m_copyback(m, off + offsetof(struct tcphdr, th_sum), sizeof(ck), &ck);
+}
+#endif
+
 /*
  * Output packets in-context until outgoing queue is empty.
+ * Packets are passed to the hypercall layer in batches so that
+ * the per-call cost of the backend (unscheduling, ring sync)
+ * is amortized over several frames.
  * Assume that VIFHYPER_SEND() is fast enough to not make it
  * necessary to drop kernel_lock.
  */
-#define LB_SH 32
+#define LB_SH 64		/* max mbufs per packet, a 64k TSO frame fits */
+#define VIF_TXBATCH 32		/* max packets per VIFHYPER_SEND() */
+#define VIF_TXIOV (2*LB_SH)	/* max iovecs per VIFHYPER_SEND() */
+
+/* lay out one frame for VIFHYPER_SEND(), returns the number of iovecs */
+static int
+virtif_txiov(struct virtif_sc *sc, struct mbuf *m0, struct iovec *io,
+	struct vif_vnethdr *vh)
+{
+	struct mbuf *m;
+	int niov = 0;
+
+	if (sc->sc_vflags & VIFFLAG_VNETHDR) {
+		virtif_txoffload(m0, vh);
+		io[niov].iov_base = vh;
+		io[niov].iov_len = sizeof(*vh);
+		niov++;
+	}
+	for (m = m0; m; m = m->m_next, niov++) {
+		io[niov].iov_base = mtod(m, void *);
+		io[niov].iov_len = m->m_len;
+	}
+	return niov;
+}
+
 static void
 virtif_start(struct ifnet *ifp)
 {
 	struct virtif_sc *sc = ifp->if_softc;
-	struct mbuf *m, *m0;
-	struct iovec io[LB_SH];
-	int i;
+	struct mbuf *m, *m0, *batch[VIF_TXBATCH];
+	struct vif_vnethdr vh[VIF_TXBATCH];
+	struct iovec io[VIF_TXIOV];
+	size_t iovcnt[VIF_TXBATCH];
+	struct virtif_txring *tr;
+	int i, n, niov, npkt, sent, hdriov, ring;
+
+	hdriov = (sc->sc_vflags & VIFFLAG_VNETHDR) ? 1 : 0;
 
+	/* without the big lock, senders may come from several cpus */
+	mutex_enter(&sc->sc_txlock);
 	ifp->if_flags |= IFF_OACTIVE;
 
 	for (;;) {
-		IF_DEQUEUE(&ifp->if_snd, m0);
-		if (!m0) {
-			break;
+		for (npkt = 0, niov = 0; npkt < VIF_TXBATCH; npkt++) {
+			IFQ_POLL(&ifp->if_snd, m0);
+			if (!m0)
+				break;
+			for (n = 0, m = m0; m; m = m->m_next)
+				n++;
+			if (n > LB_SH)
+				panic("lazy bum");
+			if (niov + hdriov + n > VIF_TXIOV)
+				break;
+			IFQ_DEQUEUE(&ifp->if_snd, m0);
+
+			niov += virtif_txiov(sc, m0, &io[niov], &vh[npkt]);
+			bpf_mtap(ifp, m0);
+			batch[npkt] = m0;
+			iovcnt[npkt] = hdriov + n;
 		}
+		if (npkt == 0)
+			break;
 
-		m = m0;
-		for (i = 0; i < LB_SH && m; i++) {
-			io[i].iov_base = mtod(m, void *);
-			io[i].iov_len = m->m_len;
-			m = m->m_next;
+		/* the first "sent" packets made it, the rest were dropped */
+		ring = virtif_txring(sc);
+		tr = &sc->sc_txr[ring];
+		mutex_enter(&tr->tr_lock);
+		sent = VIFHYPER_SEND(sc->sc_viu, ring, io, iovcnt, npkt);
+		mutex_exit(&tr->tr_lock);
+		for (i = 0; i < npkt; i++) {
+			/* direct senders count concurrently */
+			if (i < sent) {
+				atomic_inc_64(&ifp->if_opackets);
+				atomic_add_64(&ifp->if_obytes,
+				    batch[i]->m_pkthdr.len);
+			} else {
+				atomic_inc_64(&ifp->if_oerrors);
+			}
+			m_freem(batch[i]);
 		}
-		if (i == LB_SH)
-			panic("lazy bum");
-		bpf_mtap(ifp, m0);
+	}
 
-		VIFHYPER_SEND(sc->sc_viu, io, i);
+	ifp->if_flags &= ~IFF_OACTIVE;
+	mutex_exit(&sc->sc_txlock);
+}
 
+#ifdef VIF_MPSAFE
+/*
+ * Send a frame from the caller's context without the round trip
+ * through if_snd.  Only if there is a backlog, another sender is
+ * busy with this cpu's ring or the ring is full is the frame queued
+ * for virtif_start().  The backlog goes first so that frames are not
+ * reordered.  Stacks without IFEF_MPSAFE have no if_transmit, and
+ * there every frame goes through if_snd.
+ */
+static int
+virtif_transmit(struct ifnet *ifp, struct mbuf *m0)
+{
+	struct virtif_sc *sc = ifp->if_softc;
+	struct virtif_txring *tr;
+	struct vif_vnethdr vh;
+	struct iovec io[VIF_TXIOV];
+	struct mbuf *m;
+	size_t iovcnt;
+	int n, ring, error;
+
+	for (n = 0, m = m0; m; m = m->m_next)
+		n++;
+	if (n > LB_SH)
+		panic("lazy bum");
+	if ((ifp->if_flags & IFF_RUNNING) == 0) {
 		m_freem(m0);
+		return ENETDOWN;
 	}
 
-	ifp->if_flags &= ~IFF_OACTIVE;
+	ring = virtif_txring(sc);
+	tr = &sc->sc_txr[ring];
+	if (!IFQ_IS_EMPTY(&ifp->if_snd) || !mutex_tryenter(&tr->tr_lock))
+		goto queue;
+
+	iovcnt = virtif_txiov(sc, m0, io, &vh);
+	if (VIFHYPER_SEND(sc->sc_viu, ring, io, &iovcnt, 1) != 1) {
+		/* virtif_start() lays it out again */
+		mutex_exit(&tr->tr_lock);
+		if (sc->sc_vflags & VIFFLAG_VNETHDR)
+			virtif_txoffload_undo(m0, &vh);
+		goto queue;
+	}
+	mutex_exit(&tr->tr_lock);
+	bpf_mtap(ifp, m0);
+	atomic_inc_64(&ifp->if_opackets);
+	atomic_add_64(&ifp->if_obytes, m0->m_pkthdr.len);
+	m_freem(m0);
+	return 0;
+
+ queue:
+	IFQ_ENQUEUE(&ifp->if_snd, m0, error);
+	if (error)
+		return error;
+	virtif_start(ifp);
+	return 0;
 }
+#endif /* VIF_MPSAFE */
 
 static void
 virtif_stop(struct ifnet *ifp, int disable)
 {
-
-	/* XXX: VIFHYPER_STOP() */
+	struct virtif_sc *sc = ifp->if_softc;
 
 	ifp->if_flags &= ~IFF_RUNNING;
+	if (sc->sc_viu)
+		VIFHYPER_STOP(sc->sc_viu);
 }
 
-void
-VIF_DELIVERPKT(struct virtif_sc *sc, struct iovec *iov, size_t iovlen)
+/*
+ * Apply the virtio-net header of a received frame.  Frames from the
+ * host's own stack may carry only a partial checksum: if the stack
+ * here has the matching rx offload on, mark the frame as verified,
+ * otherwise finish the checksum in software.  The backends do not
+ * accept coalesced frames, so there is nothing to resegment.
+ */
+static void
+virtif_rxoffload(struct ifnet *ifp, struct mbuf *m,
+	const struct vif_vnethdr *vh)
 {
-	struct ifnet *ifp = &sc->sc_ec.ec_if;
-	struct mbuf *m;
-	size_t i;
-	int off, olen;
+	uint16_t csum;
+	int off, proto, flag;
+	bool v6;
+
+	if ((vh->vh_flags & (VIF_VNET_F_NEEDS_CSUM|VIF_VNET_F_DATA_VALID)) == 0)
+		return;
+
+	flag = proto = 0;
+	if (virtif_l4hdr(m, &proto, &v6) != -1) {
+		if (proto == IPPROTO_TCP)
+			flag = v6 ? M_CSUM_TCPv6 : M_CSUM_TCPv4;
+		else if (proto == IPPROTO_UDP)
+			flag = v6 ? M_CSUM_UDPv6 : M_CSUM_UDPv4;
+	}
+	if (flag & ifp->if_csum_flags_rx) {
+		m->m_pkthdr.csum_flags |= flag;
+		return;
+	}
 
-	if ((ifp->if_flags & IFF_RUNNING) == 0)
+	if ((vh->vh_flags & VIF_VNET_F_NEEDS_CSUM) == 0)
+		return;
+	off = vh->vh_csum_start;
+	if (off + vh->vh_csum_offset + (int)sizeof(csum) > m->m_pkthdr.len)
 		return;
+	csum = cpu_in_cksum(m, m->m_pkthdr.len - off, off, 0);
+	if (csum == 0 && proto == IPPROTO_UDP)
+		csum = 0xffff;
+	m_copyback(m, off + vh->vh_csum_offset, sizeof(csum), &csum);
+}
+
+/* add up to n mbufs to the cache, false if an allocation failed */
+static bool
+virtif_mfill(struct virtif_mcache *mc, int cl, int n)
+{
+	struct mbuf *m;
+
+	n = MIN(n, VIF_MCACHESZ - mc->mc_n[cl]);
+	while (n-- > 0) {
+		if ((m = m_gethdr(M_NOWAIT, MT_DATA)) == NULL)
+			return false;
+		if (cl == VIF_MC_CLUSTER) {
+			MCLGET(m, M_NOWAIT);
+			if ((m->m_flags & M_EXT) == 0) {
+				m_free(m);
+				return false;
+			}
+		}
+		mc->mc_m[cl][mc->mc_n[cl]++] = m;
+	}
+	return true;
+}
+
+static void
+virtif_mdrain(void *p, void *arg, struct cpu_info *ci)
+{
+	struct virtif_mcache *mc = p;
+	int cl;
+
+	for (cl = 0; cl < 2; cl++) {
+		while (mc->mc_n[cl] > 0)
+			m_free(mc->mc_m[cl][--mc->mc_n[cl]]);
+	}
+}
 
-	m = m_gethdr(M_NOWAIT, MT_DATA);
-	if (m == NULL)
-		return; /* drop packet */
-	m->m_len = m->m_pkthdr.len = 0;
-
-	for (i = 0, off = 0; i < iovlen; i++) {
-		olen = m->m_pkthdr.len;
-		m_copyback(m, off, iov[i].iov_len, iov[i].iov_base);
-		off += iov[i].iov_len;
-		if (olen + off != m->m_pkthdr.len) {
-			aprint_verbose_ifnet(ifp, "m_copyback failed\n");
-			m_freem(m);
-			return;
+/*
+ * A packet header mbuf with room for len contiguous bytes: from the
+ * cache for frames which fit in a cluster, with external storage of
+ * the exact size for larger (GRO, jumbo) frames, which are rare.
+ * *lowp is set if mbufs are running out.
+ */
+static struct mbuf *
+virtif_mget(struct virtif_sc *sc, int len, bool *lowp)
+{
+	struct virtif_mcache *mc;
+	struct mbuf *m;
+	int cl;
+
+	if (len > MCLBYTES) {
+		*lowp = true;
+		if ((m = m_gethdr(M_NOWAIT, MT_DATA)) == NULL)
+			return NULL;
+		MEXTMALLOC(m, len, M_NOWAIT);
+		if ((m->m_flags & M_EXT) == 0) {
+			m_free(m);
+			return NULL;
 		}
+		*lowp = false;
+		return m;
 	}
 
+	cl = len > MHLEN ? VIF_MC_CLUSTER : VIF_MC_HDR;
+	mc = percpu_getref(sc->sc_mcache);
+	if (mc->mc_n[cl] == 0
+	    || (mc->mc_short[cl] && mc->mc_n[cl] < VIF_MC_STEP))
+		mc->mc_short[cl] = !virtif_mfill(mc, cl, VIF_MC_STEP);
+	m = mc->mc_n[cl] > 0 ? mc->mc_m[cl][--mc->mc_n[cl]] : NULL;
+	*lowp = mc->mc_short[cl] && mc->mc_n[cl] < VIF_MC_STEP;
+	percpu_putref(sc->sc_mcache);
+	return m;
+}
+
+/* hand a received frame to the protocols */
+static void
+virtif_input(struct ifnet *ifp, struct mbuf *m)
+{
+
+#ifdef VIF_MPSAFE
+	/* ether_input() runs from the input queue's softint */
+	m_set_rcvif(m, ifp);
+	atomic_inc_64(&ifp->if_ipackets);
+	atomic_add_64(&ifp->if_ibytes, m->m_pkthdr.len);
+	bpf_mtap(ifp, m);
+	if_percpuq_enqueue(ifp->if_percpuq, m);
+#else
 	m->m_pkthdr.rcvif = ifp;
 	KERNEL_LOCK(1, NULL);
+	ifp->if_ipackets++;
+	ifp->if_ibytes += m->m_pkthdr.len;
 	bpf_mtap(ifp, m);
 	ether_input(ifp, m);
-	KERNEL_UNLOCK_LAST(NULL);
+	KERNEL_UNLOCK_ONE(NULL);
+#endif
+}
+
+static u_int
+virtif_pipepending(struct virtif_pipeline *pl)
+{
+	u_int c, n;
+
+	for (c = 0, n = 0; c < pl->pl_npipe; c++)
+		n += pl->pl_pipe[c].pp_prod - pl->pl_pipe[c].pp_cons;
+	return n;
+}
+
+/* one pass over all the queues, returns the number of frames input */
+static u_int
+virtif_pipedrain(struct virtif_sc *sc, struct virtif_pipeline *pl)
+{
+	struct ifnet *ifp = &sc->sc_ec.ec_if;
+	struct virtif_pipe *pp;
+	u_int c, n, prod, cons;
+
+	for (c = 0, n = 0; c < pl->pl_npipe; c++) {
+		pp = &pl->pl_pipe[c];
+		cons = pp->pp_cons;
+		prod = pp->pp_prod;
+		if (prod == cons)
+			continue;
+		membar_consumer();	/* the slots after the index */
+		if (prod - cons > pp->pp_maxocc)
+			pp->pp_maxocc = prod - cons;
+		for (; cons != prod; cons++, n++)
+			virtif_input(ifp, pp->pp_m[cons % VIF_PIPESZ]);
+		membar_sync();		/* done with the slots, then free them */
+		pp->pp_cons = cons;
+	}
+	return n;
+}
+
+static void
+virtif_pipeworker(void *arg)
+{
+	struct virtif_pipeline *pl = arg;
+	struct virtif_sc *sc = pl->pl_sc;
+	u_int n;
+
+	for (;;) {
+#ifndef VIF_MPSAFE
+		/* once per pass instead of once per frame */
+		KERNEL_LOCK(1, NULL);
+#endif
+		n = virtif_pipedrain(sc, pl);
+#ifndef VIF_MPSAFE
+		KERNEL_UNLOCK_ONE(NULL);
+#endif
+		if (n > 0)
+			continue;
+
+		mutex_enter(&pl->pl_lock);
+		pl->pl_sleeping = true;
+		membar_sync();
+		while (!pl->pl_dying && virtif_pipepending(pl) == 0)
+			cv_wait(&pl->pl_cv, &pl->pl_lock);
+		pl->pl_sleeping = false;
+		pl->pl_wakeups++;
+		if (pl->pl_dying) {
+			mutex_exit(&pl->pl_lock);
+			break;
+		}
+		mutex_exit(&pl->pl_lock);
+	}
+	kthread_exit(0);
+}
+
+/* queue a frame for the input thread, false if the queue is filling up */
+static bool
+virtif_pipeput(struct virtif_sc *sc, struct virtif_pipeline *pl,
+	struct mbuf *m)
+{
+	struct ifnet *ifp = &sc->sc_ec.ec_if;
+	struct virtif_pipe *pp;
+	u_int prod, occ;
+
+	kpreempt_disable();
+	pp = &pl->pl_pipe[cpu_index(curcpu())];
+	prod = pp->pp_prod;
+	if ((occ = prod - pp->pp_cons) == VIF_PIPESZ) {
+		pp->pp_drops++;
+		kpreempt_enable();
+		atomic_inc_64(&sc->sc_drops[VIFSTAT_DROP_PIPE]);
+		atomic_inc_64(&ifp->if_iqdrops);
+		m_freem(m);
+		return false;
+	}
+	pp->pp_m[prod % VIF_PIPESZ] = m;
+	membar_producer();
+	pp->pp_prod = prod + 1;
+	pp->pp_enqueued++;
+	kpreempt_enable();
+
+	/* pairs with the barrier the thread has before it sleeps */
+	membar_sync();
+	if (pl->pl_sleeping) {
+		mutex_enter(&pl->pl_lock);
+		cv_signal(&pl->pl_cv);
+		mutex_exit(&pl->pl_lock);
+	}
+	return occ + 1 < VIF_PIPEHIWAT;
+}
+
+static void
+virtif_pipestart(struct virtif_sc *sc)
+{
+	struct ifnet *ifp = &sc->sc_ec.ec_if;
+	struct virtif_pipeline *pl;
+	int error;
+
+	pl = kmem_zalloc(sizeof(*pl), KM_SLEEP);
+	pl->pl_sc = sc;
+	mutex_init(&pl->pl_lock, MUTEX_DEFAULT, IPL_NONE);
+	cv_init(&pl->pl_cv, "vifpipe");
+	pl->pl_npipe = ncpu;
+	pl->pl_pipe = kmem_zalloc(ncpu * sizeof(*pl->pl_pipe), KM_SLEEP);
+
+	error = kthread_create(PRI_NONE, KTHREAD_MPSAFE | KTHREAD_MUSTJOIN,
+	    NULL, virtif_pipeworker, pl, &pl->pl_lwp, "%s-input",
+	    ifp->if_xname);
+	if (error) {
+		aprint_error_ifnet(ifp, "cannot start the input thread: %d\n",
+		    error);
+		kmem_free(pl->pl_pipe, pl->pl_npipe * sizeof(*pl->pl_pipe));
+		cv_destroy(&pl->pl_cv);
+		mutex_destroy(&pl->pl_lock);
+		kmem_free(pl, sizeof(*pl));
+		return;
+	}
+	/* receivers see the pipeline only once its thread exists */
+	membar_producer();
+	sc->sc_pipeline = pl;
+	aprint_normal_ifnet(ifp, "input pipeline started\n");
+}
+
+/* the receivers are gone */
+static void
+virtif_pipestop(struct virtif_sc *sc)
+{
+	struct virtif_pipeline *pl = sc->sc_pipeline;
+	struct virtif_pipe *pp;
+	u_int c;
+
+	mutex_enter(&pl->pl_lock);
+	pl->pl_dying = true;
+	cv_signal(&pl->pl_cv);
+	mutex_exit(&pl->pl_lock);
+	kthread_join(pl->pl_lwp);
+
+	for (c = 0; c < pl->pl_npipe; c++) {
+		pp = &pl->pl_pipe[c];
+		for (; pp->pp_cons != pp->pp_prod; pp->pp_cons++)
+			m_freem(pp->pp_m[pp->pp_cons % VIF_PIPESZ]);
+	}
+	sc->sc_pipeline = NULL;
+	kmem_free(pl->pl_pipe, pl->pl_npipe * sizeof(*pl->pl_pipe));
+	cv_destroy(&pl->pl_cv);
+	mutex_destroy(&pl->pl_lock);
+	kmem_free(pl, sizeof(*pl));
+}
+
+/*
+ * Returns VIF_RXOVERLOAD if the stack is falling behind, i.e. the
+ * input pipeline is filling up or mbufs are running out.  The frame
+ * itself has been taken care of either way.  How full the protocol
+ * input queues (or the per-cpu input queue) are cannot be seen from
+ * here, so without the pipeline only a shortage of mbufs counts.
+ */
+int
+VIF_DELIVERPKT(struct virtif_sc *sc, struct iovec *iov, size_t iovlen)
+{
+	struct virtif_pipeline *pl;
+	struct ifnet *ifp = &sc->sc_ec.ec_if;
+	struct vif_vnethdr vh;
+	struct mbuf *m;
+	uint8_t *p;
+	size_t i;
+	int len;
+	bool low;
+	VIFCYC_DECL(t);
+
+	VIFCYC_STAMP(t);
+	if ((ifp->if_flags & IFF_RUNNING) == 0) {
+		atomic_inc_64(&sc->sc_drops[VIFSTAT_DROP_DOWN]);
+		return 0;
+	}
+
+	if (sc->sc_vflags & VIFFLAG_VNETHDR) {
+		KASSERT(iovlen > 1 && iov[0].iov_len == sizeof(vh));
+		memcpy(&vh, iov[0].iov_base, sizeof(vh));
+		iov++;
+		iovlen--;
+	}
+
+	for (i = 0, len = 0; i < iovlen; i++)
+		len += iov[i].iov_len;
+	m = virtif_mget(sc, len, &low);
+	if (m == NULL) {
+		atomic_inc_64(&sc->sc_drops[VIFSTAT_DROP_NOMBUF]);
+		atomic_inc_64(&ifp->if_iqdrops);
+		return VIF_RXOVERLOAD; /* drop packet */
+	}
+	m->m_len = m->m_pkthdr.len = len;
+
+	for (i = 0, p = mtod(m, uint8_t *); i < iovlen; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
+	if (sc->sc_vflags & VIFFLAG_VNETHDR)
+		virtif_rxoffload(ifp, m, &vh);
+	VIFCYC_LAP(sc->sc_cyc, VIFCYC_MBUF, t);
+	if ((pl = sc->sc_pipeline) != NULL) {
+		if (!virtif_pipeput(sc, pl, m))
+			low = true;
+	} else {
+		virtif_input(ifp, m);
+	}
+	VIFCYC_LAP(sc->sc_cyc, VIFCYC_INPUT, t);
+	return low ? VIF_RXOVERLOAD : 0;
 }
@@ -19,12 +19,131 @@
 #define VIF_NAME VIF_STRINGIFY(VIRTIF_BASE)
 
 #define VIFHYPER_CREATE VIF_BASENAME3(rumpcomp_,VIRTIF_BASE,_create)
+#define VIFHYPER_START VIF_BASENAME3(rumpcomp_,VIRTIF_BASE,_start)
+#define VIFHYPER_STOP VIF_BASENAME3(rumpcomp_,VIRTIF_BASE,_stop)
 #define VIFHYPER_DYING VIF_BASENAME3(rumpcomp_,VIRTIF_BASE,_dying)
 #define VIFHYPER_DESTROY VIF_BASENAME3(rumpcomp_,VIRTIF_BASE,_destroy)
+#define VIFHYPER_INFO VIF_BASENAME3(rumpcomp_,VIRTIF_BASE,_info)
+#define VIFHYPER_STATS VIF_BASENAME3(rumpcomp_,VIRTIF_BASE,_stats)
+#define VIFHYPER_CYCLES VIF_BASENAME3(rumpcomp_,VIRTIF_BASE,_cycles)
 #define VIFHYPER_SEND VIF_BASENAME3(rumpcomp_,VIRTIF_BASE,_send)
+#define VIFHYPER_TXRINGS VIF_BASENAME3(rumpcomp_,VIRTIF_BASE,_txrings)
+#define VIFHYPER_COALESCE VIF_BASENAME3(rumpcomp_,VIRTIF_BASE,_coalesce)
 
 #define VIFHYPER_FLAGS VIF_BASENAME3(rumpcomp_,VIRTIF_BASE,_flags)
 
 #define VIF_DELIVERPKT VIF_BASENAME3(rump_virtif_,VIRTIF_BASE,_deliverpkt)
 
 struct virtif_sc;
+
+/*
+ * VIF_DELIVERPKT() returns this when the stack cannot keep up.  A
+ * receiver should then stop delivering for a while and drop frames
+ * in its ring, before spending any copying or scheduling on them.
+ */
+#define VIF_RXOVERLOAD	1
+
+/*
+ * Backend properties, returned by VIFHYPER_FLAGS() once the backend
+ * has been created.
+ */
+#define VIFFLAG_VNETHDR		0x01	/* frames carry a struct vif_vnethdr */
+#define VIFFLAG_TSO		0x02	/* ... and the host takes TSO frames */
+
+/*
+ * Offload header, laid out like the virtio-net header (struct
+ * virtio_net_hdr, host byte order).  With VIFFLAG_VNETHDR the first
+ * iovec of every frame passed to VIFHYPER_SEND() and VIF_DELIVERPKT()
+ * is exactly this header.
+ */
+struct vif_vnethdr {
+	uint8_t vh_flags;
+	uint8_t vh_gso_type;
+	uint16_t vh_hdr_len;		/* ether+ip+tcp header length */
+	uint16_t vh_gso_size;		/* payload bytes per segment */
+	uint16_t vh_csum_start;		/* checksum from here to the end */
+	uint16_t vh_csum_offset;	/* ... stored here past csum_start */
+};
+
+#define VIF_VNET_F_NEEDS_CSUM	0x01	/* checksum is partial */
+#define VIF_VNET_F_DATA_VALID	0x02	/* checksum already verified */
+
+#define VIF_VNET_GSO_NONE	0
+#define VIF_VNET_GSO_TCPV4	1
+#define VIF_VNET_GSO_UDP	3
+#define VIF_VNET_GSO_TCPV6	4
+#define VIF_VNET_GSO_ECN	0x80
+
+/*
+ * Interface statistics.  Fetched with SIOCGDRVSPEC: VIRTIF_GSTATS
+ * returns one struct virtif_stats for the whole interface and
+ * VIRTIF_GRINGSTATS an array with one entry per ring.  The array
+ * commands copy out as many whole entries as fit and set ifd_len to
+ * the size of all of them, so a short or empty buffer asks for the
+ * size.
+ */
+#define VIRTIF_GSTATS		1
+#define VIRTIF_GRINGSTATS	2
+#define VIRTIF_GCYCLES		3	/* see virtif_cycles.h */
+#define VIRTIF_GPIPESTATS	4	/* struct virtif_pipestats */
+#define VIRTIF_GTXMAP		5	/* uint32_t tx ring of each cpu */
+#define VIRTIF_GCOALESCE	6	/* struct virtif_coalesce */
+
+#define VIFSTAT_DROP_NOMBUF	0	/* rx: mbuf allocation failed */
+#define VIFSTAT_DROP_COPY	1	/* rx: copy into mbuf chain failed */
+#define VIFSTAT_DROP_DOWN	2	/* rx: interface not running */
+#define VIFSTAT_DROP_TXFULL	3	/* tx: no ring space */
+#define VIFSTAT_DROP_PIPE	4	/* rx: input pipeline full */
+#define VIFSTAT_DROP_SHED	5	/* rx: left in the ring, stack overloaded */
+#define VIFSTAT_DROP_OVERSIZE	6	/* rx: host-coalesced, larger than a frame */
+#define VIFSTAT_NDROP		7
+
+#define VIFSTAT_NBATCH		8	/* 1, 2-3, 4-7, ..., 128+ */
+
+struct virtif_stats {
+	uint64_t vs_ipackets;
+	uint64_t vs_ibytes;
+	uint64_t vs_opackets;
+	uint64_t vs_obytes;
+	uint64_t vs_otruncated;		/* sent, but cut to fit the slot */
+	uint64_t vs_drops[VIFSTAT_NDROP];
+
+	/* receiver behaviour, only in the interface-wide stats */
+	uint64_t vs_wakeups;
+	uint64_t vs_emptypolls;
+	uint64_t vs_batch[VIFSTAT_NBATCH];	/* packets per wakeup */
+};
+
+/*
+ * The input pipeline (IFF_LINK0), ENOENT if it is not in use.
+ * Occupancy counts the frames queued for the input thread.
+ */
+struct virtif_pipestats {
+	uint64_t ps_enqueued;
+	uint64_t ps_drops;		/* also in VIFSTAT_DROP_PIPE */
+	uint64_t ps_wakeups;		/* of the input thread */
+	uint32_t ps_occupancy;		/* now */
+	uint32_t ps_maxoccupancy;	/* highest seen by the thread */
+};
+
+/*
+ * Receive coalescing, set with SIOCSDRVSPEC: VIRTIF_SCOALESCE and
+ * read back with SIOCGDRVSPEC: VIRTIF_GCOALESCE.  Once frames are
+ * ready, the receiver holds them back for up to vc_usecs until
+ * vc_frames are ready, then delivers them as one batch.  Zero in
+ * either field delivers at once.  With vc_adaptive the wait follows
+ * the arrival rate: none while the link is quiet, and the time
+ * vc_frames take to arrive, at most vc_usecs, while it is busy.
+ * EOPNOTSUPP from backends whose receivers cannot hold back frames.
+ */
+#define VIRTIF_SCOALESCE	1
+
+#define VIFCOAL_MAXFRAMES	1024
+#define VIFCOAL_MAXUSECS	10000
+
+struct virtif_coalesce {
+	uint32_t vc_frames;
+	uint32_t vc_usecs;
+	uint32_t vc_adaptive;
+	uint32_t vc_curusecs;		/* get only: the wait for a whole batch */
+};
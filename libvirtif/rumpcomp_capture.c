@@ -0,0 +1,413 @@
+/*
+ * Copyright (c) 2026 The drv-netif-netmap contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Packet capture in the hypercall layer, instead of bpf in the rump
+ * kernel.  The receivers and senders copy the first snaplen bytes of
+ * a frame into a bounded lock-free ring, without system calls or
+ * locks, and a writer thread streams the ring into a pcapng file
+ * through a sliding memory-mapped window.  If the writer falls
+ * behind, frames are dropped from the capture, never from the
+ * packet path.  Hypercall side only.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE	/* posix_fallocate() */
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "if_virt.h"
+#include "virtif_cycles.h"
+#include "rumpcomp_vif.h"
+
+#define CAP_RINGMEM	(8*1024*1024)	/* ring size, whatever the snaplen */
+#define CAP_MINENTS	64
+#define CAP_WINDOW	(16*1024*1024)	/* file mapped this much at a time */
+#define CAP_IDLENS	1000000		/* writer polls this often when idle */
+
+/*
+ * Ring entry.  The ring is a bounded MPSC queue: ce_seq says whether
+ * the entry is free for position pos (== pos) or filled (== pos+1),
+ * so producers claim a position with one CAS and never wait.
+ */
+struct capent {
+	uint64_t ce_seq;
+	uint64_t ce_ts;		/* ns since the epoch */
+	uint32_t ce_len;	/* length on the wire */
+	uint32_t ce_caplen;
+	uint32_t ce_out;
+	uint32_t ce_pad;
+	uint8_t ce_data[];
+};
+
+struct vif_capture {
+	/* producers */
+	uint64_t vc_enq __attribute__((__aligned__(64)));
+	uint64_t vc_nsample;
+	uint64_t vc_drops;
+
+	/* the writer */
+	uint64_t vc_deq __attribute__((__aligned__(64)));
+	int vc_stop;
+	int vc_fd;
+	uint8_t *vc_win;	/* mapped window of the file */
+	off_t vc_winoff;	/* its offset in the file */
+	size_t vc_pos;		/* write position in the window */
+	int vc_failed;
+	uint64_t vc_written;
+
+	uint8_t *vc_ents;
+	size_t vc_entsz;
+	uint64_t vc_mask;
+	unsigned int vc_snaplen;
+	unsigned int vc_sample;
+	pthread_t vc_pt;
+	char vc_path[256];
+	char vc_ifname[64];
+};
+
+#define CAPENT(vc, pos) ((struct capent *)				\
+    ((vc)->vc_ents + ((pos) & (vc)->vc_mask) * (vc)->vc_entsz))
+
+void
+vif_capspec_init(struct vif_capspec *vcs)
+{
+
+	memset(vcs, 0, sizeof(*vcs));
+	vcs->vcs_snaplen = 256;
+	vcs->vcs_sample = 1;
+}
+
+/* "capture=path", "snaplen=N", "sample=N"; EINVAL for anything else */
+int
+vif_capspec_opt(struct vif_capspec *vcs, const char *opt, const char *val)
+{
+	unsigned long v;
+	char *ep;
+
+	if (val == NULL)
+		return EINVAL;
+
+	if (strcmp(opt, "capture") == 0) {
+		if (strlen(val) >= sizeof(vcs->vcs_path))
+			return ENAMETOOLONG;
+		strcpy(vcs->vcs_path, val);
+		return 0;
+	}
+
+	v = strtoul(val, &ep, 10);
+	if (*ep != '\0')
+		return EINVAL;
+	if (strcmp(opt, "snaplen") == 0 && v >= 14 && v <= 65535) {
+		vcs->vcs_snaplen = v;
+	} else if (strcmp(opt, "sample") == 0 && v >= 1) {
+		vcs->vcs_sample = v;
+	} else {
+		return EINVAL;
+	}
+	return 0;
+}
+
+/* move the window on, reserving the disk space so writes cannot fault */
+static int
+nextwindow(struct vif_capture *vc)
+{
+	int rv;
+
+	if (vc->vc_win != NULL) {
+		munmap(vc->vc_win, CAP_WINDOW);
+		vc->vc_winoff += CAP_WINDOW;
+	}
+	vc->vc_win = NULL;
+	vc->vc_pos = 0;
+
+	if ((rv = posix_fallocate(vc->vc_fd, vc->vc_winoff, CAP_WINDOW)) != 0)
+		return rv;
+	vc->vc_win = mmap(NULL, CAP_WINDOW, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, vc->vc_fd, vc->vc_winoff);
+	if (vc->vc_win == MAP_FAILED) {
+		vc->vc_win = NULL;
+		return errno;
+	}
+	return 0;
+}
+
+static void
+capwrite(struct vif_capture *vc, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t n;
+	int rv;
+
+	while (len > 0 && !vc->vc_failed) {
+		if (vc->vc_win == NULL || vc->vc_pos == CAP_WINDOW) {
+			if ((rv = nextwindow(vc)) != 0) {
+				fprintf(stderr, "%s: capture to %s stopped: "
+				    "%s\n", vc->vc_ifname, vc->vc_path,
+				    strerror(rv));
+				vc->vc_failed = 1;
+				return;
+			}
+		}
+		n = CAP_WINDOW - vc->vc_pos;
+		if (n > len)
+			n = len;
+		memcpy(vc->vc_win + vc->vc_pos, p, n);
+		vc->vc_pos += n;
+		p += n;
+		len -= n;
+	}
+}
+
+static void
+capwrite32(struct vif_capture *vc, uint32_t v)
+{
+
+	capwrite(vc, &v, sizeof(v));
+}
+
+/* section header and one interface, with nanosecond timestamps */
+static void
+writeheader(struct vif_capture *vc)
+{
+	static const uint8_t zero[4];
+	size_t namelen = strlen(vc->vc_ifname);
+	size_t namepad = (4 - (namelen & 3)) & 3;
+	uint32_t idblen;
+	int64_t seclen = -1;
+
+	capwrite32(vc, 0x0a0d0d0a);
+	capwrite32(vc, 28);
+	capwrite32(vc, 0x1a2b3c4d);
+	capwrite32(vc, 1 | 0 << 16);		/* version 1.0 */
+	capwrite(vc, &seclen, sizeof(seclen));
+	capwrite32(vc, 28);
+
+	idblen = 20 + 4 + namelen + namepad + 8 + 4;
+	capwrite32(vc, 1);
+	capwrite32(vc, idblen);
+	capwrite32(vc, 1);			/* LINKTYPE_ETHERNET */
+	capwrite32(vc, vc->vc_snaplen);
+	capwrite32(vc, 2 | namelen << 16);	/* if_name */
+	capwrite(vc, vc->vc_ifname, namelen);
+	capwrite(vc, zero, namepad);
+	capwrite32(vc, 9 | 1 << 16);		/* if_tsresol: 10^-9 */
+	capwrite32(vc, 9);
+	capwrite32(vc, 0);			/* opt_endofopt */
+	capwrite32(vc, idblen);
+}
+
+/* enhanced packet block, with the direction in epb_flags */
+static void
+writeframe(struct vif_capture *vc, const struct capent *ce)
+{
+	static const uint8_t zero[4];
+	size_t pad = (4 - (ce->ce_caplen & 3)) & 3;
+	uint32_t blen;
+
+	blen = 28 + ce->ce_caplen + pad + 8 + 4 + 4;
+	capwrite32(vc, 6);
+	capwrite32(vc, blen);
+	capwrite32(vc, 0);
+	capwrite32(vc, ce->ce_ts >> 32);
+	capwrite32(vc, ce->ce_ts & 0xffffffff);
+	capwrite32(vc, ce->ce_caplen);
+	capwrite32(vc, ce->ce_len);
+	capwrite(vc, ce->ce_data, ce->ce_caplen);
+	capwrite(vc, zero, pad);
+	capwrite32(vc, 2 | 4 << 16);		/* epb_flags */
+	capwrite32(vc, ce->ce_out ? 2 : 1);
+	capwrite32(vc, 0);
+	capwrite32(vc, blen);
+	vc->vc_written++;
+}
+
+static void *
+writer(void *arg)
+{
+	struct vif_capture *vc = arg;
+	struct timespec idle = { 0, CAP_IDLENS };
+	struct capent *ce;
+
+	writeheader(vc);
+	for (;;) {
+		ce = CAPENT(vc, vc->vc_deq);
+		if (__atomic_load_n(&ce->ce_seq, __ATOMIC_ACQUIRE)
+		    != vc->vc_deq + 1) {
+			/* producers are gone before we are told to stop */
+			if (__atomic_load_n(&vc->vc_stop, __ATOMIC_ACQUIRE))
+				break;
+			nanosleep(&idle, NULL);
+			continue;
+		}
+		writeframe(vc, ce);
+		__atomic_store_n(&ce->ce_seq, vc->vc_deq + vc->vc_mask + 1,
+		    __ATOMIC_RELEASE);
+		vc->vc_deq++;
+	}
+	return NULL;
+}
+
+/* *vcp is left NULL if no capture was asked for */
+int
+vif_capture_open(struct vif_capture **vcp, const struct vif_capspec *vcs,
+	const char *ifname)
+{
+	struct vif_capture *vc;
+	uint64_t i, nents;
+	int rv;
+
+	*vcp = NULL;
+	if (vcs->vcs_path[0] == '\0')
+		return 0;
+
+	if ((rv = posix_memalign((void **)&vc, 64, sizeof(*vc))) != 0)
+		return rv;
+	memset(vc, 0, sizeof(*vc));
+	vc->vc_snaplen = vcs->vcs_snaplen;
+	vc->vc_sample = vcs->vcs_sample;
+	strcpy(vc->vc_path, vcs->vcs_path);
+	strncpy(vc->vc_ifname, ifname, sizeof(vc->vc_ifname)-1);
+
+	vc->vc_entsz = (sizeof(struct capent) + vc->vc_snaplen + 63) & ~63;
+	for (nents = CAP_MINENTS; 2*nents*vc->vc_entsz <= CAP_RINGMEM;)
+		nents *= 2;
+	vc->vc_mask = nents - 1;
+	if ((vc->vc_ents = malloc(nents * vc->vc_entsz)) == NULL) {
+		rv = errno;
+		goto fail;
+	}
+	for (i = 0; i < nents; i++)
+		CAPENT(vc, i)->ce_seq = i;
+
+	vc->vc_fd = open(vc->vc_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (vc->vc_fd == -1) {
+		rv = errno;
+		fprintf(stderr, "%s: cannot capture to %s: %s\n",
+		    ifname, vc->vc_path, strerror(rv));
+		goto fail;
+	}
+	if ((rv = pthread_create(&vc->vc_pt, NULL, writer, vc)) != 0) {
+		close(vc->vc_fd);
+		goto fail;
+	}
+
+	*vcp = vc;
+	return 0;
+
+ fail:
+	free(vc->vc_ents);
+	free(vc);
+	return rv;
+}
+
+/* all receivers and senders must be done with the capture */
+void
+vif_capture_close(struct vif_capture *vc)
+{
+	off_t len;
+
+	__atomic_store_n(&vc->vc_stop, 1, __ATOMIC_RELEASE);
+	pthread_join(vc->vc_pt, NULL);
+
+	len = vc->vc_winoff + vc->vc_pos;
+	if (vc->vc_win != NULL)
+		munmap(vc->vc_win, CAP_WINDOW);
+	if (ftruncate(vc->vc_fd, len) == -1)
+		fprintf(stderr, "%s: cannot truncate %s: %s\n",
+		    vc->vc_ifname, vc->vc_path, strerror(errno));
+	close(vc->vc_fd);
+
+	fprintf(stderr, "%s: captured %" PRIu64 " frames to %s, %" PRIu64
+	    " dropped\n", vc->vc_ifname, vc->vc_written, vc->vc_path,
+	    vc->vc_drops);
+	free(vc->vc_ents);
+	free(vc);
+}
+
+/*
+ * Called by receivers and senders for every frame (out is 0 for
+ * received frames).  Takes every vc_sample'th frame, and drops it
+ * from the capture if the ring is full.
+ */
+void
+vif_capture_frame(struct vif_capture *vc, const struct iovec *iov,
+	size_t iovcnt, int out)
+{
+	struct capent *ce;
+	struct timespec ts;
+	uint64_t pos, seq;
+	size_t i, n, len, caplen;
+
+	if (vc->vc_sample > 1 && __atomic_fetch_add(&vc->vc_nsample, 1,
+	    __ATOMIC_RELAXED) % vc->vc_sample != 0)
+		return;
+
+	pos = __atomic_load_n(&vc->vc_enq, __ATOMIC_RELAXED);
+	for (;;) {
+		ce = CAPENT(vc, pos);
+		seq = __atomic_load_n(&ce->ce_seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&vc->vc_enq, &pos,
+			    pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((int64_t)(seq - pos) < 0) {
+			__atomic_fetch_add(&vc->vc_drops, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&vc->vc_enq, __ATOMIC_RELAXED);
+		}
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ce->ce_ts = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	for (i = 0, len = caplen = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+		if (caplen < vc->vc_snaplen) {
+			n = vc->vc_snaplen - caplen;
+			if (n > iov[i].iov_len)
+				n = iov[i].iov_len;
+			memcpy(ce->ce_data + caplen, iov[i].iov_base, n);
+			caplen += n;
+		}
+	}
+	ce->ce_len = len;
+	ce->ce_caplen = caplen;
+	ce->ce_out = out;
+	__atomic_store_n(&ce->ce_seq, pos+1, __ATOMIC_RELEASE);
+}
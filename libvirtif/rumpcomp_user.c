@@ -25,43 +25,152 @@
  * SUCH DAMAGE.
  */
 
+
 #ifndef _KERNEL
+#ifdef __linux__
+#define _GNU_SOURCE	/* pthread_attr_setaffinity_np() */
+#endif
+
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/uio.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#ifdef __linux__
 #include <net/if.h>
+#ifdef __linux__
 #include <linux/if_tun.h>
 #endif
 
 #include <rump/rumpuser_component.h>
 
 #include "if_virt.h"
+#include "virtif_cycles.h"
 #include "rumpcomp_user.h"
+#include "rumpcomp_vif.h"
+
+/*
+ * Frames drained from the tap device per wakeup, and the size of
+ * each receive buffer.
+ */
+#define VIF_TAP_NBUF	32
+#define VIF_TAP_BUFSZ	2048
+
+
+/* upper limit for "queues=" */
+#define VIF_TAP_MAXQ	16
+
+/*
+ * One queue of the tap device.  With IFF_MULTI_QUEUE every queue has
+ * its own file descriptor and the host kernel spreads incoming flows
+ * over them, so each queue gets a receiver thread of its own.
+ */
+struct tapq {
+	struct virtif_user *tq_viu;
+	int tq_fd;
+	int tq_idx;
+	pthread_t tq_pt;
+	int tq_ptvalid;
+
+	/*
+	 * Receive buffers, reused for every batch.  With vnethdr each
+	 * frame is passed up as two iovecs, header and frame.
+	 */
+	uint8_t *tq_rxbuf;
+	size_t tq_bufsz;
+	struct iovec tq_rxiov[2*VIF_TAP_NBUF];
+
+	/* written only by the receiver and by senders under the tx lock */
+	struct virtif_stats tq_rxstats;
+	struct virtif_stats tq_txstats;
+};
 
 struct virtif_user {
-	int viu_fd;
-	int viu_dying;
+	struct vif_runctl viu_runctl;	/* shared by all receivers */
+
+	struct virtif_sc *viu_virtifsc;
+	char viu_ifname[IFNAMSIZ];
+	char viu_placement[48];	/* where the receivers run, for humans */
+
+	int viu_nqueues;
+	struct tapq *viu_q;
+
+	int viu_vnethdr;	/* frames carry a struct vif_vnethdr */
+
+	struct vif_capture *viu_cap;	/* NULL if not capturing */
 };
 
+/* "devname[,option[=value]]...", devname may also be a bare unit */
+struct tapif_params {
+	char tp_ifname[IFNAMSIZ];
+	struct vif_cpuspec tp_cpu;
+	int tp_queues;
+	int tp_vnethdr;
+	struct vif_capspec tp_cap;
+};
+
+static int
+tapopt(void *arg, const char *opt, const char *val)
+{
+	struct tapif_params *tp = arg;
+	char *ep;
+
+	if (strcmp(opt, "cpu") == 0)
+		return vif_cpuspec_parse(val, &tp->tp_cpu);
+	if (strcmp(opt, "queues") == 0) {
+		if (val == NULL)
+			return EINVAL;
+		tp->tp_queues = (int)strtol(val, &ep, 10);
+		if (*ep != '\0' || tp->tp_queues < 1
+		    || tp->tp_queues > VIF_TAP_MAXQ)
+			return EINVAL;
+#ifndef __linux__
+		if (tp->tp_queues > 1)
+			return EOPNOTSUPP;
+#endif
+		return 0;
+	}
+	if (strcmp(opt, "vnethdr") == 0 && val == NULL) {
+#ifdef __linux__
+		tp->tp_vnethdr = 1;
+		return 0;
+#else
+		return EOPNOTSUPP;
+#endif
+	}
+	return vif_capspec_opt(&tp->tp_cap, opt, val);
+}
+
+/*
+ * Open one queue of the tap device.  On Linux a multi-queue device is
+ * attached to by opening /dev/net/tun once per queue with the same
+ * name and IFF_MULTI_QUEUE.  The flag is set only when more than one
+ * queue is asked for, since a persistent single-queue tap cannot be
+ * attached to with it.
+ *
+ * With vnethdr every frame is preceded by a virtio-net header, and
+ * TUNSETOFFLOAD tells the host that we take partially checksummed
+ * and TSO frames, so host-local traffic is neither segmented nor
+ * checksummed on its way in.
+ */
 static int
-opentapdev(int devnum)
+opentapdev(const char *name, int multi, int vnethdr)
 {
 	int fd = -1;
+	int unit = name[strspn(name, "0123456789")] == '\0';
 
 #if defined(__NetBSD__) || defined(__DragonFly__)
 	char tapdev[64];
 
-	snprintf(tapdev, sizeof(tapdev), "/dev/tap%d", devnum);
+	snprintf(tapdev, sizeof(tapdev), "/dev/%s%s", unit ? "tap" : "", name);
 	fd = open(tapdev, O_RDWR);
 	if (fd == -1) {
 		fprintf(stderr, "rumpcomp_virtif_create: can't open %s: "
@@ -70,7 +179,7 @@ opentapdev(int devnum)
 
 #elif defined(__linux__)
 	struct ifreq ifr;
-	char devname[16];
+	char devname[IFNAMSIZ];
 
 	fd = open("/dev/net/tun", O_RDWR);
 	if (fd == -1) {
@@ -79,46 +188,277 @@ opentapdev(int devnum)
 		return -1;
 	}
 
-	snprintf(devname, sizeof(devname), "tun%d", devnum);
+	snprintf(devname, sizeof(devname), "%s%s", unit ? "tun" : "", name);
 	memset(&ifr, 0, sizeof(ifr));
 	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	if (multi)
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
+	if (vnethdr)
+		ifr.ifr_flags |= IFF_VNET_HDR;
 	strncpy(ifr.ifr_name, devname, sizeof(ifr.ifr_name)-1);
 
 	if (ioctl(fd, TUNSETIFF, &ifr) == -1) {
+		fprintf(stderr, "rumpcomp_virtif_create: %s: TUNSETIFF "
+		    "failed: %s\n", devname, strerror(errno));
 		close(fd);
-		fd = -1;
+		return -1;
+	}
+
+	if (vnethdr) {
+		int hdrsz = sizeof(struct vif_vnethdr);
+
+		/*
+		 * Partial checksums only: with TSO the host would pass
+		 * up GRO-coalesced frames, which ether_input() drops as
+		 * oversized.  Sending TSO frames needs no offer.
+		 */
+		if (ioctl(fd, TUNSETVNETHDRSZ, &hdrsz) == -1
+		    || ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM) == -1) {
+			fprintf(stderr, "rumpcomp_virtif_create: %s: cannot "
+			    "set up vnet header: %s\n", devname,
+			    strerror(errno));
+			close(fd);
+			return -1;
+		}
 	}
 
 #else
 	fprintf(stderr, "virtif not supported on this platform\n");
 #endif
 
+	if (fd != -1 && vif_setnonblock(fd) != 0) {
+		close(fd);
+		fd = -1;
+	}
+
 	return fd;
 }
 
+/*
+ * Drain up to VIF_TAP_NBUF frames per wakeup with non-blocking reads
+ * and deliver them within a single scheduled section.
+ */
+static void *
+receiver(void *arg)
+{
+	struct tapq *tq = arg;
+	struct virtif_user *viu = tq->tq_viu;
+	struct virtif_stats *vs = &tq->tq_rxstats;
+	struct pollfd pfd[2];
+	size_t hdrsz;
+	ssize_t nn;
+	unsigned int i, npkt, niov;
+	int prv;
+
+	hdrsz = viu->viu_vnethdr ? sizeof(struct vif_vnethdr) : 0;
+	niov = viu->viu_vnethdr ? 2 : 1;
+
+	rumpuser_component_kthread();
+
+	for (;;) {
+		if (vif_runctl_wait(&viu->viu_runctl))
+			break;
+
+		pfd[0].fd = tq->tq_fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = vif_runctl_fd(&viu->viu_runctl);
+		pfd[1].events = POLLIN;
+
+		prv = poll(pfd, 2, -1);
+		if (prv < 0) {
+			if (errno != EINTR && errno != EAGAIN) {
+				fprintf(stderr, "virtif: poll failed: %s\n",
+				    strerror(errno));
+			}
+			continue;
+		}
+		if (pfd[1].revents & POLLIN)
+			continue;
+
+		for (npkt = 0; npkt < VIF_TAP_NBUF; ) {
+			nn = read(tq->tq_fd,
+			    tq->tq_rxbuf + npkt*tq->tq_bufsz, tq->tq_bufsz);
+			if (nn <= 0) {
+				if (nn == -1 && errno != EAGAIN
+				    && errno != EINTR) {
+					fprintf(stderr, "virtif: read failed: "
+					    "%s\n", strerror(errno));
+				}
+				break;
+			}
+			if ((size_t)nn <= hdrsz)
+				continue;
+			tq->tq_rxiov[npkt*niov + niov-1].iov_len = nn - hdrsz;
+			VIF_CAPTURE(viu->viu_cap,
+			    &tq->tq_rxiov[npkt*niov + niov-1], 1, 0);
+			vs->vs_ipackets++;
+			vs->vs_ibytes += nn - hdrsz;
+			npkt++;
+		}
+
+		if (npkt > 0) {
+			rumpuser_component_schedule(NULL);
+			for (i = 0; i < npkt; i++) {
+				VIF_DELIVERPKT(viu->viu_virtifsc,
+				    &tq->tq_rxiov[i*niov], niov);
+			}
+			rumpuser_component_unschedule();
+		}
+		vif_stats_batch(vs, npkt);
+	}
+
+	rumpuser_component_kthread_release();
+	return NULL;
+}
+
+/* undo createq(), also for a partially constructed queue */
+static void
+destroyq(struct tapq *tq)
+{
+
+	if (tq->tq_ptvalid)
+		pthread_join(tq->tq_pt, NULL);
+	if (tq->tq_fd != -1)
+		close(tq->tq_fd);
+	free(tq->tq_rxbuf);
+}
+
+static int
+createq(struct virtif_user *viu, struct tapq *tq, int idx,
+	const struct tapif_params *tp)
+{
+	pthread_attr_t attr;
+	char place[sizeof(viu->viu_placement)];
+	int i, rv;
+
+	tq->tq_viu = viu;
+	tq->tq_idx = idx;
+	tq->tq_fd = -1;
+
+	tq->tq_bufsz = VIF_TAP_BUFSZ;
+	if (tp->tp_vnethdr)
+		tq->tq_bufsz += sizeof(struct vif_vnethdr);
+	tq->tq_rxbuf = malloc(VIF_TAP_NBUF * tq->tq_bufsz);
+	if (tq->tq_rxbuf == NULL)
+		return errno;
+	for (i = 0; i < VIF_TAP_NBUF; i++) {
+		uint8_t *buf = tq->tq_rxbuf + i*tq->tq_bufsz;
+
+		if (tp->tp_vnethdr) {
+			tq->tq_rxiov[2*i].iov_base = buf;
+			tq->tq_rxiov[2*i].iov_len = sizeof(struct vif_vnethdr);
+			tq->tq_rxiov[2*i+1].iov_base =
+			    buf + sizeof(struct vif_vnethdr);
+		} else {
+			tq->tq_rxiov[i].iov_base = buf;
+		}
+	}
+
+	tq->tq_fd = opentapdev(tp->tp_ifname, tp->tp_queues > 1,
+	    tp->tp_vnethdr);
+	if (tq->tq_fd == -1)
+		return errno ? errno : ENXIO;
+
+	/*
+	 * With several queues an explicit cpu range is spread over the
+	 * receivers, one cpu each; otherwise they share the placement.
+	 */
+	pthread_attr_init(&attr);
+	if (vif_placethread(tp->tp_ifname, &tp->tp_cpu,
+	    tp->tp_queues > 1 ? idx : -1, &attr, place, sizeof(place)) != 0) {
+		snprintf(place, sizeof(place), "rx unpinned");
+		pthread_attr_destroy(&attr);
+		pthread_attr_init(&attr);
+	}
+	if (idx == 0) {
+		if (tp->tp_queues > 1 && tp->tp_cpu.vc_first >= 0) {
+			snprintf(viu->viu_placement,
+			    sizeof(viu->viu_placement),
+			    "%d queues, rx cpu %d-%d", tp->tp_queues,
+			    tp->tp_cpu.vc_first, tp->tp_cpu.vc_last);
+		} else if (tp->tp_queues > 1) {
+			snprintf(viu->viu_placement,
+			    sizeof(viu->viu_placement),
+			    "%d queues, %s", tp->tp_queues, place);
+		} else {
+			strcpy(viu->viu_placement, place);
+		}
+	}
+
+	rv = pthread_create(&tq->tq_pt, &attr, receiver, tq);
+	pthread_attr_destroy(&attr);
+	if (rv == 0)
+		tq->tq_ptvalid = 1;
+	return rv;
+}
+
 int
-VIFHYPER_CREATE(int devnum, struct virtif_user **viup)
+VIFHYPER_CREATE(const char *devstr, struct virtif_sc *vif_sc, uint8_t *enaddr,
+	struct virtif_user **viup)
 {
 	struct virtif_user *viu = NULL;
+	struct tapif_params tp;
 	void *cookie;
-	int rv;
+	int i, rv;
 
 	cookie = rumpuser_component_unschedule();
 
-	viu = malloc(sizeof(*viu));
+	memset(&tp, 0, sizeof(tp));
+	vif_cpuspec_init(&tp.tp_cpu);
+	vif_capspec_init(&tp.tp_cap);
+	tp.tp_queues = 1;
+	if ((rv = vif_parselinkstr("virtif", devstr, tp.tp_ifname,
+	    sizeof(tp.tp_ifname), tapopt, &tp)) != 0)
+		goto out;
+
+	viu = calloc(1, sizeof(*viu));
 	if (viu == NULL) {
 		rv = errno;
 		goto out;
 	}
-
-	viu->viu_fd = opentapdev(devnum);
-	if (viu->viu_fd == -1) {
+	viu->viu_q = calloc(tp.tp_queues, sizeof(*viu->viu_q));
+	if (viu->viu_q == NULL) {
 		rv = errno;
 		free(viu);
+		viu = NULL;
 		goto out;
 	}
-	viu->viu_dying = 0;
-	rv = 0;
+	if ((rv = vif_runctl_init(&viu->viu_runctl)) != 0) {
+		free(viu->viu_q);
+		free(viu);
+		viu = NULL;
+		goto out;
+	}
+	if ((rv = vif_capture_open(&viu->viu_cap, &tp.tp_cap,
+	    tp.tp_ifname)) != 0) {
+		vif_runctl_fini(&viu->viu_runctl);
+		free(viu->viu_q);
+		free(viu);
+		viu = NULL;
+		goto out;
+	}
+	viu->viu_virtifsc = vif_sc;
+	strcpy(viu->viu_ifname, tp.tp_ifname);
+	viu->viu_vnethdr = tp.tp_vnethdr;
+
+	for (i = 0; i < tp.tp_queues; i++) {
+		if ((rv = createq(viu, &viu->viu_q[i], i, &tp)) != 0)
+			break;
+	}
+	if (rv != 0) {
+		/* the receivers are still parked on the runctl */
+		vif_runctl_dying(&viu->viu_runctl);
+		for (; i >= 0; i--)
+			destroyq(&viu->viu_q[i]);
+		if (viu->viu_cap != NULL)
+			vif_capture_close(viu->viu_cap);
+		vif_runctl_fini(&viu->viu_runctl);
+		free(viu->viu_q);
+		free(viu);
+		viu = NULL;
+		goto out;
+	}
+	viu->viu_nqueues = tp.tp_queues;
 
  out:
 	rumpuser_component_schedule(cookie);
@@ -128,78 +468,140 @@ VIFHYPER_CREATE(int devnum, struct virtif_user **viup)
 }
 
 void
-VIFHYPER_SEND(struct virtif_user *viu,
-	struct iovec *iov, size_t iovlen)
+VIFHYPER_INFO(struct virtif_user *viu, char *buf, size_t buflen)
 {
-	void *cookie = rumpuser_component_unschedule();
 
-	/* no need to check for return value; packets may be dropped */
-	writev(viu->viu_fd, iov, iovlen);
+	snprintf(buf, buflen, "%s", viu->viu_placement);
+}
 
-	rumpuser_component_schedule(cookie);
+int
+VIFHYPER_FLAGS(struct virtif_user *viu)
+{
+
+	return viu->viu_vnethdr ? VIFFLAG_VNETHDR | VIFFLAG_TSO : 0;
 }
 
-/* how often to check for interface going south */
-#define POLLTIMO_MS 10
+/* read() returns one frame at a time, there is no batch to hold back */
 int
-VIFHYPER_RECV(struct virtif_user *viu,
-	void *data, size_t dlen, size_t *rcv)
+VIFHYPER_COALESCE(struct virtif_user *viu, struct virtif_coalesce *vc,
+	int set)
 {
-	void *cookie = rumpuser_component_unschedule();
-	struct pollfd pfd;
-	ssize_t nn = 0;
-	int rv, prv;
 
-	pfd.fd = viu->viu_fd;
-	pfd.events = POLLIN;
+	return rumpuser_component_errtrans(EOPNOTSUPP);
+}
 
-	for (;;) {
-		if (viu->viu_dying) {
-			rv = 0;
-			*rcv = 0;
-			break;
-		}
+/*
+ * SEND picks the tap queue of each frame by its flow, so all queues
+ * sit behind the one ring the kernel sees.
+ */
+int
+VIFHYPER_TXRINGS(struct virtif_user *viu)
+{
 
-		prv = poll(&pfd, 1, POLLTIMO_MS);
-		if (prv == 0)
+	return 1;
+}
+
+/* every queue is reported as a ring */
+int
+VIFHYPER_STATS(struct virtif_user *viu, int ring, struct virtif_stats *vs)
+{
+	int i;
+
+	memset(vs, 0, sizeof(*vs));
+	if (ring >= viu->viu_nqueues)
+		return rumpuser_component_errtrans(ENOENT);
+	for (i = 0; i < viu->viu_nqueues; i++) {
+		if (ring >= 0 && ring != i)
 			continue;
-		if (prv == -1) {
-			rv = errno;
-			break;
-		}
+		vif_stats_add(vs, &viu->viu_q[i].tq_rxstats);
+		vif_stats_add(vs, &viu->viu_q[i].tq_txstats);
+	}
+	return 0;
+}
 
-		nn = read(viu->viu_fd, data, dlen);
-		if (nn == -1) {
-			if (errno == EAGAIN)
-				continue;
-			rv = errno;
-		} else {
-			*rcv = (size_t)nn;
-			rv = 0;
-		}
+/* the queue a frame goes out on: by flow, so that a flow keeps its order */
+static struct tapq *
+txq(struct virtif_user *viu, const struct iovec *iov, size_t iovcnt)
+{
+
+	if (viu->viu_nqueues == 1)
+		return &viu->viu_q[0];
+	return &viu->viu_q[vif_flowhash(iov, iovcnt) % viu->viu_nqueues];
+}
 
-		break;
+/*
+ * The tap device takes exactly one frame per write, so a batch costs
+ * one writev() per frame but only one unschedule/schedule pair.
+ * With several queues each frame goes to the queue its flow hashes
+ * to.  With vnethdr the first iovec of each frame is the header,
+ * which the tap device takes in the same write.  Stop at the first
+ * failure and drop the rest of the batch.
+ */
+int
+VIFHYPER_SEND(struct virtif_user *viu, int txring, struct iovec *iov,
+	const size_t *iovcnt, size_t npkt)
+{
+	void *cookie = rumpuser_component_unschedule();
+	struct tapq *tq;
+	size_t pkt, sent, hdrsz, hdriov;
+	ssize_t nn;
+
+	hdrsz = viu->viu_vnethdr ? sizeof(struct vif_vnethdr) : 0;
+	hdriov = viu->viu_vnethdr ? 1 : 0;
+
+	for (pkt = 0; pkt < npkt; iov += iovcnt[pkt], pkt++) {
+		tq = txq(viu, iov + hdriov, iovcnt[pkt] - hdriov);
+		if ((nn = writev(tq->tq_fd, iov, iovcnt[pkt])) == -1)
+			break;
+		VIF_CAPTURE(viu->viu_cap, iov + hdriov, iovcnt[pkt] - hdriov, 1);
+		tq->tq_txstats.vs_opackets++;
+		tq->tq_txstats.vs_obytes += nn - hdrsz;
+	}
+	sent = pkt;
+
+	/* the rest is dropped, each frame on the queue it was meant for */
+	for (; pkt < npkt; iov += iovcnt[pkt], pkt++) {
+		tq = txq(viu, iov + hdriov, iovcnt[pkt] - hdriov);
+		tq->tq_txstats.vs_drops[VIFSTAT_DROP_TXFULL]++;
 	}
 
 	rumpuser_component_schedule(cookie);
-	return rumpuser_component_errtrans(rv);
+	return (int)sent;
+}
+
+void
+VIFHYPER_START(struct virtif_user *viu)
+{
+
+	vif_runctl_start(&viu->viu_runctl);
+}
+
+void
+VIFHYPER_STOP(struct virtif_user *viu)
+{
+
+	vif_runctl_stop(&viu->viu_runctl);
 }
-#undef POLLTIMO_MS
 
 void
 VIFHYPER_DYING(struct virtif_user *viu)
 {
 
-	/* no locking necessary.  it'll be seen eventually */
-	viu->viu_dying = 1;
+	vif_runctl_dying(&viu->viu_runctl);
 }
 
 void
 VIFHYPER_DESTROY(struct virtif_user *viu)
 {
 	void *cookie = rumpuser_component_unschedule();
-
-	close(viu->viu_fd);
+	int i;
+
+	for (i = 0; i < viu->viu_nqueues; i++)
+		destroyq(&viu->viu_q[i]);
+	if (viu->viu_cap != NULL)
+		vif_capture_close(viu->viu_cap);
+	vif_runctl_fini(&viu->viu_runctl);
+	free(viu->viu_q);
 	free(viu);
 
 	rumpuser_component_schedule(cookie);
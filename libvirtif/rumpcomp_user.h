@@ -29,9 +29,23 @@ struct virtif_user;
 
 int 	VIFHYPER_CREATE(const char *, struct virtif_sc *, uint8_t *,
 			struct virtif_user **);
+void	VIFHYPER_START(struct virtif_user *);
+void	VIFHYPER_STOP(struct virtif_user *);
 void	VIFHYPER_DYING(struct virtif_user *);
 void	VIFHYPER_DESTROY(struct virtif_user *);
 
-void	VIFHYPER_SEND(struct virtif_user *, struct iovec *, size_t);
+void	VIFHYPER_INFO(struct virtif_user *, char *, size_t);
+int	VIFHYPER_FLAGS(struct virtif_user *);
 
-void	VIF_DELIVERPKT(struct virtif_sc *, struct iovec *, size_t);
+int	VIFHYPER_STATS(struct virtif_user *, int, struct virtif_stats *);
+#ifdef VIRTIF_CYCLES
+struct vif_cychist *VIFHYPER_CYCLES(struct virtif_user *);
+#endif
+
+int	VIFHYPER_COALESCE(struct virtif_user *, struct virtif_coalesce *,
+			  int);
+int	VIFHYPER_TXRINGS(struct virtif_user *);
+int	VIFHYPER_SEND(struct virtif_user *, int, struct iovec *,
+		      const size_t *, size_t);
+
+int	VIF_DELIVERPKT(struct virtif_sc *, struct iovec *, size_t);
@@ -0,0 +1,621 @@
+/*
+ * Copyright (c) 2026 The drv-netif-netmap contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE	/* CPU_SET() and pthread_attr_setaffinity_np() */
+#endif
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <net/if.h>
+
+#include "if_virt.h"
+#include "virtif_cycles.h"
+#include "rumpcomp_vif.h"
+
+int
+vif_setnonblock(int fd)
+{
+	int fl;
+
+	if ((fl = fcntl(fd, F_GETFL)) == -1
+	    || fcntl(fd, F_SETFL, fl | O_NONBLOCK) == -1)
+		return errno;
+	return 0;
+}
+
+int
+vif_runctl_init(struct vif_runctl *vr)
+{
+	int rv;
+
+	if (pipe(vr->vr_kickfd) == -1)
+		return errno;
+	if ((rv = vif_setnonblock(vr->vr_kickfd[0])) != 0
+	    || (rv = vif_setnonblock(vr->vr_kickfd[1])) != 0) {
+		close(vr->vr_kickfd[0]);
+		close(vr->vr_kickfd[1]);
+		return rv;
+	}
+	pthread_mutex_init(&vr->vr_mtx, NULL);
+	pthread_cond_init(&vr->vr_cv, NULL);
+	vr->vr_running = 0;
+	vr->vr_dying = 0;
+	return 0;
+}
+
+void
+vif_runctl_fini(struct vif_runctl *vr)
+{
+
+	pthread_cond_destroy(&vr->vr_cv);
+	pthread_mutex_destroy(&vr->vr_mtx);
+	close(vr->vr_kickfd[0]);
+	close(vr->vr_kickfd[1]);
+}
+
+/* called with vr_mtx held, so that a start cannot slip in before it */
+static void
+kick(struct vif_runctl *vr)
+{
+	char c = 0;
+
+	/* EAGAIN means a wakeup is already pending, which is fine */
+	(void)write(vr->vr_kickfd[1], &c, 1);
+}
+
+static void
+drain(struct vif_runctl *vr)
+{
+	char buf[64];
+
+	while (read(vr->vr_kickfd[0], buf, sizeof(buf)) > 0)
+		continue;
+}
+
+/*
+ * A kick always comes with a stop or with dying, under vr_mtx.  It
+ * is left in the pipe while the interface is down, so that every
+ * receiver of a multi-queue interface sees it, and drained once the
+ * interface runs again.
+ */
+void
+vif_runctl_start(struct vif_runctl *vr)
+{
+
+	pthread_mutex_lock(&vr->vr_mtx);
+	drain(vr);
+	vr->vr_running = 1;
+	pthread_cond_broadcast(&vr->vr_cv);
+	pthread_mutex_unlock(&vr->vr_mtx);
+}
+
+void
+vif_runctl_stop(struct vif_runctl *vr)
+{
+
+	pthread_mutex_lock(&vr->vr_mtx);
+	vr->vr_running = 0;
+	kick(vr);
+	pthread_mutex_unlock(&vr->vr_mtx);
+}
+
+void
+vif_runctl_dying(struct vif_runctl *vr)
+{
+
+	pthread_mutex_lock(&vr->vr_mtx);
+	vr->vr_dying = 1;
+	pthread_cond_broadcast(&vr->vr_cv);
+	kick(vr);
+	pthread_mutex_unlock(&vr->vr_mtx);
+}
+
+/*
+ * Block while the interface is down.  Returns non-zero when the
+ * receiver should exit.  A kick found while running is stale, and
+ * would keep the receiver's poll from ever blocking.
+ */
+int
+vif_runctl_wait(struct vif_runctl *vr)
+{
+	int dying;
+
+	pthread_mutex_lock(&vr->vr_mtx);
+	while (!vr->vr_running && !vr->vr_dying)
+		pthread_cond_wait(&vr->vr_cv, &vr->vr_mtx);
+	dying = vr->vr_dying;
+	if (!dying)
+		drain(vr);
+	pthread_mutex_unlock(&vr->vr_mtx);
+
+	return dying;
+}
+
+int
+vif_parselinkstr(const char *who, const char *linkstr,
+	char *ifname, size_t ifnamelen, vif_optfn optfn, void *arg)
+{
+	char *str, *opt, *val, *lasts;
+	int rv = 0;
+
+	if ((str = strdup(linkstr)) == NULL)
+		return errno;
+
+	opt = strtok_r(str, ",", &lasts);
+	if (opt == NULL || strlen(opt) >= ifnamelen) {
+		fprintf(stderr, "%s: invalid interface name in \"%s\"\n",
+		    who, linkstr);
+		rv = EINVAL;
+		goto out;
+	}
+	strcpy(ifname, opt);
+
+	while ((opt = strtok_r(NULL, ",", &lasts)) != NULL) {
+		if ((val = strchr(opt, '=')) != NULL)
+			*val++ = '\0';
+
+		if ((rv = optfn(arg, opt, val)) != 0) {
+			fprintf(stderr, "%s: %s: invalid option \"%s%s%s\"\n",
+			    who, ifname, opt, val ? "=" : "", val ? val : "");
+			goto out;
+		}
+	}
+
+ out:
+	free(str);
+	return rv;
+}
+
+void
+vif_cpuspec_init(struct vif_cpuspec *vc)
+{
+
+	vc->vc_first = vc->vc_last = -1;
+	vc->vc_nopin = 0;
+}
+
+/* "N", "N-M" or "any" */
+int
+vif_cpuspec_parse(const char *val, struct vif_cpuspec *vc)
+{
+	const char *p;
+	char *ep;
+	long first, last;
+
+	if (val == NULL)
+		return EINVAL;
+	if (strcmp(val, "any") == 0) {
+		vc->vc_nopin = 1;
+		return 0;
+	}
+	p = val;
+	first = last = strtol(p, &ep, 10);
+	if (ep != p && *ep == '-') {
+		p = ep + 1;
+		last = strtol(p, &ep, 10);
+	}
+	if (ep == p || *ep != '\0' || first < 0 || last < first
+	    || last > INT_MAX)
+		return EINVAL;
+	vc->vc_first = first;
+	vc->vc_last = last;
+	return 0;
+}
+
+#ifdef __linux__
+/*
+ * Return the NUMA node the NIC is attached to, or -1 if it
+ * cannot be determined (virtual ports, single-node hosts).
+ */
+static int
+nicnode(const char *ifname)
+{
+	char path[128];
+	FILE *fp;
+	int node;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node",
+	    ifname);
+	if ((fp = fopen(path, "r")) == NULL)
+		return -1;
+	if (fscanf(fp, "%d", &node) != 1)
+		node = -1;
+	fclose(fp);
+	return node;
+}
+
+/* parse a sysfs cpulist such as "0-7,16-23" */
+static int
+nodecpus(int node, cpu_set_t *set, char *list, size_t listlen)
+{
+	char path[128], *p, *ep;
+	FILE *fp;
+	long first, last;
+	int ok;
+
+	snprintf(path, sizeof(path),
+	    "/sys/devices/system/node/node%d/cpulist", node);
+	if ((fp = fopen(path, "r")) == NULL)
+		return 0;
+	ok = fgets(list, listlen, fp) != NULL;
+	fclose(fp);
+	if (!ok)
+		return 0;
+	list[strcspn(list, "\n")] = '\0';
+
+	CPU_ZERO(set);
+	for (p = list; *p; p = ep) {
+		first = last = strtol(p, &ep, 10);
+		if (ep == p)
+			return 0;
+		if (*ep == '-') {
+			p = ep + 1;
+			last = strtol(p, &ep, 10);
+			if (ep == p)
+				return 0;
+		}
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, set);
+		if (*ep == ',')
+			ep++;
+	}
+	return CPU_COUNT(set) > 0;
+}
+
+/*
+ * Decide where a receiver runs: an explicit cpu= range wins,
+ * otherwise the cpus of the NIC's NUMA node, so that ring and
+ * buffer accesses stay socket-local.  With several receivers,
+ * receiver number idx (>= 0) gets one cpu of an explicit range,
+ * round-robin.  A description of the choice is left in descr.
+ */
+int
+vif_placethread(const char *ifname, const struct vif_cpuspec *vc, int idx,
+	pthread_attr_t *attr, char *descr, size_t descrlen)
+{
+	char list[256];
+	cpu_set_t set;
+	int cpu, node;
+
+	if (vc->vc_nopin) {
+		snprintf(descr, descrlen, "rx unpinned");
+		return 0;
+	}
+
+	if (vc->vc_first >= 0 && idx >= 0) {
+		cpu = vc->vc_first + idx % (vc->vc_last - vc->vc_first + 1);
+		CPU_ZERO(&set);
+		if (cpu < CPU_SETSIZE)
+			CPU_SET(cpu, &set);
+		snprintf(descr, descrlen, "rx cpu %d", cpu);
+	} else if (vc->vc_first >= 0) {
+		CPU_ZERO(&set);
+		for (cpu = vc->vc_first;
+		    cpu <= vc->vc_last && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, &set);
+		if (vc->vc_first == vc->vc_last)
+			snprintf(descr, descrlen, "rx cpu %d", vc->vc_first);
+		else
+			snprintf(descr, descrlen, "rx cpu %d-%d",
+			    vc->vc_first, vc->vc_last);
+	} else if ((node = nicnode(ifname)) >= 0
+	    && nodecpus(node, &set, list, sizeof(list))) {
+		snprintf(descr, descrlen, "rx cpu %s (numa node %d)",
+		    list, node);
+	} else {
+		snprintf(descr, descrlen, "rx unpinned (numa node unknown)");
+		return 0;
+	}
+
+	return pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+/* the MAC address of a host interface */
+int
+vif_gethwaddr(const char *ifname, uint8_t *enaddr)
+{
+	struct ifreq ifr;
+	int fd, rv = 0;
+
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		return errno;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name)-1);
+	if (ioctl(fd, SIOCGIFHWADDR, &ifr) == -1)
+		rv = errno;
+	else
+		memcpy(enaddr, ifr.ifr_hwaddr.sa_data, 6);
+	close(fd);
+	return rv;
+}
+#else
+int
+vif_placethread(const char *ifname, const struct vif_cpuspec *vc, int idx,
+	pthread_attr_t *attr, char *descr, size_t descrlen)
+{
+
+	snprintf(descr, descrlen, "rx unpinned");
+	return 0;
+}
+
+int
+vif_gethwaddr(const char *ifname, uint8_t *enaddr)
+{
+
+	return EOPNOTSUPP;
+}
+#endif
+
+/*
+ * Hash a frame's flow (addresses and, for unfragmented TCP/UDP, the
+ * ports) so that all frames of a connection leave through the same
+ * queue and stay in order.  The headers may be split across iovecs
+ * (one per mbuf), so the first bytes are gathered into a local buffer.
+ * Anything not IPv4 or IPv6 hashes on the ethertype alone.
+ */
+#define FH_HDRLEN	(14 + 4 + 60 + 4)	/* ether, vlan, ip+options, ports */
+
+static uint32_t
+fhmix(uint32_t h, const uint8_t *p, size_t len)
+{
+
+	/* FNV-1a */
+	while (len--) {
+		h ^= *p++;
+		h *= 16777619;
+	}
+	return h;
+}
+
+uint32_t
+vif_flowhash(const struct iovec *iov, size_t iovcnt)
+{
+	uint8_t hdr[FH_HDRLEN], *l3;
+	size_t len = 0, n, l3len, ihl;
+	uint32_t h = 2166136261U;
+	uint16_t etype;
+	uint8_t proto;
+
+	for (; iovcnt > 0 && len < sizeof(hdr); iov++, iovcnt--) {
+		n = iov->iov_len;
+		if (n > sizeof(hdr) - len)
+			n = sizeof(hdr) - len;
+		memcpy(hdr + len, iov->iov_base, n);
+		len += n;
+	}
+	if (len < 14)
+		return 0;
+
+	etype = hdr[12] << 8 | hdr[13];
+	l3 = hdr + 14;
+	if (etype == 0x8100 && len >= 18) {
+		etype = hdr[16] << 8 | hdr[17];
+		l3 += 4;
+	}
+	l3len = len - (l3 - hdr);
+
+	switch (etype) {
+	case 0x0800:
+		if (l3len < 20)
+			break;
+		ihl = (l3[0] & 0xf) * 4;
+		proto = l3[9];
+		h = fhmix(h, l3 + 9, 1);
+		h = fhmix(h, l3 + 12, 8);
+		/* ports only on first fragments without MF/offset */
+		if ((proto == 6 || proto == 17)
+		    && (l3[6] & 0x3f) == 0 && l3[7] == 0 && l3len >= ihl + 4)
+			h = fhmix(h, l3 + ihl, 4);
+		return h;
+	case 0x86dd:
+		if (l3len < 40)
+			break;
+		proto = l3[6];
+		h = fhmix(h, l3 + 6, 1);
+		h = fhmix(h, l3 + 8, 32);
+		if ((proto == 6 || proto == 17) && l3len >= 44)
+			h = fhmix(h, l3 + 40, 4);
+		return h;
+	}
+
+	return fhmix(h, (const uint8_t *)&etype, sizeof(etype));
+}
+
+void
+vif_stats_add(struct virtif_stats *dst, const struct virtif_stats *src)
+{
+	int i;
+
+	dst->vs_ipackets += src->vs_ipackets;
+	dst->vs_ibytes += src->vs_ibytes;
+	dst->vs_opackets += src->vs_opackets;
+	dst->vs_obytes += src->vs_obytes;
+	dst->vs_otruncated += src->vs_otruncated;
+	for (i = 0; i < VIFSTAT_NDROP; i++)
+		dst->vs_drops[i] += src->vs_drops[i];
+	dst->vs_wakeups += src->vs_wakeups;
+	dst->vs_emptypolls += src->vs_emptypolls;
+	for (i = 0; i < VIFSTAT_NBATCH; i++)
+		dst->vs_batch[i] += src->vs_batch[i];
+}
+
+void
+vif_stats_batch(struct virtif_stats *vs, unsigned int npkt)
+{
+	unsigned int b;
+
+	vs->vs_wakeups++;
+	if (npkt == 0) {
+		vs->vs_emptypolls++;
+		return;
+	}
+	for (b = 0; npkt > 1 && b < VIFSTAT_NBATCH-1; b++)
+		npkt >>= 1;
+	vs->vs_batch[b]++;
+}
+
+uint64_t
+vif_nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* below this the adaptive wait is zero: latency matters more */
+#define COAL_LOWRATE	10000
+
+void
+vif_coalesce_init(struct vif_coalesce *vco)
+{
+
+	memset(vco, 0, sizeof(*vco));
+}
+
+void
+vif_coalesce_set(struct vif_coalesce *vco, const struct virtif_coalesce *vc)
+{
+
+	vco->vco_frames = vc->vc_frames;
+	vco->vco_usecs = vc->vc_usecs;
+	vco->vco_adaptive = vc->vc_adaptive != 0;
+	vco->vco_curusecs = vco->vco_adaptive ? 0 : vc->vc_usecs;
+}
+
+void
+vif_coalesce_get(const struct vif_coalesce *vco, struct virtif_coalesce *vc)
+{
+
+	vc->vc_frames = vco->vco_frames;
+	vc->vc_usecs = vco->vco_usecs;
+	vc->vc_adaptive = vco->vco_adaptive;
+	vc->vc_curusecs = vco->vco_curusecs;
+}
+
+/*
+ * How long to hold back a batch of which nready frames are ready,
+ * in microseconds.  Zero: deliver now.  In adaptive mode this is
+ * the time the missing frames take to arrive at the smoothed rate,
+ * at most the wait for a whole batch (vco_curusecs).
+ */
+unsigned int
+vif_coalesce_wait(struct vif_coalesce *vco, unsigned int nready)
+{
+	unsigned int frames = vco->vco_frames;
+	uint64_t us;
+
+	if (frames <= 1 || nready >= frames)
+		return 0;
+	if (!vco->vco_adaptive || vco->vco_rate == 0)
+		return vco->vco_curusecs;
+	us = (uint64_t)(frames - nready) * 1000000 / vco->vco_rate;
+	return us < vco->vco_curusecs ? (unsigned int)us : vco->vco_curusecs;
+}
+
+/*
+ * Account a delivered batch.  In adaptive mode the arrival rate is
+ * averaged over the last few batches, and vco_curusecs set to the
+ * time a whole batch takes to arrive at that rate, or to zero if
+ * the rate is too low for waiting to pay off.
+ */
+void
+vif_coalesce_batch(struct vif_coalesce *vco, unsigned int npkt)
+{
+	uint64_t now, dt, rate, us;
+
+	if (!vco->vco_adaptive || npkt == 0)
+		return;
+
+	now = vif_nsecs();
+	dt = now - vco->vco_last;
+	vco->vco_last = now;
+	if (dt == 0)
+		dt = 1;
+	rate = npkt * 1000000000ULL / dt;
+	vco->vco_rate = (3 * vco->vco_rate + rate) / 4;
+
+	if (vco->vco_rate < COAL_LOWRATE) {
+		us = 0;
+	} else {
+		us = (uint64_t)vco->vco_frames * 1000000 / vco->vco_rate;
+		if (us > vco->vco_usecs)
+			us = vco->vco_usecs;
+	}
+	vco->vco_curusecs = (unsigned int)us;
+}
+
+#ifdef VIRTIF_CYCLES
+static uint64_t
+cycpercentile(const struct vif_cychist *vh, unsigned int pct)
+{
+	uint64_t want, seen = 0;
+	unsigned int b;
+
+	want = (vh->vh_count * pct + 99) / 100;
+	for (b = 0; b < VIFCYC_NBUCKET; b++) {
+		seen += vh->vh_bucket[b];
+		if (seen >= want)
+			return vif_cycbucketmin(b);
+	}
+	return 0;
+}
+
+void
+vif_cycles_dump(const char *ifname, const struct vif_cychist *cyc)
+{
+	static const char *names[] = VIFCYC_NAMES;
+	const struct vif_cychist *vh;
+	int s;
+
+	fprintf(stderr, "%s: cycles per stage\n", ifname);
+	fprintf(stderr, "%12s %12s %10s %10s %10s %10s\n",
+	    "stage", "count", "mean", "p50", "p90", "p99");
+	for (s = 0; s < VIFCYC_NSTAGES; s++) {
+		vh = &cyc[s];
+		if (vh->vh_count == 0)
+			continue;
+		fprintf(stderr, "%12s %12" PRIu64 " %10" PRIu64 " %10" PRIu64
+		    " %10" PRIu64 " %10" PRIu64 "\n", names[s], vh->vh_count,
+		    vh->vh_sum / vh->vh_count, cycpercentile(vh, 50),
+		    cycpercentile(vh, 90), cycpercentile(vh, 99));
+	}
+}
+#endif
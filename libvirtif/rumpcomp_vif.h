@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2026 The drv-netif-netmap contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Helpers shared by the hypercall implementations of the different
+ * backends.  Hypercall side only.
+ */
+
+/*
+ * Receiver run state.  Receivers sleep on vr_cv while the interface
+ * is stopped and include vr_kickfd[0] in their poll set while it is
+ * running, so that stop and dying take effect immediately.
+ */
+struct vif_runctl {
+	pthread_mutex_t vr_mtx;
+	pthread_cond_t vr_cv;
+	int vr_running;
+	int vr_dying;
+	int vr_kickfd[2];
+};
+
+int	vif_runctl_init(struct vif_runctl *);
+void	vif_runctl_fini(struct vif_runctl *);
+void	vif_runctl_start(struct vif_runctl *);
+void	vif_runctl_stop(struct vif_runctl *);
+void	vif_runctl_dying(struct vif_runctl *);
+int	vif_runctl_wait(struct vif_runctl *);
+
+#define vif_runctl_fd(vr) ((vr)->vr_kickfd[0])
+
+/* receiver thread placement, "cpu=" in the link string */
+struct vif_cpuspec {
+	int vc_first;		/* -1: use the NIC's NUMA node */
+	int vc_last;
+	int vc_nopin;
+};
+
+void	vif_cpuspec_init(struct vif_cpuspec *);
+int	vif_cpuspec_parse(const char *, struct vif_cpuspec *);
+int	vif_placethread(const char *, const struct vif_cpuspec *, int,
+			pthread_attr_t *, char *, size_t);
+
+/*
+ * Split "ifname[,option[=value]]..." and call the backend for each
+ * option.  The callback returns 0 or an errno, EINVAL for options it
+ * does not know.
+ */
+typedef int (*vif_optfn)(void *, const char *, const char *);
+int	vif_parselinkstr(const char *, const char *, char *, size_t,
+			 vif_optfn, void *);
+
+int	vif_setnonblock(int);
+int	vif_gethwaddr(const char *, uint8_t *);
+uint32_t vif_flowhash(const struct iovec *, size_t);
+
+/*
+ * Packet capture into a pcapng file, "capture=path" in the link
+ * string with "snaplen=N" (default 256) and "sample=N" (every Nth
+ * frame).  See rumpcomp_capture.c.
+ */
+struct vif_capspec {
+	char vcs_path[256];
+	unsigned int vcs_snaplen;
+	unsigned int vcs_sample;
+};
+
+struct vif_capture;
+
+void	vif_capspec_init(struct vif_capspec *);
+int	vif_capspec_opt(struct vif_capspec *, const char *, const char *);
+int	vif_capture_open(struct vif_capture **, const struct vif_capspec *,
+			 const char *);
+void	vif_capture_close(struct vif_capture *);
+void	vif_capture_frame(struct vif_capture *, const struct iovec *, size_t,
+			  int);
+
+#define VIF_CAPTURE(vc, iov, iovcnt, out) do {				\
+	if ((vc) != NULL)						\
+		vif_capture_frame((vc), (iov), (iovcnt), (out));	\
+} while (/*CONSTCOND*/0)
+
+/*
+ * Receive coalescing, see struct virtif_coalesce.  The settings are
+ * written by VIFHYPER_COALESCE while the receiver runs and are read
+ * by the receiver only between batches; the rest is the receiver's.
+ */
+struct vif_coalesce {
+	volatile unsigned int vco_frames;
+	volatile unsigned int vco_usecs;
+	volatile int vco_adaptive;
+	volatile unsigned int vco_curusecs;
+
+	uint64_t vco_last;	/* ns, end of the previous batch */
+	uint64_t vco_rate;	/* frames per second, smoothed */
+};
+
+void	vif_coalesce_init(struct vif_coalesce *);
+void	vif_coalesce_set(struct vif_coalesce *, const struct virtif_coalesce *);
+void	vif_coalesce_get(const struct vif_coalesce *, struct virtif_coalesce *);
+unsigned int vif_coalesce_wait(struct vif_coalesce *, unsigned int);
+void	vif_coalesce_batch(struct vif_coalesce *, unsigned int);
+uint64_t vif_nsecs(void);
+
+void	vif_stats_add(struct virtif_stats *, const struct virtif_stats *);
+void	vif_stats_batch(struct virtif_stats *, unsigned int);
+
+#ifdef VIRTIF_CYCLES
+void	vif_cycles_dump(const char *, const struct vif_cychist *);
+#endif
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2026 The drv-netif-netmap contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Per-stage cycle accounting for the packet path.  Compiled in only
+ * with -DVIRTIF_CYCLES (NETMAPIF_CYCLES=yes in the Makefile); otherwise
+ * the macros expand to nothing.
+ *
+ * NOTE!  This file is included both in the rump kernel and in the
+ * hypercall layer, so it must not depend on either environment.
+ */
+
+#define VIFCYC_POLL	0	/* receiver: waiting in poll() */
+#define VIFCYC_SCHED	1	/* rumpuser_component_schedule() */
+#define VIFCYC_MBUF	2	/* mbuf allocation and copy */
+#define VIFCYC_INPUT	3	/* bpf_mtap() and ether_input() */
+#define VIFCYC_TXCOPY	4	/* copying a frame into a tx slot */
+#define VIFCYC_TXSYNC	5	/* NIOCTXSYNC */
+#define VIFCYC_NSTAGES	6
+
+#define VIFCYC_NAMES \
+    { "poll", "schedule", "mbuf", "ether_input", "txcopy", "txsync" }
+
+/*
+ * Log-linear histogram: values below 8 get their own bucket, above
+ * that each power of two is split into 4 linear buckets.
+ */
+#define VIFCYC_NBUCKET	(8 + 61*4)
+
+struct vif_cychist {
+	uint64_t vh_count;
+	uint64_t vh_sum;
+	uint64_t vh_bucket[VIFCYC_NBUCKET];
+};
+
+#ifdef VIRTIF_CYCLES
+
+static __inline uint64_t
+vif_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	uint32_t lo, hi;
+
+	__asm __volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (uint64_t)hi << 32 | lo;
+#elif defined(__aarch64__)
+	uint64_t v;
+
+	__asm __volatile("mrs %0, cntvct_el0" : "=r"(v));
+	return v;
+#else
+#error VIRTIF_CYCLES not supported on this architecture
+#endif
+}
+
+static __inline unsigned int
+vif_cycbucket(uint64_t v)
+{
+	unsigned int e;
+
+	if (v < 8)
+		return (unsigned int)v;
+	e = 63 - __builtin_clzll(v);
+	return 8 + (e-3)*4 + (unsigned int)((v >> (e-2)) & 3);
+}
+
+static __inline uint64_t
+vif_cycbucketmin(unsigned int b)
+{
+	unsigned int e;
+
+	if (b < 8)
+		return b;
+	e = 3 + (b-8)/4;
+	return ((uint64_t)1 << e) + ((b-8)%4) * ((uint64_t)1 << (e-2));
+}
+
+static __inline void
+vif_cychist_add(struct vif_cychist *vh, uint64_t v)
+{
+
+	vh->vh_count++;
+	vh->vh_sum += v;
+	vh->vh_bucket[vif_cycbucket(v)]++;
+}
+
+#define VIFCYC_DECL(t)		uint64_t t
+#define VIFCYC_STAMP(t)		((t) = vif_cycles())
+#define VIFCYC_LAP(h, s, t)	do {					\
+	uint64_t _now = vif_cycles();					\
+	vif_cychist_add(&(h)[(s)], _now - (t));				\
+	(t) = _now;							\
+} while (/*CONSTCOND*/0)
+
+#else /* !VIRTIF_CYCLES */
+
+#define VIFCYC_DECL(t)		int t __attribute__((__unused__))
+#define VIFCYC_STAMP(t)		((void)0)
+#define VIFCYC_LAP(h, s, t)	((void)0)
+
+#endif /* VIRTIF_CYCLES */
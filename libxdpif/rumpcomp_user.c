@@ -0,0 +1,898 @@
+/*
+ * Copyright (c) 2026 The drv-netif-netmap contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Linux AF_XDP backend.  Every NIC queue in use gets an XDP socket
+ * with its own UMEM, shared between receive and transmit, and its own
+ * receiver thread.  A five-instruction XDP program redirects each
+ * queue's frames to its socket through an XSKMAP and passes everything
+ * else to the host stack.  The program is loaded and attached with
+ * plain bpf(2) calls, so no libbpf is needed; it is attached through
+ * a BPF link and goes away when the interface is destroyed.
+ *
+ * UMEM frames are recycled like netmap buffers: a received frame is
+ * copied into an mbuf by VIF_DELIVERPKT() and handed straight back
+ * to the fill ring, and transmit frames return to a free list from
+ * the completion ring.
+ */
+
+#define _GNU_SOURCE	/* pthread_attr_setaffinity_np() */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <net/if.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#include <rump/rumpuser_component.h>
+
+#include "if_virt.h"
+#include "virtif_cycles.h"
+#include "rumpcomp_user.h"
+#include "rumpcomp_vif.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+/*
+ * UMEM geometry, per queue.  The first half of the frames is kept
+ * in the fill ring for receive, the second half is used for transmit.
+ */
+#define XDP_FRAMESZ	2048
+#define XDP_NFRAMES	4096
+#define XDP_NRXFRAMES	(XDP_NFRAMES/2)
+#define XDP_RINGSZ	2048	/* every ring, a power of two */
+
+/* upper limit for "queues=" */
+#define XDP_MAXQ	16
+
+#define XDP_BUDGET	256	/* frames delivered per wakeup */
+
+/* one producer/consumer ring mapped from the socket */
+struct xring {
+	uint32_t *xr_prod;
+	uint32_t *xr_cons;
+	uint32_t *xr_flags;
+	void *xr_desc;
+	void *xr_map;
+	size_t xr_mapsz;
+};
+
+#define XR_LOAD(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define XR_STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define XR_ADDR(xr, i)	(((uint64_t *)(xr)->xr_desc)[(i) & (XDP_RINGSZ-1)])
+#define XR_DESC(xr, i)	\
+    (&((struct xdp_desc *)(xr)->xr_desc)[(i) & (XDP_RINGSZ-1)])
+
+struct xdpq {
+	struct virtif_user *xq_viu;
+	int xq_fd;
+	int xq_idx;
+	pthread_t xq_pt;
+	int xq_ptvalid;
+
+	uint8_t *xq_umem;
+	struct xring xq_rx;
+	struct xring xq_fill;
+	struct xring xq_tx;
+	struct xring xq_comp;
+
+	/* transmit frames not in flight, used only by senders */
+	uint64_t xq_txfree[XDP_NFRAMES - XDP_NRXFRAMES];
+	unsigned int xq_ntxfree;
+
+	/*
+	 * Written only by the queue's receiver and by the senders, which
+	 * the kernel's lock of its single tx ring serializes.
+	 */
+	struct virtif_stats xq_rxstats;
+	struct virtif_stats xq_txstats;
+};
+
+struct virtif_user {
+	struct vif_runctl viu_runctl;	/* shared by all receivers */
+
+	struct virtif_sc *viu_virtifsc;
+	char viu_ifname[IFNAMSIZ];
+	char viu_placement[48];	/* where the receivers run, for humans */
+
+	int viu_mapfd;		/* XSKMAP, queue id -> socket */
+	int viu_progfd;
+	int viu_linkfd;		/* the attachment, detached on close */
+
+	int viu_nqueues;
+	struct xdpq *viu_q;
+	unsigned int viu_budget;
+
+	struct vif_capture *viu_cap;	/* NULL if not capturing */
+};
+
+/* "ifname[,option[=value]]..." */
+struct xdpif_params {
+	char xp_ifname[IFNAMSIZ];
+	struct vif_cpuspec xp_cpu;
+	int xp_queues;
+	unsigned int xp_budget;
+	uint32_t xp_xdpflags;	/* XDP_FLAGS_*, program attach mode */
+	uint16_t xp_bindflags;	/* XDP_COPY, XDP_ZEROCOPY */
+	struct vif_capspec xp_cap;
+};
+
+static int
+xdpopt(void *arg, const char *opt, const char *val)
+{
+	struct xdpif_params *xp = arg;
+	unsigned long v;
+	char *ep;
+
+	if (strcmp(opt, "cpu") == 0)
+		return vif_cpuspec_parse(val, &xp->xp_cpu);
+	if (strcmp(opt, "queues") == 0) {
+		if (val == NULL)
+			return EINVAL;
+		xp->xp_queues = (int)strtol(val, &ep, 10);
+		if (*ep != '\0' || xp->xp_queues < 1
+		    || xp->xp_queues > XDP_MAXQ)
+			return EINVAL;
+		return 0;
+	}
+	if (strcmp(opt, "budget") == 0) {
+		if (val == NULL)
+			return EINVAL;
+		v = strtoul(val, &ep, 10);
+		if (*val == '\0' || *ep != '\0' || v < 1 || v > XDP_RINGSZ)
+			return EINVAL;
+		xp->xp_budget = v;
+		return 0;
+	}
+	if (val != NULL)
+		return vif_capspec_opt(&xp->xp_cap, opt, val);
+	if (strcmp(opt, "skb") == 0)
+		xp->xp_xdpflags = XDP_FLAGS_SKB_MODE;
+	else if (strcmp(opt, "drv") == 0)
+		xp->xp_xdpflags = XDP_FLAGS_DRV_MODE;
+	else if (strcmp(opt, "copy") == 0)
+		xp->xp_bindflags = XDP_COPY;
+	else if (strcmp(opt, "zerocopy") == 0)
+		xp->xp_bindflags = XDP_ZEROCOPY;
+	else
+		return EINVAL;
+	return 0;
+}
+
+static int
+sys_bpf(int cmd, union bpf_attr *attr)
+{
+
+	return (int)syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/*
+ * Create the XSKMAP and load the redirect program:
+ *
+ *	r2 = ctx->rx_queue_index
+ *	r1 = xskmap
+ *	r3 = XDP_PASS		(action if the queue has no socket)
+ *	return bpf_redirect_map(r1, r2, r3)
+ */
+static int
+loadprog(struct virtif_user *viu, int nqueues)
+{
+	struct bpf_insn prog[] = {
+		{ .code = BPF_LDX | BPF_MEM | BPF_W,
+		  .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1,
+		  .off = offsetof(struct xdp_md, rx_queue_index) },
+		{ .code = BPF_LD | BPF_DW | BPF_IMM,
+		  .dst_reg = BPF_REG_1, .src_reg = BPF_PSEUDO_MAP_FD },
+		{ .code = 0 },	/* second half of the 64bit immediate */
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K,
+		  .dst_reg = BPF_REG_3, .imm = XDP_PASS },
+		{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+	static const char license[] = "Dual BSD/GPL";
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = nqueues;
+	if ((viu->viu_mapfd = sys_bpf(BPF_MAP_CREATE, &attr)) == -1)
+		return errno;
+
+	prog[1].imm = viu->viu_mapfd;
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.expected_attach_type = BPF_XDP;
+	attr.insns = (uintptr_t)prog;
+	attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+	attr.license = (uintptr_t)license;
+	if ((viu->viu_progfd = sys_bpf(BPF_PROG_LOAD, &attr)) == -1)
+		return errno;
+	return 0;
+}
+
+static int
+attachprog(struct virtif_user *viu, int ifindex, uint32_t xdpflags)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = viu->viu_progfd;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = xdpflags;
+	if ((viu->viu_linkfd = sys_bpf(BPF_LINK_CREATE, &attr)) == -1)
+		return errno;
+	return 0;
+}
+
+static int
+mapsock(struct virtif_user *viu, struct xdpq *xq)
+{
+	union bpf_attr attr;
+	uint32_t key = xq->xq_idx, val = xq->xq_fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = viu->viu_mapfd;
+	attr.key = (uintptr_t)&key;
+	attr.value = (uintptr_t)&val;
+	if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1)
+		return errno;
+	return 0;
+}
+
+static int
+mapring(int fd, const struct xdp_ring_offset *off, size_t descsz,
+	off_t pgoff, struct xring *xr)
+{
+
+	xr->xr_mapsz = off->desc + XDP_RINGSZ * descsz;
+	xr->xr_map = mmap(NULL, xr->xr_mapsz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, pgoff);
+	if (xr->xr_map == MAP_FAILED) {
+		xr->xr_map = NULL;
+		return errno;
+	}
+	xr->xr_prod = (void *)((uint8_t *)xr->xr_map + off->producer);
+	xr->xr_cons = (void *)((uint8_t *)xr->xr_map + off->consumer);
+	xr->xr_flags = (void *)((uint8_t *)xr->xr_map + off->flags);
+	xr->xr_desc = (uint8_t *)xr->xr_map + off->desc;
+	return 0;
+}
+
+static void
+unmapring(struct xring *xr)
+{
+
+	if (xr->xr_map)
+		munmap(xr->xr_map, xr->xr_mapsz);
+}
+
+/*
+ * Kernels before 5.11 charge UMEM and BPF maps to RLIMIT_MEMLOCK,
+ * whose default is too small for them.  Called when that is what a
+ * registration failed on; the limit is process-wide, so say so.
+ */
+static int
+raisememlock(const char *ifname)
+{
+	struct rlimit rl = { RLIM_INFINITY, RLIM_INFINITY }, orl;
+
+	if (getrlimit(RLIMIT_MEMLOCK, &orl) == 0
+	    && orl.rlim_cur == RLIM_INFINITY)
+		return EEXIST;
+	if (setrlimit(RLIMIT_MEMLOCK, &rl) == -1) {
+		int error = errno;
+
+		fprintf(stderr, "xdpif:%s: cannot raise RLIMIT_MEMLOCK: %s\n",
+		    ifname, strerror(error));
+		return error;
+	}
+	fprintf(stderr, "xdpif:%s: raised RLIMIT_MEMLOCK of the process "
+	    "to unlimited\n", ifname);
+	return 0;
+}
+
+static int
+regumem(const struct xdpif_params *xp, struct xdpq *xq)
+{
+	struct xdp_umem_reg ur;
+	int rv;
+
+	memset(&ur, 0, sizeof(ur));
+	ur.addr = (uintptr_t)xq->xq_umem;
+	ur.len = (uint64_t)XDP_NFRAMES * XDP_FRAMESZ;
+	ur.chunk_size = XDP_FRAMESZ;
+	if (setsockopt(xq->xq_fd, SOL_XDP, XDP_UMEM_REG,
+	    &ur, sizeof(ur)) == 0)
+		return 0;
+	rv = errno;
+	if ((rv != ENOMEM && rv != EPERM) || raisememlock(xp->xp_ifname) != 0)
+		return rv;
+	if (setsockopt(xq->xq_fd, SOL_XDP, XDP_UMEM_REG,
+	    &ur, sizeof(ur)) == -1)
+		return errno;
+	return 0;
+}
+
+/*
+ * Set up the UMEM and the four rings of one socket, prime the fill
+ * ring with the receive frames and bind the socket to its queue.
+ */
+static int
+openxsk(const struct xdpif_params *xp, int ifindex, struct xdpq *xq)
+{
+	struct xdp_mmap_offsets off;
+	struct sockaddr_xdp sxdp;
+	socklen_t optlen;
+	int ringsz = XDP_RINGSZ;
+	unsigned int i;
+	int rv;
+
+	xq->xq_umem = mmap(NULL, (size_t)XDP_NFRAMES * XDP_FRAMESZ,
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+	    -1, 0);
+	if (xq->xq_umem == MAP_FAILED) {
+		xq->xq_umem = NULL;
+		return errno;
+	}
+
+	if ((xq->xq_fd = socket(AF_XDP, SOCK_RAW, 0)) == -1)
+		return errno;
+
+	if ((rv = regumem(xp, xq)) != 0)
+		return rv;
+	if (setsockopt(xq->xq_fd, SOL_XDP, XDP_UMEM_FILL_RING,
+	      &ringsz, sizeof(ringsz)) == -1
+	    || setsockopt(xq->xq_fd, SOL_XDP, XDP_UMEM_COMPLETION_RING,
+	      &ringsz, sizeof(ringsz)) == -1
+	    || setsockopt(xq->xq_fd, SOL_XDP, XDP_RX_RING,
+	      &ringsz, sizeof(ringsz)) == -1
+	    || setsockopt(xq->xq_fd, SOL_XDP, XDP_TX_RING,
+	      &ringsz, sizeof(ringsz)) == -1)
+		return errno;
+
+	optlen = sizeof(off);
+	if (getsockopt(xq->xq_fd, SOL_XDP, XDP_MMAP_OFFSETS,
+	    &off, &optlen) == -1)
+		return errno;
+	if ((rv = mapring(xq->xq_fd, &off.rx, sizeof(struct xdp_desc),
+	    XDP_PGOFF_RX_RING, &xq->xq_rx)) != 0
+	    || (rv = mapring(xq->xq_fd, &off.tx, sizeof(struct xdp_desc),
+	      XDP_PGOFF_TX_RING, &xq->xq_tx)) != 0
+	    || (rv = mapring(xq->xq_fd, &off.fr, sizeof(uint64_t),
+	      XDP_UMEM_PGOFF_FILL_RING, &xq->xq_fill)) != 0
+	    || (rv = mapring(xq->xq_fd, &off.cr, sizeof(uint64_t),
+	      XDP_UMEM_PGOFF_COMPLETION_RING, &xq->xq_comp)) != 0)
+		return rv;
+
+	for (i = 0; i < XDP_NRXFRAMES; i++)
+		XR_ADDR(&xq->xq_fill, i) = (uint64_t)i * XDP_FRAMESZ;
+	XR_STORE(xq->xq_fill.xr_prod, XDP_NRXFRAMES);
+	for (i = 0; i < XDP_NFRAMES - XDP_NRXFRAMES; i++)
+		xq->xq_txfree[i] = (uint64_t)(XDP_NRXFRAMES + i) * XDP_FRAMESZ;
+	xq->xq_ntxfree = i;
+
+	memset(&sxdp, 0, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = ifindex;
+	sxdp.sxdp_queue_id = xq->xq_idx;
+	sxdp.sxdp_flags = xp->xp_bindflags | XDP_USE_NEED_WAKEUP;
+	if (bind(xq->xq_fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == -1) {
+		rv = errno;
+		fprintf(stderr, "xdpif:%s: cannot bind to queue %d: %s\n",
+		    xp->xp_ifname, xq->xq_idx, strerror(rv));
+		return rv;
+	}
+	return 0;
+}
+
+/* undo openxsk() and createq(), also for a partially constructed queue */
+static void
+destroyq(struct xdpq *xq)
+{
+
+	if (xq->xq_ptvalid)
+		pthread_join(xq->xq_pt, NULL);
+	unmapring(&xq->xq_rx);
+	unmapring(&xq->xq_tx);
+	unmapring(&xq->xq_fill);
+	unmapring(&xq->xq_comp);
+	if (xq->xq_fd != -1)
+		close(xq->xq_fd);
+	if (xq->xq_umem)
+		munmap(xq->xq_umem, (size_t)XDP_NFRAMES * XDP_FRAMESZ);
+}
+
+/*
+ * Deliver up to a budget's worth of the rx ring within one scheduled
+ * section and give each frame back to the fill ring right away.  The
+ * fill ring is as large as the set of receive frames, so there is
+ * always room.
+ */
+static void *
+receiver(void *arg)
+{
+	struct xdpq *xq = arg;
+	struct virtif_user *viu = xq->xq_viu;
+	struct virtif_stats *vs = &xq->xq_rxstats;
+	struct xdp_desc *desc;
+	struct iovec iov;
+	struct pollfd pfd[2];
+	uint32_t cons, fprod, npkt, i;
+	int prv, polled = 0;
+
+	rumpuser_component_kthread();
+
+	for (;;) {
+		if (vif_runctl_wait(&viu->viu_runctl))
+			break;
+
+		cons = *xq->xq_rx.xr_cons;
+		npkt = XR_LOAD(xq->xq_rx.xr_prod) - cons;
+		if (npkt == 0) {
+			/* woken up for nothing */
+			if (polled)
+				vif_stats_batch(vs, 0);
+			polled = 1;
+			pfd[0].fd = xq->xq_fd;
+			pfd[0].events = POLLIN;
+			pfd[1].fd = vif_runctl_fd(&viu->viu_runctl);
+			pfd[1].events = POLLIN;
+
+			prv = poll(pfd, 2, -1);
+			if (prv < 0 && errno != EINTR && errno != EAGAIN) {
+				fprintf(stderr, "xdpif: poll failed: %s\n",
+				    strerror(errno));
+			}
+			continue;
+		}
+		polled = 0;
+
+		/* the rest waits for the next pass, so others get the cpu */
+		if (npkt > viu->viu_budget)
+			npkt = viu->viu_budget;
+		fprod = *xq->xq_fill.xr_prod;
+		rumpuser_component_schedule(NULL);
+		for (i = 0; i < npkt; i++) {
+			desc = XR_DESC(&xq->xq_rx, cons + i);
+			iov.iov_base = xq->xq_umem + desc->addr;
+			iov.iov_len = desc->len;
+			vs->vs_ipackets++;
+			vs->vs_ibytes += desc->len;
+			VIF_CAPTURE(viu->viu_cap, &iov, 1, 0);
+			VIF_DELIVERPKT(viu->viu_virtifsc, &iov, 1);
+			XR_ADDR(&xq->xq_fill, fprod + i) =
+			    desc->addr & ~(uint64_t)(XDP_FRAMESZ-1);
+		}
+		rumpuser_component_unschedule();
+
+		XR_STORE(xq->xq_rx.xr_cons, cons + npkt);
+		XR_STORE(xq->xq_fill.xr_prod, fprod + npkt);
+		/* the driver may have stopped for want of fill entries */
+		if (XR_LOAD(xq->xq_fill.xr_flags) & XDP_RING_NEED_WAKEUP)
+			(void)recvfrom(xq->xq_fd, NULL, 0, MSG_DONTWAIT,
+			    NULL, NULL);
+		vif_stats_batch(vs, npkt);
+	}
+
+	rumpuser_component_kthread_release();
+	return NULL;
+}
+
+static int
+createq(struct virtif_user *viu, struct xdpq *xq, int idx,
+	const struct xdpif_params *xp, int ifindex)
+{
+	pthread_attr_t attr;
+	char place[sizeof(viu->viu_placement)];
+	int rv;
+
+	xq->xq_viu = viu;
+	xq->xq_idx = idx;
+	xq->xq_fd = -1;
+	if ((rv = openxsk(xp, ifindex, xq)) != 0
+	    || (rv = mapsock(viu, xq)) != 0)
+		return rv;
+
+	pthread_attr_init(&attr);
+	if (vif_placethread(xp->xp_ifname, &xp->xp_cpu,
+	    xp->xp_queues > 1 ? idx : -1, &attr, place, sizeof(place)) != 0) {
+		snprintf(place, sizeof(place), "rx unpinned");
+		pthread_attr_destroy(&attr);
+		pthread_attr_init(&attr);
+	}
+	if (idx == 0) {
+		if (xp->xp_queues > 1 && xp->xp_cpu.vc_first >= 0) {
+			snprintf(viu->viu_placement,
+			    sizeof(viu->viu_placement),
+			    "%d queues, rx cpu %d-%d", xp->xp_queues,
+			    xp->xp_cpu.vc_first, xp->xp_cpu.vc_last);
+		} else if (xp->xp_queues > 1) {
+			snprintf(viu->viu_placement,
+			    sizeof(viu->viu_placement),
+			    "%d queues, %s", xp->xp_queues, place);
+		} else {
+			strcpy(viu->viu_placement, place);
+		}
+	}
+
+	rv = pthread_create(&xq->xq_pt, &attr, receiver, xq);
+	pthread_attr_destroy(&attr);
+	if (rv == 0)
+		xq->xq_ptvalid = 1;
+	return rv;
+}
+
+static void
+closeprog(struct virtif_user *viu)
+{
+
+	if (viu->viu_linkfd != -1)
+		close(viu->viu_linkfd);
+	if (viu->viu_progfd != -1)
+		close(viu->viu_progfd);
+	if (viu->viu_mapfd != -1)
+		close(viu->viu_mapfd);
+	viu->viu_mapfd = viu->viu_progfd = viu->viu_linkfd = -1;
+}
+
+int
+VIFHYPER_CREATE(const char *devstr, struct virtif_sc *vif_sc, uint8_t *enaddr,
+	struct virtif_user **viup)
+{
+	struct virtif_user *viu = NULL;
+	struct xdpif_params xp;
+	void *cookie;
+	int i, ifindex, rv;
+
+	cookie = rumpuser_component_unschedule();
+
+	memset(&xp, 0, sizeof(xp));
+	vif_cpuspec_init(&xp.xp_cpu);
+	vif_capspec_init(&xp.xp_cap);
+	xp.xp_queues = 1;
+	xp.xp_budget = XDP_BUDGET;
+	if ((rv = vif_parselinkstr("xdpif", devstr, xp.xp_ifname,
+	    sizeof(xp.xp_ifname), xdpopt, &xp)) != 0)
+		goto out;
+
+	if ((ifindex = if_nametoindex(xp.xp_ifname)) == 0) {
+		rv = errno;
+		fprintf(stderr, "xdpif: %s: no such interface\n",
+		    xp.xp_ifname);
+		goto out;
+	}
+
+	viu = calloc(1, sizeof(*viu));
+	if (viu == NULL) {
+		rv = errno;
+		goto out;
+	}
+	viu->viu_mapfd = viu->viu_progfd = viu->viu_linkfd = -1;
+	viu->viu_q = calloc(xp.xp_queues, sizeof(*viu->viu_q));
+	if (viu->viu_q == NULL) {
+		rv = errno;
+		free(viu);
+		viu = NULL;
+		goto out;
+	}
+	if ((rv = loadprog(viu, xp.xp_queues)) == EPERM
+	    && raisememlock(xp.xp_ifname) == 0) {
+		closeprog(viu);
+		rv = loadprog(viu, xp.xp_queues);
+	}
+	if (rv != 0) {
+		fprintf(stderr, "xdpif:%s: cannot load XDP program: %s\n",
+		    xp.xp_ifname, strerror(rv));
+		closeprog(viu);
+		free(viu->viu_q);
+		free(viu);
+		viu = NULL;
+		goto out;
+	}
+	if (vif_gethwaddr(xp.xp_ifname, enaddr) != 0) {
+		fprintf(stderr, "xdpif:%s: failed to retrieve "
+		    "MAC address\n", xp.xp_ifname);
+	}
+	if ((rv = vif_runctl_init(&viu->viu_runctl)) != 0) {
+		closeprog(viu);
+		free(viu->viu_q);
+		free(viu);
+		viu = NULL;
+		goto out;
+	}
+	if ((rv = vif_capture_open(&viu->viu_cap, &xp.xp_cap,
+	    xp.xp_ifname)) != 0) {
+		vif_runctl_fini(&viu->viu_runctl);
+		closeprog(viu);
+		free(viu->viu_q);
+		free(viu);
+		viu = NULL;
+		goto out;
+	}
+	viu->viu_virtifsc = vif_sc;
+	viu->viu_budget = xp.xp_budget;
+	strcpy(viu->viu_ifname, xp.xp_ifname);
+
+	for (i = 0; i < xp.xp_queues; i++) {
+		if ((rv = createq(viu, &viu->viu_q[i], i, &xp, ifindex)) != 0)
+			break;
+	}
+	if (rv == 0 && (rv = attachprog(viu, ifindex, xp.xp_xdpflags)) != 0) {
+		fprintf(stderr, "xdpif:%s: cannot attach XDP program: %s\n",
+		    xp.xp_ifname, strerror(rv));
+		i = xp.xp_queues - 1;
+	}
+	if (rv != 0) {
+		vif_runctl_dying(&viu->viu_runctl);
+		for (; i >= 0; i--)
+			destroyq(&viu->viu_q[i]);
+		closeprog(viu);
+		if (viu->viu_cap != NULL)
+			vif_capture_close(viu->viu_cap);
+		vif_runctl_fini(&viu->viu_runctl);
+		free(viu->viu_q);
+		free(viu);
+		viu = NULL;
+		goto out;
+	}
+	viu->viu_nqueues = xp.xp_queues;
+
+ out:
+	rumpuser_component_schedule(cookie);
+
+	*viup = viu;
+	return rumpuser_component_errtrans(rv);
+}
+
+void
+VIFHYPER_INFO(struct virtif_user *viu, char *buf, size_t buflen)
+{
+
+	snprintf(buf, buflen, "%s", viu->viu_placement);
+}
+
+int
+VIFHYPER_FLAGS(struct virtif_user *viu)
+{
+
+	return 0;
+}
+
+/* not implemented for the AF_XDP rings */
+int
+VIFHYPER_COALESCE(struct virtif_user *viu, struct virtif_coalesce *vc,
+	int set)
+{
+
+	return rumpuser_component_errtrans(EOPNOTSUPP);
+}
+
+/*
+ * SEND spreads the frames over the sockets' tx rings itself.  Those
+ * rings take a single producer, which the kernel's one ring lock
+ * provides.
+ */
+int
+VIFHYPER_TXRINGS(struct virtif_user *viu)
+{
+
+	return 1;
+}
+
+/* every queue is reported as a ring */
+int
+VIFHYPER_STATS(struct virtif_user *viu, int ring, struct virtif_stats *vs)
+{
+	int i;
+
+	memset(vs, 0, sizeof(*vs));
+	if (ring >= viu->viu_nqueues)
+		return rumpuser_component_errtrans(ENOENT);
+	for (i = 0; i < viu->viu_nqueues; i++) {
+		if (ring >= 0 && ring != i)
+			continue;
+		vif_stats_add(vs, &viu->viu_q[i].xq_rxstats);
+		vif_stats_add(vs, &viu->viu_q[i].xq_txstats);
+	}
+	return 0;
+}
+
+/* return the frames the host has finished sending to the free list */
+static void
+reclaimtx(struct xdpq *xq)
+{
+	uint32_t cons, n, i;
+
+	cons = *xq->xq_comp.xr_cons;
+	n = XR_LOAD(xq->xq_comp.xr_prod) - cons;
+	for (i = 0; i < n; i++)
+		xq->xq_txfree[xq->xq_ntxfree++] = XR_ADDR(&xq->xq_comp, cons+i);
+	XR_STORE(xq->xq_comp.xr_cons, cons + n);
+}
+
+static void
+kicktx(struct xdpq *xq)
+{
+
+	if (XR_LOAD(xq->xq_tx.xr_flags) & XDP_RING_NEED_WAKEUP)
+		(void)sendto(xq->xq_fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+}
+
+static int
+txqueue(struct virtif_user *viu, const struct iovec *iov, size_t iovcnt)
+{
+
+	if (viu->viu_nqueues == 1)
+		return 0;
+	return (int)(vif_flowhash(iov, iovcnt) % viu->viu_nqueues);
+}
+
+/*
+ * Copy a batch of frames into UMEM frames and queue them on the tx
+ * rings, each frame on the queue its flow hashes to, and kick each
+ * queue used once.  Returns the number of frames queued; the rest
+ * were dropped for lack of frames or ring space.
+ */
+int
+VIFHYPER_SEND(struct virtif_user *viu, int txring, struct iovec *iov,
+	const size_t *iovcnt, size_t npkt)
+{
+	void *cookie = NULL; /* XXXgcc */
+	struct xdpq *xq;
+	struct xdp_desc *desc;
+	struct pollfd pfd;
+	uint32_t prod, used = 0;
+	uint8_t *p;
+	size_t pkt, sent = 0, i, n, totlen;
+	int q, retries, unscheduled = 0;
+
+	for (pkt = 0; pkt < npkt; iov += iovcnt[pkt], pkt++) {
+		q = txqueue(viu, iov, iovcnt[pkt]);
+		xq = &viu->viu_q[q];
+
+		for (retries = 10; retries > 0; retries--) {
+			prod = *xq->xq_tx.xr_prod;
+			if (xq->xq_ntxfree == 0)
+				reclaimtx(xq);
+			if (xq->xq_ntxfree > 0
+			    && prod - XR_LOAD(xq->xq_tx.xr_cons) < XDP_RINGSZ)
+				break;
+
+			if (!unscheduled) {
+				cookie = rumpuser_component_unschedule();
+				unscheduled = 1;
+			}
+			(void)sendto(xq->xq_fd, NULL, 0, MSG_DONTWAIT,
+			    NULL, 0);
+			pfd.fd = xq->xq_fd;
+			pfd.events = POLLOUT;
+			(void)poll(&pfd, 1, 500 /* ms */);
+		}
+		if (retries == 0)
+			break;
+
+		desc = XR_DESC(&xq->xq_tx, prod);
+		desc->addr = xq->xq_txfree[--xq->xq_ntxfree];
+		p = xq->xq_umem + desc->addr;
+		for (i = 0, totlen = 0;
+		    totlen < XDP_FRAMESZ && i < iovcnt[pkt]; i++) {
+			n = iov[i].iov_len;
+			if (totlen + n > XDP_FRAMESZ) {
+				n = XDP_FRAMESZ - totlen;
+				xq->xq_txstats.vs_otruncated++;
+			}
+			memcpy(p + totlen, iov[i].iov_base, n);
+			totlen += n;
+		}
+		desc->len = totlen;
+		desc->options = 0;
+		XR_STORE(xq->xq_tx.xr_prod, prod + 1);
+		used |= 1U << q;
+		VIF_CAPTURE(viu->viu_cap, iov, iovcnt[pkt], 1);
+
+		xq->xq_txstats.vs_opackets++;
+		xq->xq_txstats.vs_obytes += totlen;
+		sent++;
+	}
+
+	/* the rest is dropped, each frame on the queue it was meant for */
+	for (; pkt < npkt; iov += iovcnt[pkt], pkt++) {
+		q = txqueue(viu, iov, iovcnt[pkt]);
+		viu->viu_q[q].xq_txstats.vs_drops[VIFSTAT_DROP_TXFULL]++;
+	}
+
+	for (q = 0; used; q++, used >>= 1) {
+		if (used & 1)
+			kicktx(&viu->viu_q[q]);
+	}
+
+	if (unscheduled)
+		rumpuser_component_schedule(cookie);
+	return (int)sent;
+}
+
+void
+VIFHYPER_START(struct virtif_user *viu)
+{
+
+	vif_runctl_start(&viu->viu_runctl);
+}
+
+void
+VIFHYPER_STOP(struct virtif_user *viu)
+{
+
+	vif_runctl_stop(&viu->viu_runctl);
+}
+
+void
+VIFHYPER_DYING(struct virtif_user *viu)
+{
+
+	vif_runctl_dying(&viu->viu_runctl);
+}
+
+void
+VIFHYPER_DESTROY(struct virtif_user *viu)
+{
+	void *cookie = rumpuser_component_unschedule();
+	int i;
+
+	/* detach first so that the host stops redirecting to us */
+	closeprog(viu);
+	for (i = 0; i < viu->viu_nqueues; i++)
+		destroyq(&viu->viu_q[i]);
+	if (viu->viu_cap != NULL)
+		vif_capture_close(viu->viu_cap);
+	vif_runctl_fini(&viu->viu_runctl);
+	free(viu->viu_q);
+	free(viu);
+
+	rumpuser_component_schedule(cookie);
+}